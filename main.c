@@ -7,9 +7,18 @@
 #include <shlobj.h>
 #include <shobjidl.h>
 #include <commctrl.h>
+#include <windowsx.h>
 #include <dwmapi.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wchar.h>
+#include <wctype.h>
+#if defined(_MSC_VER) && defined(_DEBUG)
+#include <crtdbg.h>
+#endif
 
 #pragma comment(lib, "user32.lib")
 #pragma comment(lib, "shell32.lib")
@@ -30,10 +39,10 @@
 
 #pragma comment(linker, "/manifestdependency:\"type='win32' name='Microsoft.Windows.Common-Controls' version='6.0.0.0' processorArchitecture='*' publicKeyToken='6595b64144ccf1df' language='*'\"")
 
-#define MAX_ITEMS 256
+// Layout sizes are at 96 DPI and scaled with ScaleForDpi
 #define ICON_SIZE 32
+#define ICON_MASTER_SIZE 64     // Largest icon level (200%), kept by the icon cache
 #define ICON_PADDING 8
-#define ICON_CELL_SIZE (ICON_SIZE + ICON_PADDING * 2)
 #define HEADER_HEIGHT 36
 #define STATUS_HEIGHT 24
 #define WINDOW_WIDTH 320
@@ -42,6 +51,8 @@
 #define IDC_LISTVIEW 1001
 #define ID_TIMER_FADE 1
 #define ID_TIMER_CLICK_ANIM 2
+#define ID_TIMER_REFRESH 3
+#define ID_TIMER_LAUNCH_WATCHDOG 4
 #define CLICK_ANIM_DURATION_MS 2000
 #define CLICK_ANIM_INTERVAL_MS 200
 
@@ -49,19 +60,57 @@
 #define IDM_REGISTER_CONTEXT_MENU 2002
 #define IDM_UNREGISTER_CONTEXT_MENU 2003
 
-typedef struct FolderEntry {
-    WCHAR szName[MAX_PATH];
-    WCHAR szPath[MAX_PATH];
-    BOOL bIsDirectory;
-    int nIconIndex;
-} FolderEntry;
+#define ITEM_FLAG_DIRECTORY 0x01
+#define ITEM_FLAG_ICON_PENDING 0x02
+
+#define ITEM_NO_TARGET MAXDWORD
+
+// Sort modes (--sort)
+#define SORT_FOLDERS_FIRST 0    // Folders, then files; natural order within each
+#define SORT_NATURAL 1          // Natural order, folders and files mixed
+#define SORT_PLAIN 2            // Case-insensitive code unit order, mixed
+#define SORT_FRECENCY 3         // Most used first, then folders-first order
+
+#define RECURSIVE_MAX_DEPTH 16  // --recursive without a depth
+
+// Folder items. Full paths live back to back in one string arena (so paths
+// longer than MAX_PATH cost nothing extra); each item's name is the tail of
+// its path. Per-item fields are kept as parallel arrays indexed by item.
+typedef struct ItemStore {
+    WCHAR* arena;
+    SIZE_T arenaLength;
+    SIZE_T arenaCapacity;
+
+    // Collation keys, built once per item by ItemStoreAdd so that sorting
+    // is a byte compare rather than a case-folding string compare
+    BYTE* keyArena;
+    SIZE_T keyArenaLength;
+    SIZE_T keyArenaCapacity;
+    int sortMode;           // Mode the keys were built for
+    SIZE_T rootLength;      // Set for recursive listings: keys group by subfolder
+
+    DWORD* pathOffset;
+    WORD* nameStart;        // Offset of the name within the path
+    DWORD* keyOffset;
+    WORD* keySize;
+    DWORD* targetOffset;    // Resolved shortcut target in the arena, or ITEM_NO_TARGET
+    BYTE* flags;
+    int* iconIndex;
+    int count;
+    int capacity;
+} ItemStore;
 
 static WCHAR g_folderPath[MAX_PATH] = {0};
 static WCHAR g_folderName[MAX_PATH] = {0};
-static FolderEntry g_items[MAX_ITEMS];
-static int g_itemCount = 0;
+static ItemStore g_store;
+static int g_sortMode = SORT_FOLDERS_FIRST;
+static int g_recursiveDepth = 0;    // Subfolder levels to flatten (--recursive)
+static BOOL g_prefetchEnabled = FALSE;  // Read ahead likely launches (--prefetch)
+static WCHAR* g_ruleText = NULL;        // --include / --exclude, one rule per line
 static BOOL g_isDarkMode = FALSE;
 static HIMAGELIST g_imageList = NULL;
+static UINT g_dpi = USER_DEFAULT_SCREEN_DPI;   // Of the monitor the popup is on
+static int g_iconSize = ICON_SIZE;              // Icon level for g_dpi, see IconSizeForDpi
 static HWND g_hwndMain = NULL;
 static HWND g_hwndListView = NULL;
 static HWND g_hwndTooltip = NULL;
@@ -83,6 +132,470 @@ static COLORREF g_hoverBgColor;
 
 static WCHAR g_exePath[MAX_PATH] = {0};
 
+// Startup tracing (--trace <file>). Spans are QueryPerformanceCounter
+// intervals appended to a fixed buffer with one interlocked increment, so
+// worker threads can record without locking. The buffer is only allocated
+// when tracing is on; otherwise TraceBegin returns 0 and TraceEnd returns
+// on its first test. Counters (such as cache hit rates) are
+// recorded the same way, as events without a duration, so diagnostics cost
+// nothing unless --trace is given. The events are written as Chrome
+// trace-event JSON (chrome://tracing, Perfetto) when the process exits.
+// Writing closes the buffer to new events but never frees it, since a
+// worker the exit did not wait for may still be finishing one.
+#define TRACE_MAX_EVENTS 65536
+#define TRACE_MAX_ARGS 2
+#define TRACE_COUNTER (-1)          // duration of a counter event
+
+typedef struct TraceEvent {
+    const char* name;       // Static string; set last, NULL until the event is complete
+    LONGLONG start;
+    LONGLONG duration;      // Or TRACE_COUNTER
+    DWORD threadId;
+    const char* argNames[TRACE_MAX_ARGS];  // Static strings, or NULL
+    LONGLONG args[TRACE_MAX_ARGS];
+} TraceEvent;
+
+static TraceEvent* g_traceEvents = NULL;
+static volatile LONG g_traceCount = 0;
+static LONGLONG g_traceBase = 0;
+static LONGLONG g_traceFrequency = 1;
+static WCHAR g_tracePath[MAX_PATH] = {0};
+
+static void TraceInit(const WCHAR* path) {
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+
+    g_traceEvents = calloc(TRACE_MAX_EVENTS, sizeof(TraceEvent));
+    if (!g_traceEvents) return;
+    g_traceFrequency = frequency.QuadPart;
+    g_traceBase = now.QuadPart;
+    wcscpy_s(g_tracePath, MAX_PATH, path);
+}
+
+static LONGLONG TraceBegin(void) {
+    if (!g_traceEvents) return 0;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static void TraceRecord(const char* name, LONGLONG start, LONGLONG duration,
+                        const char* argName0, LONGLONG arg0, const char* argName1, LONGLONG arg1) {
+    LONG index = InterlockedIncrement(&g_traceCount) - 1;
+    if (index >= TRACE_MAX_EVENTS) return;
+
+    TraceEvent* event = &g_traceEvents[index];
+    event->start = start;
+    event->duration = duration;
+    event->threadId = GetCurrentThreadId();
+    event->argNames[0] = argName0;
+    event->args[0] = arg0;
+    event->argNames[1] = argName1;
+    event->args[1] = arg1;
+    InterlockedExchangePointer((void* volatile*)&event->name, (void*)name);
+}
+
+// Ends a span begun with TraceBegin, with up to two named values
+static void TraceEndArgs(const char* name, LONGLONG start, const char* argName0, LONGLONG arg0,
+                         const char* argName1, LONGLONG arg1) {
+    if (!start) return;
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    TraceRecord(name, start, now.QuadPart - start, argName0, arg0, argName1, arg1);
+}
+
+// Per-item spans carry the item index
+static void TraceEndArg(const char* name, LONGLONG start, int item) {
+    TraceEndArgs(name, start, "item", item, NULL, 0);
+}
+
+static void TraceEnd(const char* name, LONGLONG start) {
+    TraceEndArgs(name, start, NULL, 0, NULL, 0);
+}
+
+// A span measured elsewhere, in QueryPerformanceCounter ticks
+static void TraceSpan(const char* name, LONGLONG start, LONGLONG end, const char* argName, LONGLONG arg) {
+    if (!g_traceEvents || !start || end < start) return;
+    TraceRecord(name, start, end - start, argName, arg, NULL, 0);
+}
+
+static void TraceCounter(const char* name, const char* argName0, LONGLONG arg0,
+                         const char* argName1, LONGLONG arg1) {
+    LONGLONG now = TraceBegin();
+    if (!now) return;
+    TraceRecord(name, now, TRACE_COUNTER, argName0, arg0, argName1, arg1);
+}
+
+static void TraceWrite(void) {
+    if (!g_traceEvents) return;
+
+    // Spans that end from here on find the buffer full
+    LONG count = min(InterlockedExchange(&g_traceCount, TRACE_MAX_EVENTS), TRACE_MAX_EVENTS);
+
+    FILE* file = NULL;
+    if (_wfopen_s(&file, g_tracePath, L"w") == 0 && file) {
+        DWORD processId = GetCurrentProcessId();
+        int written = 0;
+
+        fprintf(file, "{\"traceEvents\":[\n");
+        for (LONG i = 0; i < count; i++) {
+            const TraceEvent* event = &g_traceEvents[i];
+            if (!event->name) continue;  // Slot claimed but never filled
+
+            double ts = (double)(event->start - g_traceBase) * 1000000.0 / g_traceFrequency;
+            fprintf(file, "%s{\"name\":\"%s\",\"ts\":%.3f,\"pid\":%lu,\"tid\":%lu",
+                    written++ ? ",\n" : "", event->name, ts, processId, event->threadId);
+            if (event->duration == TRACE_COUNTER) {
+                fprintf(file, ",\"ph\":\"C\"");
+            } else {
+                double dur = (double)event->duration * 1000000.0 / g_traceFrequency;
+                fprintf(file, ",\"ph\":\"X\",\"dur\":%.3f", dur);
+            }
+            for (int a = 0; a < TRACE_MAX_ARGS && event->argNames[a]; a++) {
+                fprintf(file, "%s\"%s\":%lld", a ? "," : ",\"args\":{", event->argNames[a], event->args[a]);
+            }
+            fprintf(file, "%s}", event->argNames[0] ? "}" : "");
+        }
+        fprintf(file, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(file);
+    }
+}
+
+static const WCHAR* ItemPath(int index) {
+    return g_store.arena + g_store.pathOffset[index];
+}
+
+static const WCHAR* ItemName(int index) {
+    return ItemPath(index) + g_store.nameStart[index];
+}
+
+// Name below the listed folder: the path relative to the root in recursive
+// listings, else just the name
+static const WCHAR* ItemRelativePath(int index) {
+    return g_store.rootLength ? ItemPath(index) + g_store.rootLength + 1 : ItemName(index);
+}
+
+static BOOL ItemIsDirectory(int index) {
+    return (g_store.flags[index] & ITEM_FLAG_DIRECTORY) != 0;
+}
+
+// Builds the collation key for a name: each code unit case-folded and
+// stored big-endian, so memcmp orders keys the way _wcsicmp orders names.
+// In natural modes a run of ASCII digits becomes the '0' code unit, the
+// count of significant digits and then the digits, so "App2" < "App10" and
+// numbers still sort where digits would. A path separator (only seen in
+// subfolder groups) becomes 00 01, below every character. Keys longer than
+// maxBytes are truncated (ties fall back to item order).
+#define SORT_KEY_MAX_BYTES_PER_CHAR 5   // One digit: marker, count, digit
+
+static int AppendSortKey(const WCHAR* text, const WCHAR* end, int mode, BYTE* key, int length, int maxBytes) {
+    while (text < end && length + SORT_KEY_MAX_BYTES_PER_CHAR <= maxBytes) {
+        if (mode != SORT_PLAIN && *text >= L'0' && *text <= L'9') {
+            while (*text == L'0' && text + 1 < end && text[1] >= L'0' && text[1] <= L'9') text++;
+            const WCHAR* digits = text;
+            while (text < end && *text >= L'0' && *text <= L'9') text++;
+            int digitCount = (int)min(text - digits, maxBytes - length - 4);
+
+            key[length++] = 0;
+            key[length++] = '0';
+            key[length++] = (BYTE)(digitCount >> 8);
+            key[length++] = (BYTE)digitCount;
+            for (int i = 0; i < digitCount; i++) key[length++] = (BYTE)digits[i];
+            continue;
+        }
+
+        WCHAR folded = (*text == L'\\') ? 1 : towlower(*text);
+        text++;
+        key[length++] = (BYTE)(folded >> 8);
+        key[length++] = (BYTE)folded;
+    }
+    return length;
+}
+
+// Key for the item at path, whose folder part is folderLength characters.
+// Stores with a rootLength (recursive listings) are grouped by subfolder:
+// top-level items get a leading 0, the rest a 1, the subfolder path
+// relative to the root and a 00 00 terminator ahead of the name.
+static int BuildSortKey(const ItemStore* store, const WCHAR* path, SIZE_T folderLength, int mode,
+                        BYTE* key, int maxBytes) {
+    const WCHAR* name = path + folderLength + 1;
+    int length = 0;
+
+    if (store->rootLength && maxBytes >= 3) {
+        if (folderLength > store->rootLength + 1) {
+            key[length++] = 1;
+            length = AppendSortKey(path + store->rootLength + 1, path + folderLength, mode, key, length, maxBytes - 2);
+            key[length++] = 0;
+            key[length++] = 0;
+        } else {
+            key[length++] = 0;
+        }
+    }
+    return AppendSortKey(name, name + wcslen(name), mode, key, length, maxBytes);
+}
+
+static void ItemStoreReset(ItemStore* store) {
+    store->arenaLength = 0;
+    store->keyArenaLength = 0;
+    store->sortMode = g_sortMode;
+    store->count = 0;
+}
+
+static BOOL ItemStoreGrowArena(ItemStore* store, SIZE_T chars) {
+    if (store->arenaLength + chars > store->arenaCapacity) {
+        SIZE_T newCapacity = store->arenaCapacity ? store->arenaCapacity * 2 : 16384;
+        while (newCapacity < store->arenaLength + chars) newCapacity *= 2;
+        if (newCapacity >= MAXDWORD) return FALSE;
+        WCHAR* arena = realloc(store->arena, newCapacity * sizeof(WCHAR));
+        if (!arena) return FALSE;
+        store->arena = arena;
+        store->arenaCapacity = newCapacity;
+    }
+    return TRUE;
+}
+
+static BOOL ItemStoreReserve(ItemStore* store, int count, SIZE_T chars) {
+    if (!ItemStoreGrowArena(store, chars)) return FALSE;
+
+    SIZE_T keyBytes = min(chars * SORT_KEY_MAX_BYTES_PER_CHAR, 0xFFFF);
+    if (store->keyArenaLength + keyBytes > store->keyArenaCapacity) {
+        SIZE_T newCapacity = store->keyArenaCapacity ? store->keyArenaCapacity * 2 : 16384;
+        while (newCapacity < store->keyArenaLength + keyBytes) newCapacity *= 2;
+        if (newCapacity > MAXDWORD) return FALSE;
+        BYTE* keyArena = realloc(store->keyArena, newCapacity);
+        if (!keyArena) return FALSE;
+        store->keyArena = keyArena;
+        store->keyArenaCapacity = newCapacity;
+    }
+
+    if (count > store->capacity) {
+        int newCapacity = store->capacity ? store->capacity * 2 : 256;
+        while (newCapacity < count) newCapacity *= 2;
+        DWORD* pathOffset = realloc(store->pathOffset, newCapacity * sizeof(DWORD));
+        if (pathOffset) store->pathOffset = pathOffset;
+        WORD* nameStart = realloc(store->nameStart, newCapacity * sizeof(WORD));
+        if (nameStart) store->nameStart = nameStart;
+        DWORD* keyOffset = realloc(store->keyOffset, newCapacity * sizeof(DWORD));
+        if (keyOffset) store->keyOffset = keyOffset;
+        WORD* keySize = realloc(store->keySize, newCapacity * sizeof(WORD));
+        if (keySize) store->keySize = keySize;
+        DWORD* targetOffset = realloc(store->targetOffset, newCapacity * sizeof(DWORD));
+        if (targetOffset) store->targetOffset = targetOffset;
+        BYTE* flags = realloc(store->flags, newCapacity * sizeof(BYTE));
+        if (flags) store->flags = flags;
+        int* iconIndex = realloc(store->iconIndex, newCapacity * sizeof(int));
+        if (iconIndex) store->iconIndex = iconIndex;
+        if (!pathOffset || !nameStart || !keyOffset || !keySize || !targetOffset || !flags || !iconIndex) return FALSE;
+        store->capacity = newCapacity;
+    }
+    return TRUE;
+}
+
+// Appends "<folder>\<name>" to the store, given both lengths; name need not
+// be terminated. Returns the new index, or -1 when out of memory.
+static int ItemStoreAddName(ItemStore* store, const WCHAR* folder, SIZE_T folderLength, const WCHAR* name,
+                            SIZE_T nameLength, BYTE flags, int iconIndex) {
+    if (folderLength + 1 > 0xFFFF) return -1;
+
+    SIZE_T chars = folderLength + 1 + nameLength + 1;
+    if (!ItemStoreReserve(store, store->count + 1, chars)) return -1;
+
+    int index = store->count++;
+    WCHAR* path = store->arena + store->arenaLength;
+    wmemcpy(path, folder, folderLength);
+    path[folderLength] = L'\\';
+    wmemcpy(path + folderLength + 1, name, nameLength);
+    path[folderLength + 1 + nameLength] = L'\0';
+
+    store->pathOffset[index] = (DWORD)store->arenaLength;
+    store->nameStart[index] = (WORD)(folderLength + 1);
+    store->targetOffset[index] = ITEM_NO_TARGET;
+    store->flags[index] = flags;
+    store->iconIndex[index] = iconIndex;
+    store->arenaLength += chars;
+
+    SIZE_T keyBytes = min(chars * SORT_KEY_MAX_BYTES_PER_CHAR, 0xFFFF);
+    store->keyOffset[index] = (DWORD)store->keyArenaLength;
+    store->keySize[index] = (WORD)BuildSortKey(store, path, folderLength, store->sortMode,
+                                               store->keyArena + store->keyArenaLength, (int)keyBytes);
+    store->keyArenaLength += store->keySize[index];
+    return index;
+}
+
+static int ItemStoreAdd(ItemStore* store, const WCHAR* folder, const WCHAR* name, BYTE flags, int iconIndex) {
+    return ItemStoreAddName(store, folder, wcslen(folder), name, wcslen(name), flags, iconIndex);
+}
+
+// Records the resolved target of a shortcut item, so the icon loader can
+// skip parsing the .lnk.
+static BOOL ItemStoreSetTarget(ItemStore* store, int index, const WCHAR* target) {
+    SIZE_T chars = wcslen(target) + 1;
+    if (!ItemStoreGrowArena(store, chars)) return FALSE;
+
+    wmemcpy(store->arena + store->arenaLength, target, chars);
+    store->targetOffset[index] = (DWORD)store->arenaLength;
+    store->arenaLength += chars;
+    return TRUE;
+}
+
+// Copies item index of src, key included, to the end of dst. Both stores
+// must have been built with the same root and sort mode.
+static int ItemStoreAppend(ItemStore* dst, const ItemStore* src, int index) {
+    const WCHAR* path = src->arena + src->pathOffset[index];
+    SIZE_T chars = wcslen(path) + 1;
+    WORD keySize = src->keySize[index];
+    if (!ItemStoreReserve(dst, dst->count + 1, chars)) return -1;
+
+    int added = dst->count++;
+    wmemcpy(dst->arena + dst->arenaLength, path, chars);
+    memcpy(dst->keyArena + dst->keyArenaLength, src->keyArena + src->keyOffset[index], keySize);
+    dst->pathOffset[added] = (DWORD)dst->arenaLength;
+    dst->nameStart[added] = src->nameStart[index];
+    dst->keyOffset[added] = (DWORD)dst->keyArenaLength;
+    dst->keySize[added] = keySize;
+    dst->targetOffset[added] = ITEM_NO_TARGET;
+    dst->flags[added] = src->flags[index];
+    dst->iconIndex[added] = src->iconIndex[index];
+    dst->arenaLength += chars;
+    dst->keyArenaLength += keySize;
+
+    if (src->targetOffset[index] != ITEM_NO_TARGET &&
+        !ItemStoreSetTarget(dst, added, src->arena + src->targetOffset[index])) {
+        dst->count--;
+        return -1;
+    }
+    return added;
+}
+
+static void ItemStoreRemove(ItemStore* store, int index) {
+    int tail = store->count - index - 1;
+    memmove(store->pathOffset + index, store->pathOffset + index + 1, tail * sizeof(DWORD));
+    memmove(store->nameStart + index, store->nameStart + index + 1, tail * sizeof(WORD));
+    memmove(store->keyOffset + index, store->keyOffset + index + 1, tail * sizeof(DWORD));
+    memmove(store->keySize + index, store->keySize + index + 1, tail * sizeof(WORD));
+    memmove(store->targetOffset + index, store->targetOffset + index + 1, tail * sizeof(DWORD));
+    memmove(store->flags + index, store->flags + index + 1, tail * sizeof(BYTE));
+    memmove(store->iconIndex + index, store->iconIndex + index + 1, tail * sizeof(int));
+    store->count--;
+}
+
+// Points an existing item at a new name. The old path stays in the arena as
+// garbage until the next full load resets it.
+static BOOL ItemStoreRename(ItemStore* store, int index, const WCHAR* folder, const WCHAR* name) {
+    BYTE flags = store->flags[index];
+    int iconIndex = store->iconIndex[index];
+    int added = ItemStoreAdd(store, folder, name, flags, iconIndex);
+    if (added < 0) return FALSE;
+
+    store->pathOffset[index] = store->pathOffset[added];
+    store->nameStart[index] = store->nameStart[added];
+    store->keyOffset[index] = store->keyOffset[added];
+    store->keySize[index] = store->keySize[added];
+    store->targetOffset[index] = ITEM_NO_TARGET;
+    store->count--;
+    return TRUE;
+}
+
+static int ItemStoreFind(const ItemStore* store, const WCHAR* name) {
+    for (int i = 0; i < store->count; i++) {
+        const WCHAR* path = store->arena + store->pathOffset[i];
+        if (_wcsicmp(path + store->nameStart[i], name) == 0) return i;
+    }
+    return -1;
+}
+
+// Reorders the per-item arrays so that item i becomes order[i]. The arenas
+// are left as is; only the offsets move.
+static BOOL ItemStorePermute(ItemStore* store, const int* order) {
+    int count = store->count;
+    DWORD* pathOffset = malloc(count * sizeof(DWORD));
+    WORD* nameStart = malloc(count * sizeof(WORD));
+    DWORD* keyOffset = malloc(count * sizeof(DWORD));
+    WORD* keySize = malloc(count * sizeof(WORD));
+    DWORD* targetOffset = malloc(count * sizeof(DWORD));
+    BYTE* flags = malloc(count * sizeof(BYTE));
+    int* iconIndex = malloc(count * sizeof(int));
+    if (!pathOffset || !nameStart || !keyOffset || !keySize || !targetOffset || !flags || !iconIndex) {
+        free(pathOffset);
+        free(nameStart);
+        free(keyOffset);
+        free(keySize);
+        free(targetOffset);
+        free(flags);
+        free(iconIndex);
+        return FALSE;
+    }
+
+    for (int i = 0; i < count; i++) {
+        pathOffset[i] = store->pathOffset[order[i]];
+        nameStart[i] = store->nameStart[order[i]];
+        keyOffset[i] = store->keyOffset[order[i]];
+        keySize[i] = store->keySize[order[i]];
+        targetOffset[i] = store->targetOffset[order[i]];
+        flags[i] = store->flags[order[i]];
+        iconIndex[i] = store->iconIndex[order[i]];
+    }
+
+    free(store->pathOffset);
+    free(store->nameStart);
+    free(store->keyOffset);
+    free(store->keySize);
+    free(store->targetOffset);
+    free(store->flags);
+    free(store->iconIndex);
+    store->pathOffset = pathOffset;
+    store->nameStart = nameStart;
+    store->keyOffset = keyOffset;
+    store->keySize = keySize;
+    store->targetOffset = targetOffset;
+    store->flags = flags;
+    store->iconIndex = iconIndex;
+    store->capacity = count;
+    return TRUE;
+}
+
+// Rebuilds every key for the current sort mode, e.g. when a resident model
+// built under one --sort is reused under another.
+static BOOL ItemStoreRebuildKeys(ItemStore* store) {
+    SIZE_T keyBytes = 0;
+    for (int i = 0; i < store->count; i++) {
+        keyBytes += min((wcslen(store->arena + store->pathOffset[i]) + 1) * SORT_KEY_MAX_BYTES_PER_CHAR, 0xFFFF);
+    }
+    BYTE* keyArena = malloc(max(keyBytes, 1));
+    if (!keyArena) return FALSE;
+
+    SIZE_T length = 0;
+    for (int i = 0; i < store->count; i++) {
+        const WCHAR* path = store->arena + store->pathOffset[i];
+        SIZE_T maxBytes = min((wcslen(path) + 1) * SORT_KEY_MAX_BYTES_PER_CHAR, 0xFFFF);
+        store->keyOffset[i] = (DWORD)length;
+        store->keySize[i] = (WORD)BuildSortKey(store, path, store->nameStart[i] - 1, g_sortMode,
+                                               keyArena + length, (int)maxBytes);
+        length += store->keySize[i];
+    }
+
+    free(store->keyArena);
+    store->keyArena = keyArena;
+    store->keyArenaLength = length;
+    store->keyArenaCapacity = max(keyBytes, 1);
+    store->sortMode = g_sortMode;
+    return TRUE;
+}
+
+static void FreeItemStore(ItemStore* store) {
+    free(store->arena);
+    free(store->pathOffset);
+    free(store->nameStart);
+    free(store->keyArena);
+    free(store->keyOffset);
+    free(store->keySize);
+    free(store->targetOffset);
+    free(store->flags);
+    free(store->iconIndex);
+    ZeroMemory(store, sizeof(*store));
+}
+
 static void GetExePath(void) {
     GetModuleFileNameW(NULL, g_exePath, MAX_PATH);
 }
@@ -112,6 +625,32 @@ static void ShowNotification(const WCHAR* title, const WCHAR* message, BOOL isEr
     DestroyWindow(hwndNotify);
 }
 
+// Console output for the command-line modes (--bench, --add-to-taskbar-batch).
+// FolderIcon is a GUI-subsystem program, so without a redirected stdout the
+// text goes to the console it was started from.
+static HANDLE g_consoleOutput = NULL;
+
+static void OpenConsoleOutput(void) {
+    g_consoleOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+    if (!g_consoleOutput || g_consoleOutput == INVALID_HANDLE_VALUE) {
+        // GUI subsystem: borrow the console we were started from
+        if (AttachConsole(ATTACH_PARENT_PROCESS) || AllocConsole()) {
+            g_consoleOutput = CreateFileW(L"CONOUT$", GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+        }
+    }
+}
+
+static void ConsolePrint(const char* format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int length = vsprintf_s(line, sizeof(line), format, args);
+    va_end(args);
+
+    DWORD written;
+    if (length > 0) WriteFile(g_consoleOutput, line, (DWORD)length, &written, NULL);
+}
+
 static BOOL IsRunningAsAdmin(void) {
     BOOL isAdmin = FALSE;
     PSID adminGroup = NULL;
@@ -234,134 +773,269 @@ static BOOL UnregisterContextMenu(void) {
     return success;
 }
 
-static BOOL GetFolderIconLocation(const WCHAR* folderPath, WCHAR* iconPath, int* iconIndex) {
-    // First, check desktop.ini for custom icon
-    WCHAR iniPath[MAX_PATH];
-    swprintf_s(iniPath, MAX_PATH, L"%s\\desktop.ini", folderPath);
+// desktop.ini, read in one pass. The file is scanned in place in whatever
+// encoding it has (UTF-16LE or UTF-8 with a BOM, otherwise the ANSI code
+// page, as GetPrivateProfileString reads it); the keys GetFolderIconLocation
+// needs are kept as spans and only the winning value is converted. As with
+// the profile API, the first occurrence of a section or key wins, names
+// match case-insensitively, and whitespace and one pair of quotes around a
+// value are dropped.
+#define INI_ANSI 0
+#define INI_UTF8 1
+#define INI_UTF16 2
+#define DESKTOP_INI_MAX_SIZE (1024 * 1024)
+
+typedef struct IniSpan {
+    DWORD start;            // In code units
+    DWORD length;
+} IniSpan;
+
+typedef struct DesktopIni {
+    const BYTE* data;
+    DWORD units;
+    int encoding;
+    IniSpan viewStateResource;  // [ViewState] IconResource
+    IniSpan classInfoResource;  // [.ShellClassInfo] IconResource
+    IniSpan iconFile;           // [.ShellClassInfo] IconFile
+    IniSpan iconIndex;          // [.ShellClassInfo] IconIndex
+} DesktopIni;
+
+static unsigned IniUnit(const DesktopIni* ini, DWORD i) {
+    if (ini->encoding == INI_UTF16) return ini->data[i * 2] | (ini->data[i * 2 + 1] << 8);
+    return ini->data[i];
+}
 
-    // Try IconResource first (Windows Vista+)
-    WCHAR iconResource[MAX_PATH] = {0};
-    GetPrivateProfileStringW(L"ViewState", L"IconResource", L"",
-                             iconResource, MAX_PATH, iniPath);
+static BOOL IniSpanEquals(const DesktopIni* ini, IniSpan span, const char* name) {
+    for (DWORD i = 0; i < span.length; i++) {
+        unsigned c = IniUnit(ini, span.start + i);
+        if (!name[i] || c >= 0x80 || towlower((wint_t)c) != towlower((unsigned char)name[i])) return FALSE;
+    }
+    return name[span.length] == 0;
+}
 
-    if (!iconResource[0]) {
-        // Try .ShellClassInfo section
-        GetPrivateProfileStringW(L".ShellClassInfo", L"IconResource", L"",
-                                 iconResource, MAX_PATH, iniPath);
+static IniSpan IniTrim(const DesktopIni* ini, DWORD start, DWORD end) {
+    while (start < end && (IniUnit(ini, start) == ' ' || IniUnit(ini, start) == '\t')) start++;
+    while (end > start && (IniUnit(ini, end - 1) == ' ' || IniUnit(ini, end - 1) == '\t')) end--;
+    if (end - start >= 2 && IniUnit(ini, start) == '"' && IniUnit(ini, end - 1) == '"') {
+        start++;
+        end--;
     }
+    IniSpan span = { start, end - start };
+    return span;
+}
 
-    if (iconResource[0]) {
-        // Parse IconResource format: "path,index" or just "path"
-        WCHAR* comma = wcsrchr(iconResource, L',');
-        if (comma) {
-            *comma = L'\0';
-            *iconIndex = _wtoi(comma + 1);
-        } else {
-            *iconIndex = 0;
-        }
+static void ParseDesktopIni(const BYTE* data, DWORD size, DesktopIni* ini) {
+    ZeroMemory(ini, sizeof(*ini));
+    ini->data = data;
+    if (size >= 2 && data[0] == 0xFF && data[1] == 0xFE) {
+        ini->encoding = INI_UTF16;
+        ini->units = size / 2;
+    } else {
+        ini->encoding = size >= 3 && data[0] == 0xEF && data[1] == 0xBB && data[2] == 0xBF ? INI_UTF8 : INI_ANSI;
+        ini->units = size;
+    }
 
-        // Handle relative paths
-        if (iconResource[0] != L'\\' && iconResource[1] != L':') {
-            WCHAR fullPath[MAX_PATH];
-            swprintf_s(fullPath, MAX_PATH, L"%s\\%s", folderPath, iconResource);
-            wcscpy_s(iconPath, MAX_PATH, fullPath);
-        } else {
-            wcscpy_s(iconPath, MAX_PATH, iconResource);
+    enum { SECTION_OTHER, SECTION_VIEW_STATE, SECTION_CLASS_INFO } section = SECTION_OTHER;
+    BOOL seenViewState = FALSE, seenClassInfo = FALSE;
+    DWORD i = ini->encoding == INI_UTF16 ? 1 : ini->encoding == INI_UTF8 ? 3 : 0;
+    while (i < ini->units) {
+        DWORD lineStart = i;
+        while (i < ini->units && IniUnit(ini, i) != '\n' && IniUnit(ini, i) != '\r') i++;
+        IniSpan line = IniTrim(ini, lineStart, i);
+        while (i < ini->units && (IniUnit(ini, i) == '\n' || IniUnit(ini, i) == '\r')) i++;
+        if (line.length == 0) continue;
+
+        unsigned first = IniUnit(ini, line.start);
+        if (first == '[') {
+            DWORD close = line.start + 1;
+            while (close < line.start + line.length && IniUnit(ini, close) != ']') close++;
+            IniSpan name = IniTrim(ini, line.start + 1, close);
+            // Later sections with the same name are ignored
+            section = SECTION_OTHER;
+            if (IniSpanEquals(ini, name, "ViewState") && !seenViewState) {
+                section = SECTION_VIEW_STATE;
+                seenViewState = TRUE;
+            } else if (IniSpanEquals(ini, name, ".ShellClassInfo") && !seenClassInfo) {
+                section = SECTION_CLASS_INFO;
+                seenClassInfo = TRUE;
+            }
+            continue;
         }
-        return TRUE;
+        if (first == ';' || section == SECTION_OTHER) continue;
+
+        DWORD equals = line.start;
+        DWORD lineEnd = line.start + line.length;
+        while (equals < lineEnd && IniUnit(ini, equals) != '=') equals++;
+        if (equals == lineEnd) continue;
+        IniSpan key = IniTrim(ini, line.start, equals);
+        IniSpan value = IniTrim(ini, equals + 1, lineEnd);
+
+        IniSpan* slot = NULL;
+        if (IniSpanEquals(ini, key, "IconResource")) {
+            slot = section == SECTION_VIEW_STATE ? &ini->viewStateResource : &ini->classInfoResource;
+        } else if (section == SECTION_CLASS_INFO && IniSpanEquals(ini, key, "IconFile")) {
+            slot = &ini->iconFile;
+        } else if (section == SECTION_CLASS_INFO && IniSpanEquals(ini, key, "IconIndex")) {
+            slot = &ini->iconIndex;
+        }
+        // A value always starts past its key, so start 0 means not seen yet
+        if (slot && !slot->start) *slot = value;
     }
+}
 
-    // Try IconFile (older method)
-    WCHAR iconFile[MAX_PATH] = {0};
-    GetPrivateProfileStringW(L".ShellClassInfo", L"IconFile", L"",
-                             iconFile, MAX_PATH, iniPath);
-    if (iconFile[0]) {
-        *iconIndex = GetPrivateProfileIntW(L".ShellClassInfo", L"IconIndex", 0, iniPath);
-
-        if (iconFile[0] != L'\\' && iconFile[1] != L':') {
-            WCHAR fullPath[MAX_PATH];
-            swprintf_s(fullPath, MAX_PATH, L"%s\\%s", folderPath, iconFile);
-            wcscpy_s(iconPath, MAX_PATH, fullPath);
-        } else {
-            wcscpy_s(iconPath, MAX_PATH, iconFile);
-        }
+// Converts a value to UTF-16. Returns FALSE if it does not fit.
+static BOOL IniCopyValue(const DesktopIni* ini, IniSpan span, WCHAR* out, int outSize) {
+    if (span.length >= (DWORD)outSize) return FALSE;
+    if (ini->encoding == INI_UTF16) {
+        for (DWORD i = 0; i < span.length; i++) out[i] = (WCHAR)IniUnit(ini, span.start + i);
+        out[span.length] = 0;
         return TRUE;
     }
-
-    // No custom icon found, use default folder icon
-    wcscpy_s(iconPath, MAX_PATH, L"%SystemRoot%\\System32\\shell32.dll");
-    *iconIndex = 3; // Default folder icon
+    if (span.length == 0) {
+        out[0] = 0;
+        return TRUE;
+    }
+    int length = MultiByteToWideChar(ini->encoding == INI_UTF8 ? CP_UTF8 : CP_ACP, 0,
+                                     (const char*)ini->data + span.start, (int)span.length, out, outSize - 1);
+    if (length <= 0) return FALSE;
+    out[length] = 0;
     return TRUE;
 }
 
-static BOOL CreateFolderIconShortcut(const WCHAR* folderPath) {
-    if (!folderPath || !folderPath[0] || !g_exePath[0]) {
+// Leading integer of a value, 0 if there is none (GetPrivateProfileInt)
+static int IniParseInt(const DesktopIni* ini, DWORD start, DWORD end) {
+    BOOL negative = start < end && IniUnit(ini, start) == '-';
+    if (negative) start++;
+    int value = 0;
+    for (; start < end && IniUnit(ini, start) >= '0' && IniUnit(ini, start) <= '9'; start++) {
+        value = value * 10 + (int)(IniUnit(ini, start) - '0');
+    }
+    return negative ? -value : value;
+}
+
+// Resolves the icon named by a parsed desktop.ini: IconResource ("path" or
+// "path,index", [ViewState] before [.ShellClassInfo]), then IconFile with
+// IconIndex. Relative paths are taken from folderPath.
+static BOOL ResolveDesktopIniIcon(const DesktopIni* ini, const WCHAR* folderPath, WCHAR* iconPath, int* iconIndex) {
+    IniSpan path;
+    const IniSpan* resource = ini->viewStateResource.length ? &ini->viewStateResource : &ini->classInfoResource;
+    if (resource->length) {
+        DWORD comma = resource->start + resource->length;
+        while (comma > resource->start && IniUnit(ini, comma - 1) != ',') comma--;
+        if (comma > resource->start) {
+            path = IniTrim(ini, resource->start, comma - 1);
+            *iconIndex = IniParseInt(ini, IniTrim(ini, comma, resource->start + resource->length).start,
+                                     resource->start + resource->length);
+        } else {
+            path = *resource;
+            *iconIndex = 0;
+        }
+    } else if (ini->iconFile.length) {
+        path = ini->iconFile;
+        *iconIndex = IniParseInt(ini, ini->iconIndex.start, ini->iconIndex.start + ini->iconIndex.length);
+    } else {
         return FALSE;
     }
 
-    IShellLinkW* pShellLink = NULL;
-    IPersistFile* pPersistFile = NULL;
-    BOOL success = FALSE;
+    WCHAR value[MAX_PATH];
+    if (!IniCopyValue(ini, path, value, MAX_PATH) || !value[0]) return FALSE;
 
-    HRESULT hr = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER,
-                                   &IID_IShellLinkW, (void**)&pShellLink);
-    if (FAILED(hr)) return FALSE;
+    // Handle relative paths
+    if (value[0] != L'\\' && value[0] != L'%' && value[1] != L':') {
+        if (wcslen(folderPath) + 1 + wcslen(value) >= MAX_PATH) return FALSE;
+        swprintf_s(iconPath, MAX_PATH, L"%s\\%s", folderPath, value);
+        return TRUE;
+    }
+    wcscpy_s(iconPath, MAX_PATH, value);
+    return TRUE;
+}
 
-    // Set shortcut target to FolderIcon.exe
-    pShellLink->lpVtbl->SetPath(pShellLink, g_exePath);
+// Returns FALSE when the folder has no custom icon; iconPath then names the
+// stock folder icon.
+static BOOL GetFolderIconLocation(const WCHAR* folderPath, WCHAR* iconPath, int* iconIndex) {
+    WCHAR iniPath[MAX_PATH];
+    BOOL found = FALSE;
+    if (wcslen(folderPath) < MAX_PATH - 12) {
+        swprintf_s(iniPath, MAX_PATH, L"%s\\desktop.ini", folderPath);
+        HANDLE hFile = CreateFileW(iniPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hFile != INVALID_HANDLE_VALUE) {
+            // Typical files fit the stack buffer
+            BYTE stackBuffer[2048];
+            BYTE* buffer = stackBuffer;
+            LARGE_INTEGER size;
+            if (GetFileSizeEx(hFile, &size) && size.QuadPart > (LONGLONG)sizeof(stackBuffer)) {
+                buffer = size.QuadPart <= DESKTOP_INI_MAX_SIZE ? malloc((SIZE_T)size.QuadPart) : NULL;
+            }
 
-    // Set arguments to the folder path
-    WCHAR args[MAX_PATH + 3];
-    swprintf_s(args, MAX_PATH + 3, L"\"%s\"", folderPath);
-    pShellLink->lpVtbl->SetArguments(pShellLink, args);
+            DWORD capacity = buffer == stackBuffer ? sizeof(stackBuffer) : (DWORD)size.QuadPart;
+            DWORD read = 0;
+            if (buffer && ReadFile(hFile, buffer, capacity, &read, NULL)) {
+                DesktopIni ini;
+                ParseDesktopIni(buffer, read, &ini);
+                found = ResolveDesktopIniIcon(&ini, folderPath, iconPath, iconIndex);
+            }
+            if (buffer != stackBuffer) free(buffer);
+            CloseHandle(hFile);
+        }
+    }
+    if (found) return TRUE;
 
-    // Set working directory to exe directory
-    WCHAR exeDir[MAX_PATH];
-    wcscpy_s(exeDir, MAX_PATH, g_exePath);
-    WCHAR* lastSlash = wcsrchr(exeDir, L'\\');
-    if (lastSlash) *lastSlash = L'\0';
-    pShellLink->lpVtbl->SetWorkingDirectory(pShellLink, exeDir);
+    // No custom icon found, use default folder icon
+    wcscpy_s(iconPath, MAX_PATH, L"%SystemRoot%\\System32\\shell32.dll");
+    *iconIndex = 3; // Default folder icon
+    return FALSE;
+}
 
-    // Get and set the folder's icon
-    WCHAR iconPath[MAX_PATH];
-    int iconIndex = 0;
-    GetFolderIconLocation(folderPath, iconPath, &iconIndex);
-    pShellLink->lpVtbl->SetIconLocation(pShellLink, iconPath, iconIndex);
+// Folder icons for a whole listing at once. Requests are independent, so a
+// few threads (the caller included) take the next one off a shared counter.
+#define FOLDER_ICON_MAX_THREADS 8
+#define FOLDER_ICON_PER_THREAD 16   // Smaller batches are not worth a thread
 
-    // Get folder name for description
-    WCHAR folderName[MAX_PATH];
-    const WCHAR* nameStart = wcsrchr(folderPath, L'\\');
-    if (nameStart && *(nameStart + 1)) {
-        wcscpy_s(folderName, MAX_PATH, nameStart + 1);
-    } else {
-        wcscpy_s(folderName, MAX_PATH, L"FolderIcon");
+typedef struct FolderIconRequest {
+    const WCHAR* folderPath;
+    WCHAR iconPath[MAX_PATH];
+    int iconIndex;
+    BOOL custom;            // FALSE: iconPath is the stock folder icon
+} FolderIconRequest;
+
+typedef struct FolderIconBatch {
+    FolderIconRequest* requests;
+    int count;
+    volatile LONG next;
+} FolderIconBatch;
+
+static DWORD WINAPI FolderIconBatchThread(LPVOID param) {
+    FolderIconBatch* batch = (FolderIconBatch*)param;
+    for (;;) {
+        LONG i = InterlockedIncrement(&batch->next) - 1;
+        if (i >= batch->count) break;
+        FolderIconRequest* request = &batch->requests[i];
+        request->custom = GetFolderIconLocation(request->folderPath, request->iconPath, &request->iconIndex);
     }
-    pShellLink->lpVtbl->SetDescription(pShellLink, folderName);
+    return 0;
+}
 
-    // Create shortcut path: same location as folder with "-shortcut" suffix
-    // e.g., C:\Users\Name\MyFolder -> C:\Users\Name\MyFolder-shortcut.lnk
-    WCHAR shortcutPath[MAX_PATH];
-    swprintf_s(shortcutPath, MAX_PATH, L"%s-shortcut.lnk", folderPath);
+static void ResolveFolderIcons(FolderIconRequest* requests, int count) {
+    FolderIconBatch batch = { requests, count, 0 };
 
-    // Save shortcut
-    hr = pShellLink->lpVtbl->QueryInterface(pShellLink, &IID_IPersistFile, (void**)&pPersistFile);
-    if (SUCCEEDED(hr)) {
-        hr = pPersistFile->lpVtbl->Save(pPersistFile, shortcutPath, TRUE);
-        if (SUCCEEDED(hr)) {
-            success = TRUE;
-            WCHAR msg[MAX_PATH];
-            swprintf_s(msg, MAX_PATH, L"Shortcut created: %s-shortcut.lnk", folderName);
-            ShowNotification(L"FolderIcon", msg, FALSE);
-        } else {
-            ShowNotification(L"FolderIcon", L"Failed to create shortcut", TRUE);
-        }
-        pPersistFile->lpVtbl->Release(pPersistFile);
-    } else {
-        ShowNotification(L"FolderIcon", L"Failed to create shortcut", TRUE);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int threadCount = min((int)si.dwNumberOfProcessors, FOLDER_ICON_MAX_THREADS);
+    threadCount = max(1, min(threadCount, count / FOLDER_ICON_PER_THREAD));
+
+    HANDLE threads[FOLDER_ICON_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threadCount; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, FolderIconBatchThread, &batch, 0, NULL);
+        if (hThread) threads[started++] = hThread;
     }
+    FolderIconBatchThread(&batch);
 
-    pShellLink->lpVtbl->Release(pShellLink);
-    return success;
+    if (started > 0) WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) {
+        CloseHandle(threads[i]);
+    }
 }
 
 static BOOL IsDarkModeEnabled(void) {
@@ -398,14 +1072,64 @@ static void InitializeColors(void) {
     }
 }
 
-static void ParseCommandLine(void) {
+// Appends "<keyword> <pattern>" lines to g_ruleText for a ;-separated
+// command-line list (--include, --exclude)
+static void AppendRuleText(const WCHAR* keyword, const WCHAR* list) {
+    SIZE_T used = g_ruleText ? wcslen(g_ruleText) : 0;
+    SIZE_T listLength = wcslen(list);
+    SIZE_T needed = used + listLength + (listLength + 1) * (wcslen(keyword) + 2) + 1;
+    WCHAR* text = realloc(g_ruleText, needed * sizeof(WCHAR));
+    if (!text) return;
+    g_ruleText = text;
+
+    while (*list) {
+        const WCHAR* end = wcschr(list, L';');
+        if (!end) end = list + wcslen(list);
+        if (end > list) {
+            used += swprintf_s(text + used, needed - used, L"%s %.*s\n", keyword, (int)(end - list), list);
+        }
+        list = *end ? end + 1 : end;
+    }
+    text[used] = L'\0';
+}
+
+static void ParseCommandLine(const WCHAR* commandLine) {
     int argc;
-    LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    LPWSTR* argv = CommandLineToArgvW(commandLine, &argc);
+    g_folderPath[0] = 0;
+    g_sortMode = SORT_FOLDERS_FIRST;
+    g_recursiveDepth = 0;
+    g_prefetchEnabled = FALSE;
+    free(g_ruleText);
+    g_ruleText = NULL;
 
     if (argv) {
         for (int i = 1; i < argc; i++) {
             if ((wcscmp(argv[i], L"--folder") == 0 || wcscmp(argv[i], L"-f") == 0) && i + 1 < argc) {
                 wcscpy_s(g_folderPath, MAX_PATH, argv[++i]);
+            } else if (wcscmp(argv[i], L"--recursive") == 0) {
+                g_recursiveDepth = RECURSIVE_MAX_DEPTH;
+            } else if (wcsncmp(argv[i], L"--recursive=", 12) == 0) {
+                g_recursiveDepth = max(0, min(_wtoi(argv[i] + 12), RECURSIVE_MAX_DEPTH));
+            } else if (wcscmp(argv[i], L"--include") == 0 && i + 1 < argc) {
+                AppendRuleText(L"include", argv[++i]);
+            } else if (wcscmp(argv[i], L"--exclude") == 0 && i + 1 < argc) {
+                AppendRuleText(L"exclude", argv[++i]);
+            } else if (wcscmp(argv[i], L"--prefetch") == 0) {
+                g_prefetchEnabled = TRUE;
+            } else if (wcscmp(argv[i], L"--sort") == 0 && i + 1 < argc) {
+                i++;
+                if (_wcsicmp(argv[i], L"natural") == 0) {
+                    g_sortMode = SORT_NATURAL;
+                } else if (_wcsicmp(argv[i], L"plain") == 0) {
+                    g_sortMode = SORT_PLAIN;
+                } else if (_wcsicmp(argv[i], L"frecency") == 0) {
+                    g_sortMode = SORT_FRECENCY;
+                } else {
+                    g_sortMode = SORT_FOLDERS_FIRST;
+                }
+            } else if (wcscmp(argv[i], L"--trace") == 0 && i + 1 < argc) {
+                i++;  // Output file, handled in wWinMain
             } else if (argv[i][0] != L'-' && GetFileAttributesW(argv[i]) & FILE_ATTRIBUTE_DIRECTORY) {
                 wcscpy_s(g_folderPath, MAX_PATH, argv[i]);
             }
@@ -426,148 +1150,5945 @@ static void ParseCommandLine(void) {
     }
 }
 
-static int CompareItems(const void* a, const void* b) {
-    const FolderEntry* itemA = (const FolderEntry*)a;
-    const FolderEntry* itemB = (const FolderEntry*)b;
+static ULONGLONG HashBytes(const BYTE* data, SIZE_T size) {
+    ULONGLONG hash = 0xCBF29CE484222325ULL;
+    for (SIZE_T i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
 
-    if (itemA->bIsDirectory != itemB->bIsDirectory) {
-        return itemB->bIsDirectory - itemA->bIsDirectory;
+// 64-bit hash for icon pixel blocks. Four independent lanes each take one
+// 8-byte word per 32-byte step (multiply, then fold the high bits down), so
+// the compiler can keep them in vector registers; the lanes are combined and
+// finished with the MurmurHash3 mixer. Not cryptographic: icons with equal
+// hashes are treated as identical.
+static ULONGLONG HashPixels(const BYTE* data, SIZE_T size) {
+    ULONGLONG lanes[4] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL };
+    SIZE_T i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            ULONGLONG word;
+            memcpy(&word, data + i + lane * 8, 8);
+            lanes[lane] = (lanes[lane] ^ word) * 0x9E3779B97F4A7C15ULL;
+            lanes[lane] ^= lanes[lane] >> 31;
+        }
     }
-    return _wcsicmp(itemA->szName, itemB->szName);
+
+    ULONGLONG hash = size;
+    for (int lane = 0; lane < 4; lane++) hash = (hash ^ lanes[lane]) * 0xC2B2AE3D27D4EB4FULL;
+    for (; i < size; i++) hash = (hash ^ data[i]) * 0x100000001B3ULL;
+
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDULL;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ULL;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-static BOOL IsShortcut(const WCHAR* path) {
-    const WCHAR* ext = wcsrchr(path, L'.');
-    return ext && _wcsicmp(ext, L".lnk") == 0;
+// Case-insensitive FNV-1a over the path, matching how Windows compares paths.
+static ULONGLONG HashPath(const WCHAR* path) {
+    ULONGLONG hash = 0xCBF29CE484222325ULL;
+    for (; *path; path++) {
+        WCHAR ch = towlower(*path);
+        hash ^= (BYTE)(ch & 0xFF);
+        hash *= 0x100000001B3ULL;
+        hash ^= (BYTE)(ch >> 8);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
 }
 
-static BOOL ResolveShortcut(const WCHAR* shortcutPath, WCHAR* targetPath, int targetPathSize) {
-    BOOL success = FALSE;
-    IShellLinkW* pShellLink = NULL;
-    IPersistFile* pPersistFile = NULL;
+static BOOL GetIconCachePath(WCHAR* path, const WCHAR* fileName) {
+    WCHAR appData[MAX_PATH];
+    if (FAILED(SHGetFolderPathW(NULL, CSIDL_LOCAL_APPDATA, NULL, 0, appData))) return FALSE;
 
-    HRESULT hr = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER,
-                                   &IID_IShellLinkW, (void**)&pShellLink);
-    if (SUCCEEDED(hr)) {
-        hr = pShellLink->lpVtbl->QueryInterface(pShellLink, &IID_IPersistFile, (void**)&pPersistFile);
-        if (SUCCEEDED(hr)) {
-            hr = pPersistFile->lpVtbl->Load(pPersistFile, shortcutPath, STGM_READ);
-            if (SUCCEEDED(hr)) {
-                hr = pShellLink->lpVtbl->GetPath(pShellLink, targetPath, targetPathSize, NULL, 0);
-                if (SUCCEEDED(hr) && targetPath[0] != L'\0') {
-                    success = TRUE;
-                }
-            }
-            pPersistFile->lpVtbl->Release(pPersistFile);
-        }
-        pShellLink->lpVtbl->Release(pShellLink);
-    }
+    swprintf_s(path, MAX_PATH, L"%s\\FolderIcon", appData);
+    CreateDirectoryW(path, NULL);
+    swprintf_s(path, MAX_PATH, L"%s\\FolderIcon\\%s", appData, fileName);
+    return TRUE;
+}
 
-    return success;
+// Launch history for --sort frecency. Every launch appends one fixed-size
+// FrecencyRecord to usage-<folder hash>.log under %LOCALAPPDATA%\FolderIcon.
+// Each record is written with a single append and carries its own checksum,
+// so a crash mid-write leaves at worst a torn record that readers skip.
+// Once the log reaches FRECENCY_COMPACT_RECORDS records it is folded into
+// usage-<folder hash>.dat, a table of decayed scores replaced atomically, and
+// the log is truncated. The summary remembers the newest record it folded, so
+// a crash between those two steps cannot count a launch twice.
+//
+// Each launch is worth 1.0, halving every FRECENCY_HALF_LIFE_DAYS. Summary
+// scores are stored as of the summary's timestamp and decayed on read, so
+// ranking is one pass over the summary and the bounded log plus a hash lookup
+// per item, however long the history is.
+#define FRECENCY_MAGIC 0x53554946           // "FIUS"
+#define FRECENCY_RECORD_MAGIC 0x4C554946    // "FIUL"
+#define FRECENCY_VERSION 1
+#define FRECENCY_COMPACT_RECORDS 256
+#define FRECENCY_MAX_ENTRIES 1024
+#define FRECENCY_HALF_LIFE_DAYS 14.0
+#define FRECENCY_MIN_SCORE 0.01             // Dropped at compaction below this
+// Sort ranks are scores times FRECENCY_RANK_SCALE, truncated and capped at
+// 4e9: scores within the same 1/1024 step tie and keep the sort mode order
+#define FRECENCY_RANK_SCALE 1024.0
+#define FILETIME_TICKS_PER_DAY 864000000000.0
+
+typedef struct FrecencyRecord {
+    ULONGLONG nameHash;
+    ULONGLONG time;         // FILETIME of the launch
+    DWORD magic;
+    DWORD checksum;         // Over the fields above
+} FrecencyRecord;
+
+typedef struct FrecencyHeader {
+    DWORD magic;
+    DWORD version;
+    DWORD entryCount;
+    DWORD checksum;         // Over the entry table
+    ULONGLONG time;         // Scores below are as of this time
+    ULONGLONG foldedThrough;  // Newest log record already counted
+} FrecencyHeader;
+
+typedef struct FrecencyEntry {
+    ULONGLONG nameHash;
+    double score;
+} FrecencyEntry;
+
+// Open-addressed score table keyed by name hash (0 marks an empty slot)
+typedef struct FrecencyTable {
+    FrecencyEntry* slots;
+    DWORD mask;
+    DWORD count;
+    ULONGLONG time;         // Scores are as of this time
+    ULONGLONG foldedThrough;
+} FrecencyTable;
+
+static DWORD FrecencyRecordChecksum(const FrecencyRecord* record) {
+    return (DWORD)HashBytes((const BYTE*)record, offsetof(FrecencyRecord, checksum));
 }
 
-static void LoadFolderContents(void) {
-    g_itemCount = 0;
+static void FrecencyMakeRecord(FrecencyRecord* record, ULONGLONG nameHash, ULONGLONG time) {
+    ZeroMemory(record, sizeof(*record));
+    record->nameHash = nameHash;
+    record->time = time;
+    record->magic = FRECENCY_RECORD_MAGIC;
+    record->checksum = FrecencyRecordChecksum(record);
+}
 
-    if (g_imageList) {
-        ImageList_Destroy(g_imageList);
-    }
-    g_imageList = ImageList_Create(ICON_SIZE, ICON_SIZE, ILC_COLOR32 | ILC_MASK, 50, 50);
+static double FrecencyDecay(double score, ULONGLONG from, ULONGLONG to) {
+    if (to <= from) return score;
+    return score * pow(0.5, (double)(to - from) / FILETIME_TICKS_PER_DAY / FRECENCY_HALF_LIFE_DAYS);
+}
 
-    WCHAR searchPath[MAX_PATH];
-    swprintf_s(searchPath, MAX_PATH, L"%s\\*", g_folderPath);
+static void FrecencyFreeTable(FrecencyTable* table) {
+    free(table->slots);
+    ZeroMemory(table, sizeof(*table));
+}
 
-    WIN32_FIND_DATAW findData;
-    HANDLE hFind = FindFirstFileW(searchPath, &findData);
+static FrecencyEntry* FrecencyFindSlot(FrecencyEntry* slots, DWORD mask, ULONGLONG nameHash) {
+    DWORD slot = (DWORD)(nameHash ^ (nameHash >> 32)) & mask;
+    while (slots[slot].nameHash && slots[slot].nameHash != nameHash) slot = (slot + 1) & mask;
+    return &slots[slot];
+}
 
-    if (hFind != INVALID_HANDLE_VALUE) {
-        do {
-            if (wcscmp(findData.cFileName, L".") == 0 || wcscmp(findData.cFileName, L"..") == 0) {
-                continue;
-            }
+static double FrecencyLookup(const FrecencyTable* table, ULONGLONG nameHash) {
+    if (!table->slots) return 0.0;
+    if (!nameHash) nameHash = 1;
+    FrecencyEntry* entry = FrecencyFindSlot(table->slots, table->mask, nameHash);
+    return entry->nameHash ? entry->score : 0.0;
+}
 
-            // Skip hidden files
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_HIDDEN) {
-                continue;
-            }
+static BOOL FrecencyAdd(FrecencyTable* table, ULONGLONG nameHash, double score) {
+    if (!nameHash) nameHash = 1;  // 0 marks empty slots
 
-            if (g_itemCount >= MAX_ITEMS) break;
+    // Keep the table at most half full
+    if (!table->slots || (table->count + 1) * 2 > table->mask + 1) {
+        DWORD capacity = table->slots ? (table->mask + 1) * 2 : 256;
+        FrecencyEntry* slots = calloc(capacity, sizeof(FrecencyEntry));
+        if (!slots) return FALSE;
+        for (DWORD i = 0; table->slots && i <= table->mask; i++) {
+            if (table->slots[i].nameHash) *FrecencyFindSlot(slots, capacity - 1, table->slots[i].nameHash) = table->slots[i];
+        }
+        free(table->slots);
+        table->slots = slots;
+        table->mask = capacity - 1;
+    }
 
-            FolderEntry* item = &g_items[g_itemCount];
-            wcscpy_s(item->szName, MAX_PATH, findData.cFileName);
-            swprintf_s(item->szPath, MAX_PATH, L"%s\\%s", g_folderPath, findData.cFileName);
-            item->bIsDirectory = (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    FrecencyEntry* entry = FrecencyFindSlot(table->slots, table->mask, nameHash);
+    if (!entry->nameHash) {
+        entry->nameHash = nameHash;
+        entry->score = 0.0;
+        table->count++;
+    }
+    entry->score += score;
+    return TRUE;
+}
 
-            // Get icon - for shortcuts, get the target's icon without overlay arrow
-            WCHAR iconPath[MAX_PATH];
-            wcscpy_s(iconPath, MAX_PATH, item->szPath);
+// Loads a summary file image into the table, decayed to table->time.
+// A damaged summary is ignored as a whole.
+static void FrecencyReadSummary(FrecencyTable* table, const BYTE* data, SIZE_T size) {
+    if (size < sizeof(FrecencyHeader)) return;
 
-            if (IsShortcut(item->szPath)) {
-                WCHAR targetPath[MAX_PATH];
-                if (ResolveShortcut(item->szPath, targetPath, MAX_PATH)) {
-                    wcscpy_s(iconPath, MAX_PATH, targetPath);
-                }
-            }
+    const FrecencyHeader* header = (const FrecencyHeader*)data;
+    if (header->magic != FRECENCY_MAGIC || header->version != FRECENCY_VERSION ||
+        header->entryCount > FRECENCY_MAX_ENTRIES ||
+        size != sizeof(FrecencyHeader) + header->entryCount * sizeof(FrecencyEntry)) {
+        return;
+    }
 
-            SHFILEINFOW sfi = {0};
-            SHGetFileInfoW(iconPath, 0, &sfi, sizeof(sfi), SHGFI_ICON | SHGFI_LARGEICON);
+    const FrecencyEntry* entries = (const FrecencyEntry*)(data + sizeof(FrecencyHeader));
+    if ((DWORD)HashBytes((const BYTE*)entries, header->entryCount * sizeof(FrecencyEntry)) != header->checksum) return;
 
-            if (sfi.hIcon) {
-                item->nIconIndex = ImageList_AddIcon(g_imageList, sfi.hIcon);
-                DestroyIcon(sfi.hIcon);
-            } else {
-                item->nIconIndex = -1;
-            }
+    for (DWORD i = 0; i < header->entryCount; i++) {
+        FrecencyAdd(table, entries[i].nameHash, FrecencyDecay(entries[i].score, header->time, table->time));
+    }
+    table->foldedThrough = header->foldedThrough;
+}
 
-            g_itemCount++;
-        } while (FindNextFileW(hFind, &findData));
+// Adds the log's launches newer than the summary. A record that fails its
+// checksum (a torn append, or garbage after a crash) is skipped a byte at a
+// time until the next valid record, so one bad write costs only itself.
+// Returns the newest record time seen.
+static ULONGLONG FrecencyReadLog(FrecencyTable* table, const BYTE* data, SIZE_T size) {
+    ULONGLONG newest = table->foldedThrough;
+    SIZE_T offset = 0;
+    while (offset + sizeof(FrecencyRecord) <= size) {
+        FrecencyRecord record;
+        memcpy(&record, data + offset, sizeof(record));
+        if (record.magic != FRECENCY_RECORD_MAGIC || record.checksum != FrecencyRecordChecksum(&record)) {
+            offset++;
+            continue;
+        }
+        offset += sizeof(record);
 
-        FindClose(hFind);
+        if (record.time <= table->foldedThrough) continue;
+        FrecencyAdd(table, record.nameHash, FrecencyDecay(1.0, record.time, table->time));
+        if (record.time > newest) newest = record.time;
     }
+    return newest;
+}
 
-    qsort(g_items, g_itemCount, sizeof(FolderEntry), CompareItems);
+static int CompareFrecencyScores(const void* a, const void* b) {
+    const FrecencyEntry* entryA = a;
+    const FrecencyEntry* entryB = b;
+    if (entryA->score != entryB->score) return entryA->score > entryB->score ? -1 : 1;
+    return entryA->nameHash < entryB->nameHash ? -1 : entryA->nameHash > entryB->nameHash;
 }
 
-static void PositionWindow(HWND hwnd) {
-    POINT cursorPos;
-    GetCursorPos(&cursorPos);
+// Builds the summary file image for the table: faded entries dropped, the
+// rest capped to FRECENCY_MAX_ENTRIES by score. Caller frees the result.
+static BYTE* FrecencyWriteSummary(const FrecencyTable* table, ULONGLONG foldedThrough, SIZE_T* size) {
+    BYTE* data = malloc(sizeof(FrecencyHeader) + (table->count + 1) * sizeof(FrecencyEntry));
+    if (!data) return NULL;
 
-    HMONITOR hMonitor = MonitorFromPoint(cursorPos, MONITOR_DEFAULTTONEAREST);
-    MONITORINFO mi = { sizeof(mi) };
-    GetMonitorInfo(hMonitor, &mi);
+    FrecencyEntry* entries = (FrecencyEntry*)(data + sizeof(FrecencyHeader));
+    DWORD count = 0;
+    for (DWORD i = 0; table->slots && i <= table->mask; i++) {
+        if (table->slots[i].nameHash && table->slots[i].score >= FRECENCY_MIN_SCORE) entries[count++] = table->slots[i];
+    }
+    qsort(entries, count, sizeof(FrecencyEntry), CompareFrecencyScores);
+    count = min(count, FRECENCY_MAX_ENTRIES);
+
+    FrecencyHeader* header = (FrecencyHeader*)data;
+    header->magic = FRECENCY_MAGIC;
+    header->version = FRECENCY_VERSION;
+    header->entryCount = count;
+    header->checksum = (DWORD)HashBytes((const BYTE*)entries, count * sizeof(FrecencyEntry));
+    header->time = table->time;
+    header->foldedThrough = foldedThrough;
+
+    *size = sizeof(FrecencyHeader) + count * sizeof(FrecencyEntry);
+    return data;
+}
 
-    RECT work = mi.rcWork;
-    RECT bounds = mi.rcMonitor;
+static BOOL GetUsagePaths(const WCHAR* folderPath, WCHAR* summaryPath, WCHAR* logPath) {
+    WCHAR fileName[MAX_PATH];
+    ULONGLONG folderHash = HashPath(folderPath);
+    swprintf_s(fileName, MAX_PATH, L"usage-%016llx.dat", folderHash);
+    if (!GetIconCachePath(summaryPath, fileName)) return FALSE;
+    swprintf_s(fileName, MAX_PATH, L"usage-%016llx.log", folderHash);
+    return GetIconCachePath(logPath, fileName);
+}
+
+static ULONGLONG FrecencyNow(void) {
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    return ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+}
+
+// Reads a whole (small) file from an open handle. Caller frees the result.
+static BYTE* FrecencyReadHandle(HANDLE hFile, SIZE_T* size) {
+    LARGE_INTEGER fileSize;
+    *size = 0;
+    if (!GetFileSizeEx(hFile, &fileSize) || fileSize.QuadPart > 16 * 1024 * 1024) return NULL;
+
+    BYTE* data = malloc((SIZE_T)fileSize.QuadPart + 1);
+    DWORD read = 0;
+    if (data && !ReadFile(hFile, data, (DWORD)fileSize.QuadPart, &read, NULL)) read = 0;
+    *size = read;
+    return data;
+}
+
+static void FrecencyReadPath(FrecencyTable* table, const WCHAR* path, BOOL isLog) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return;
+
+    SIZE_T size;
+    BYTE* data = FrecencyReadHandle(hFile, &size);
+    CloseHandle(hFile);
+    if (!data) return;
+
+    if (isLog) {
+        FrecencyReadLog(table, data, size);
+    } else {
+        FrecencyReadSummary(table, data, size);
+    }
+    free(data);
+}
+
+// Scores for every launched item in the folder, as of now
+static void FrecencyLoad(FrecencyTable* table, const WCHAR* folderPath) {
+    ZeroMemory(table, sizeof(*table));
+    table->time = FrecencyNow();
+
+    WCHAR summaryPath[MAX_PATH], logPath[MAX_PATH];
+    if (!GetUsagePaths(folderPath, summaryPath, logPath)) return;
+    FrecencyReadPath(table, summaryPath, FALSE);
+    FrecencyReadPath(table, logPath, TRUE);
+}
+
+// Folds the log into the summary. The log is held open without sharing for
+// the duration, so concurrent launches wait (see FrecencyRecordLaunch) instead
+// of appending records that the truncation would lose.
+static void FrecencyCompact(const WCHAR* summaryPath, const WCHAR* logPath) {
+    HANDLE hLog = CreateFileW(logPath, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hLog == INVALID_HANDLE_VALUE) return;
+
+    FrecencyTable table = {0};
+    table.time = FrecencyNow();
+    FrecencyReadPath(&table, summaryPath, FALSE);
+
+    SIZE_T logSize;
+    BYTE* logData = FrecencyReadHandle(hLog, &logSize);
+    if (logData) {
+        ULONGLONG foldedThrough = FrecencyReadLog(&table, logData, logSize);
+
+        SIZE_T size;
+        BYTE* summary = FrecencyWriteSummary(&table, foldedThrough, &size);
+        if (summary) {
+            WCHAR tempPath[MAX_PATH];
+            swprintf_s(tempPath, MAX_PATH, L"%s.%lu.tmp", summaryPath, GetCurrentProcessId());
+
+            HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            if (hFile != INVALID_HANDLE_VALUE) {
+                DWORD written;
+                BOOL ok = WriteFile(hFile, summary, (DWORD)size, &written, NULL) && written == size &&
+                          FlushFileBuffers(hFile);
+                CloseHandle(hFile);
+
+                // Only a summary that made it to disk may retire the log
+                if (ok && MoveFileExW(tempPath, summaryPath, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+                    LARGE_INTEGER zero = {0};
+                    SetFilePointerEx(hLog, zero, NULL, FILE_BEGIN);
+                    SetEndOfFile(hLog);
+                } else {
+                    DeleteFileW(tempPath);
+                }
+            }
+            free(summary);
+        }
+        free(logData);
+    }
+
+    CloseHandle(hLog);
+    FrecencyFreeTable(&table);
+}
+
+// Appends one launch to the folder's log, compacting it when it is full
+static void FrecencyRecordLaunch(const WCHAR* folderPath, const WCHAR* relativePath) {
+    WCHAR summaryPath[MAX_PATH], logPath[MAX_PATH];
+    if (!GetUsagePaths(folderPath, summaryPath, logPath)) return;
+
+    // A sharing violation means another instance is compacting; it is brief
+    HANDLE hLog = INVALID_HANDLE_VALUE;
+    for (int attempt = 0; attempt < 20; attempt++) {
+        hLog = CreateFileW(logPath, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+                           FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hLog != INVALID_HANDLE_VALUE || GetLastError() != ERROR_SHARING_VIOLATION) break;
+        Sleep(5);
+    }
+    if (hLog == INVALID_HANDLE_VALUE) return;
+
+    FrecencyRecord record;
+    FrecencyMakeRecord(&record, HashPath(relativePath), FrecencyNow());
+    DWORD written;
+    WriteFile(hLog, &record, sizeof(record), &written, NULL);
+
+    LARGE_INTEGER fileSize;
+    BOOL full = GetFileSizeEx(hLog, &fileSize) &&
+                fileSize.QuadPart >= FRECENCY_COMPACT_RECORDS * (LONGLONG)sizeof(FrecencyRecord);
+    CloseHandle(hLog);
+
+    if (full) FrecencyCompact(summaryPath, logPath);
+}
+
+// One 24-byte entry per item for sorting. The first eight key bytes are
+// loaded big-endian into prefix, which settles most comparisons without
+// touching the key arena (always g_store's).
+typedef struct SortEntry {
+    ULONGLONG prefix;
+    DWORD keyOffset;        // Into g_store.keyArena
+    DWORD rank;             // Quantized frecency score, higher first
+    int item;
+    WORD keySize;
+    BYTE group;             // 0 = folder in folders-first mode, else 1
+} SortEntry;
+
+static int CompareSortEntries(const void* a, const void* b) {
+    const SortEntry* entryA = a;
+    const SortEntry* entryB = b;
+
+    if (entryA->rank != entryB->rank) return entryA->rank > entryB->rank ? -1 : 1;
+    if (entryA->group != entryB->group) return entryA->group - entryB->group;
+    if (entryA->prefix != entryB->prefix) return entryA->prefix < entryB->prefix ? -1 : 1;
+
+    int common = min(entryA->keySize, entryB->keySize);
+    int result = memcmp(g_store.keyArena + entryA->keyOffset, g_store.keyArena + entryB->keyOffset, common);
+    if (result) return result;
+    if (entryA->keySize != entryB->keySize) return entryA->keySize - entryB->keySize;
+    return entryA->item - entryB->item;
+}
+
+static void SortItems(void) {
+    int count = g_store.count;
+    if (count < 2) return;
+    if (g_store.sortMode != g_sortMode && !ItemStoreRebuildKeys(&g_store)) return;
+
+    SortEntry* entries = malloc(count * sizeof(SortEntry));
+    int* order = malloc(count * sizeof(int));
+    if (!entries || !order) {
+        free(entries);
+        free(order);
+        return;
+    }
+
+    // One hash lookup per item; the history was decayed to now on load
+    FrecencyTable frecency = {0};
+    if (g_sortMode == SORT_FRECENCY) FrecencyLoad(&frecency, g_folderPath);
+    BOOL foldersFirst = (g_sortMode == SORT_FOLDERS_FIRST || g_sortMode == SORT_FRECENCY) && !g_store.rootLength;
+
+    for (int i = 0; i < count; i++) {
+        SortEntry* entry = &entries[i];
+        const BYTE* key = g_store.keyArena + g_store.keyOffset[i];
+        entry->keyOffset = g_store.keyOffset[i];
+        entry->keySize = g_store.keySize[i];
+        entry->group = (foldersFirst && ItemIsDirectory(i)) ? 0 : 1;
+        entry->rank = frecency.count ? (DWORD)min(FrecencyLookup(&frecency, HashPath(ItemRelativePath(i))) * FRECENCY_RANK_SCALE, 4e9) : 0;
+        entry->item = i;
+
+        ULONGLONG prefix = 0;
+        for (int b = 0; b < 8; b++) {
+            prefix = (prefix << 8) | (b < entry->keySize ? key[b] : 0);
+        }
+        entry->prefix = prefix;
+    }
+
+    qsort(entries, count, sizeof(SortEntry), CompareSortEntries);
+    for (int i = 0; i < count; i++) order[i] = entries[i].item;
+    ItemStorePermute(&g_store, order);
+
+    FrecencyFreeTable(&frecency);
+    free(entries);
+    free(order);
+}
+
+static BOOL IsShortcut(const WCHAR* path) {
+    const WCHAR* ext = wcsrchr(path, L'.');
+    return ext && _wcsicmp(ext, L".lnk") == 0;
+}
+
+// Native MS-SHLLINK (.lnk) parser. Works on a raw byte buffer (normally a
+// read-only file mapping), never allocates and makes no Win32 calls, so the
+// popup can resolve shortcuts without a COM round-trip per file.
+#define SHLLINK_HEADER_SIZE 0x4C
+
+#define SLDF_HAS_ID_LIST       0x00000001
+#define SLDF_HAS_LINK_INFO     0x00000002
+#define SLDF_HAS_NAME          0x00000004
+#define SLDF_HAS_RELPATH       0x00000008
+#define SLDF_HAS_WORKINGDIR    0x00000010
+#define SLDF_HAS_ARGS          0x00000020
+#define SLDF_HAS_ICONLOCATION  0x00000040
+#define SLDF_UNICODE           0x00000080
+#define SLDF_FORCE_NO_LINKINFO 0x00000100
+#define SLDF_HAS_EXP_SZ        0x00000200
+#define SLDF_HAS_EXP_ICON_SZ   0x00004000
+
+#define LINKINFO_VOLUMEID_AND_LOCALBASEPATH 0x00000001
+#define LINKINFO_NETWORK_AND_PATHSUFFIX     0x00000002
+#define CNRL_VALID_DEVICE                   0x00000001
+
+#define EXP_SZ_LINK_SIG  0xA0000001
+#define EXP_SZ_ICON_SIG  0xA0000007
+#define EXP_SZ_BLOCK_SIZE 0x00000314
+
+typedef struct ShellLinkInfo {
+    WCHAR szTarget[MAX_PATH];
+    WCHAR szArguments[MAX_PATH];
+    WCHAR szIconPath[MAX_PATH];
+    int nIconIndex;
+    BOOL bTargetHasEnvVars;
+    BOOL bIconHasEnvVars;
+} ShellLinkInfo;
+
+static const BYTE g_shellLinkClsid[16] = {
+    0x01, 0x14, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0xC0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46
+};
+
+static WORD ReadLE16(const BYTE* p) {
+    return (WORD)(p[0] | (p[1] << 8));
+}
+
+static DWORD ReadLE32(const BYTE* p) {
+    return (DWORD)p[0] | ((DWORD)p[1] << 8) | ((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+// Appends a NUL-terminated single-byte string. Only 7-bit ASCII is accepted:
+// anything else depends on the code page the link was written with, and those
+// links are left to the COM fallback.
+static BOOL AppendAnsiString(WCHAR* dest, int destSize, int* len, const BYTE* src, SIZE_T srcMax) {
+    for (SIZE_T i = 0; i < srcMax; i++) {
+        if (src[i] == 0) {
+            dest[*len] = L'\0';
+            return TRUE;
+        }
+        if (src[i] >= 0x80 || *len + 1 >= destSize) return FALSE;
+        dest[(*len)++] = (WCHAR)src[i];
+    }
+    return FALSE;
+}
+
+// Appends a NUL-terminated UTF-16LE string.
+static BOOL AppendUnicodeString(WCHAR* dest, int destSize, int* len, const BYTE* src, SIZE_T srcMax) {
+    for (SIZE_T i = 0; i + 1 < srcMax; i += 2) {
+        WCHAR ch = (WCHAR)ReadLE16(src + i);
+        if (ch == 0) {
+            dest[*len] = L'\0';
+            return TRUE;
+        }
+        if (*len + 1 >= destSize) return FALSE;
+        dest[(*len)++] = ch;
+    }
+    return FALSE;
+}
+
+static BOOL AppendPathSeparator(WCHAR* dest, int destSize, int* len) {
+    if (*len > 0 && dest[*len - 1] == L'\\') return TRUE;
+    if (*len + 1 >= destSize) return FALSE;
+    dest[(*len)++] = L'\\';
+    dest[*len] = L'\0';
+    return TRUE;
+}
+
+// Builds the target path from the LinkInfo structure: either the local base
+// path or the network share name, followed by the common path suffix.
+static BOOL ParseLinkInfo(const BYTE* info, DWORD infoSize, WCHAR* target) {
+    if (infoSize < 0x1C) return FALSE;
+
+    DWORD headerSize = ReadLE32(info + 4);
+    DWORD flags = ReadLE32(info + 8);
+    DWORD localBaseOffset = ReadLE32(info + 16);
+    DWORD networkOffset = ReadLE32(info + 20);
+    DWORD suffixOffset = ReadLE32(info + 24);
+    DWORD localBaseOffsetW = 0;
+    DWORD suffixOffsetW = 0;
+
+    if (headerSize >= 0x24 && infoSize >= 0x24) {
+        localBaseOffsetW = ReadLE32(info + 28);
+        suffixOffsetW = ReadLE32(info + 32);
+    }
+
+    int len = 0;
+    target[0] = L'\0';
+
+    if (flags & LINKINFO_VOLUMEID_AND_LOCALBASEPATH) {
+        if (localBaseOffsetW && localBaseOffsetW < infoSize) {
+            if (!AppendUnicodeString(target, MAX_PATH, &len, info + localBaseOffsetW, infoSize - localBaseOffsetW)) return FALSE;
+        } else if (localBaseOffset && localBaseOffset < infoSize) {
+            if (!AppendAnsiString(target, MAX_PATH, &len, info + localBaseOffset, infoSize - localBaseOffset)) return FALSE;
+        } else {
+            return FALSE;
+        }
+    } else if (flags & LINKINFO_NETWORK_AND_PATHSUFFIX) {
+        if (!networkOffset || networkOffset + 0x14 > infoSize) return FALSE;
+        const BYTE* net = info + networkOffset;
+        DWORD netSize = ReadLE32(net);
+        if (netSize < 0x14 || netSize > infoSize - networkOffset) return FALSE;
+
+        DWORD netNameOffset = ReadLE32(net + 8);
+        DWORD netNameOffsetW = (netNameOffset > 0x14 && netSize >= 0x1C) ? ReadLE32(net + 20) : 0;
+        if (netNameOffsetW && netNameOffsetW < netSize) {
+            if (!AppendUnicodeString(target, MAX_PATH, &len, net + netNameOffsetW, netSize - netNameOffsetW)) return FALSE;
+        } else if (netNameOffset && netNameOffset < netSize) {
+            if (!AppendAnsiString(target, MAX_PATH, &len, net + netNameOffset, netSize - netNameOffset)) return FALSE;
+        } else {
+            return FALSE;
+        }
+    } else {
+        return FALSE;
+    }
+
+    // The suffix is usually empty for local paths; network links keep the
+    // path below the share here.
+    WCHAR suffix[MAX_PATH];
+    int suffixLen = 0;
+    suffix[0] = L'\0';
+    if (suffixOffsetW && suffixOffsetW < infoSize) {
+        if (!AppendUnicodeString(suffix, MAX_PATH, &suffixLen, info + suffixOffsetW, infoSize - suffixOffsetW)) return FALSE;
+    } else if (suffixOffset && suffixOffset < infoSize) {
+        if (!AppendAnsiString(suffix, MAX_PATH, &suffixLen, info + suffixOffset, infoSize - suffixOffset)) return FALSE;
+    }
+
+    if (suffixLen > 0) {
+        if (!AppendPathSeparator(target, MAX_PATH, &len)) return FALSE;
+        if (len + suffixLen >= MAX_PATH) return FALSE;
+        wmemcpy(target + len, suffix, suffixLen + 1);
+        len += suffixLen;
+    }
+
+    return len > 0;
+}
+
+// Builds the target path from the shell item ID list. Only the common
+// "My Computer -> drive -> file system entries" shape is understood; any other
+// item type (control panel, libraries, URIs...) rejects the link.
+static BOOL ParseLinkTargetIDList(const BYTE* list, DWORD listSize, WCHAR* target) {
+    int len = 0;
+    DWORD pos = 0;
+    target[0] = L'\0';
+
+    while (pos + 2 <= listSize) {
+        WORD itemSize = ReadLE16(list + pos);
+        if (itemSize == 0) break;
+        if (itemSize < 3 || pos + itemSize > listSize) return FALSE;
+
+        const BYTE* item = list + pos;
+        BYTE type = item[2];
+
+        if (type == 0x1F) {
+            // Root folder (CLSID), e.g. My Computer: contributes nothing
+        } else if ((type & 0x70) == 0x20) {
+            // Volume item: "C:\" as ASCII
+            if (len != 0) return FALSE;
+            if (!AppendAnsiString(target, MAX_PATH, &len, item + 3, itemSize - 3)) return FALSE;
+        } else if ((type & 0x70) == 0x30) {
+            // File entry: short 8.3 name, optionally followed by the BEEF0004
+            // extension block that carries the long Unicode name
+            if (len == 0 || itemSize < 14) return FALSE;
+            if (!AppendPathSeparator(target, MAX_PATH, &len)) return FALSE;
+
+            const BYTE* shortName = item + 14;
+            SIZE_T shortMax = itemSize - 14;
+            SIZE_T shortLen = 0;
+            while (shortLen < shortMax && shortName[shortLen]) shortLen++;
+            if (shortLen == shortMax) return FALSE;
+
+            BOOL haveLongName = FALSE;
+            DWORD extOffset = (DWORD)(14 + shortLen + 1);
+            if (extOffset & 1) extOffset++;
+            if (extOffset + 8 <= itemSize && ReadLE32(item + extOffset + 4) == 0xBEEF0004) {
+                const BYTE* ext = item + extOffset;
+                WORD extSize = ReadLE16(ext);
+                WORD extVersion = ReadLE16(ext + 2);
+                DWORD nameOffset = 18;
+                if (extVersion >= 7) nameOffset += 18;
+                if (extVersion >= 3) nameOffset += 2;
+                if (extVersion >= 9) nameOffset += 4;
+                if (extVersion >= 8) nameOffset += 4;
+                if (extSize <= itemSize - extOffset && nameOffset < extSize) {
+                    int saved = len;
+                    haveLongName = AppendUnicodeString(target, MAX_PATH, &len, ext + nameOffset, extSize - nameOffset);
+                    if (!haveLongName) {
+                        len = saved;
+                        target[len] = L'\0';
+                    }
+                }
+            }
+
+            if (!haveLongName &&
+                !AppendAnsiString(target, MAX_PATH, &len, shortName, shortMax)) {
+                return FALSE;
+            }
+        } else {
+            return FALSE;
+        }
+
+        pos += itemSize;
+    }
+
+    return len > 0;
+}
+
+// Reads one StringData entry; the returned string is optional (dest may be NULL).
+static BOOL ReadLinkString(const BYTE* data, SIZE_T size, SIZE_T* pos, BOOL isUnicode, WCHAR* dest) {
+    if (*pos + 2 > size) return FALSE;
+    WORD count = ReadLE16(data + *pos);
+    *pos += 2;
+
+    SIZE_T bytes = isUnicode ? (SIZE_T)count * 2 : count;
+    if (*pos + bytes > size) return FALSE;
+
+    if (dest) {
+        if (count >= MAX_PATH) return FALSE;
+        const BYTE* src = data + *pos;
+        for (WORD i = 0; i < count; i++) {
+            if (isUnicode) {
+                dest[i] = (WCHAR)ReadLE16(src + i * 2);
+            } else {
+                if (src[i] >= 0x80) return FALSE;
+                dest[i] = (WCHAR)src[i];
+            }
+        }
+        dest[count] = L'\0';
+    }
+
+    *pos += bytes;
+    return TRUE;
+}
+
+// Reads the TargetUnicode (or TargetAnsi) field of an EnvironmentVariable or
+// IconEnvironment extra data block.
+static BOOL ReadEnvironmentBlock(const BYTE* block, WCHAR* dest) {
+    int len = 0;
+    if (AppendUnicodeString(dest, MAX_PATH, &len, block + 8 + MAX_PATH, MAX_PATH * 2) && len > 0) {
+        return TRUE;
+    }
+    len = 0;
+    return AppendAnsiString(dest, MAX_PATH, &len, block + 8, MAX_PATH) && len > 0;
+}
+
+static BOOL ParseShellLink(const BYTE* data, SIZE_T size, ShellLinkInfo* info) {
+    info->szTarget[0] = L'\0';
+    info->szArguments[0] = L'\0';
+    info->szIconPath[0] = L'\0';
+    info->nIconIndex = 0;
+    info->bTargetHasEnvVars = FALSE;
+    info->bIconHasEnvVars = FALSE;
+
+    if (size < SHLLINK_HEADER_SIZE) return FALSE;
+    if (ReadLE32(data) != SHLLINK_HEADER_SIZE) return FALSE;
+    if (memcmp(data + 4, g_shellLinkClsid, sizeof(g_shellLinkClsid)) != 0) return FALSE;
+
+    DWORD flags = ReadLE32(data + 20);
+    BOOL isUnicode = (flags & SLDF_UNICODE) != 0;
+    info->nIconIndex = (int)ReadLE32(data + 56);
+
+    SIZE_T pos = SHLLINK_HEADER_SIZE;
+    const BYTE* idList = NULL;
+    WORD idListSize = 0;
+    const BYTE* linkInfo = NULL;
+    DWORD linkInfoSize = 0;
+
+    if (flags & SLDF_HAS_ID_LIST) {
+        if (pos + 2 > size) return FALSE;
+        idListSize = ReadLE16(data + pos);
+        pos += 2;
+        if (pos + idListSize > size) return FALSE;
+        idList = data + pos;
+        pos += idListSize;
+    }
+
+    if (flags & SLDF_HAS_LINK_INFO) {
+        if (pos + 4 > size) return FALSE;
+        linkInfoSize = ReadLE32(data + pos);
+        if (linkInfoSize < 4 || linkInfoSize > size - pos) return FALSE;
+        if (!(flags & SLDF_FORCE_NO_LINKINFO)) {
+            linkInfo = data + pos;
+        }
+        pos += linkInfoSize;
+    }
+
+    if ((flags & SLDF_HAS_NAME) && !ReadLinkString(data, size, &pos, isUnicode, NULL)) return FALSE;
+    if ((flags & SLDF_HAS_RELPATH) && !ReadLinkString(data, size, &pos, isUnicode, NULL)) return FALSE;
+    if ((flags & SLDF_HAS_WORKINGDIR) && !ReadLinkString(data, size, &pos, isUnicode, NULL)) return FALSE;
+    if ((flags & SLDF_HAS_ARGS) && !ReadLinkString(data, size, &pos, isUnicode, info->szArguments)) return FALSE;
+    if ((flags & SLDF_HAS_ICONLOCATION) && !ReadLinkString(data, size, &pos, isUnicode, info->szIconPath)) return FALSE;
+
+    // Extra data: walk the block list looking for the environment variable
+    // forms of the target and icon paths.
+    WCHAR envTarget[MAX_PATH];
+    WCHAR envIcon[MAX_PATH];
+    envTarget[0] = L'\0';
+    envIcon[0] = L'\0';
+
+    while (pos + 4 <= size) {
+        DWORD blockSize = ReadLE32(data + pos);
+        if (blockSize < 4) break;
+        if (blockSize < 8 || blockSize > size - pos) return FALSE;
+
+        const BYTE* block = data + pos;
+        DWORD signature = ReadLE32(block + 4);
+        if (blockSize == EXP_SZ_BLOCK_SIZE) {
+            if (signature == EXP_SZ_LINK_SIG && (flags & SLDF_HAS_EXP_SZ)) {
+                ReadEnvironmentBlock(block, envTarget);
+            } else if (signature == EXP_SZ_ICON_SIG && (flags & SLDF_HAS_EXP_ICON_SZ)) {
+                ReadEnvironmentBlock(block, envIcon);
+            }
+        }
+        pos += blockSize;
+    }
+
+    if (envIcon[0]) {
+        wcscpy_s(info->szIconPath, MAX_PATH, envIcon);
+        info->bIconHasEnvVars = TRUE;
+    } else if (wcschr(info->szIconPath, L'%')) {
+        info->bIconHasEnvVars = TRUE;
+    }
+
+    // Target precedence mirrors the shell: environment string, then LinkInfo,
+    // then the ID list.
+    if (envTarget[0]) {
+        wcscpy_s(info->szTarget, MAX_PATH, envTarget);
+        info->bTargetHasEnvVars = TRUE;
+        return TRUE;
+    }
+    if (linkInfo && ParseLinkInfo(linkInfo, linkInfoSize, info->szTarget)) {
+        return TRUE;
+    }
+    if (idList && ParseLinkTargetIDList(idList, idListSize, info->szTarget)) {
+        return TRUE;
+    }
+
+    info->szTarget[0] = L'\0';
+    return FALSE;
+}
+
+// Maps the .lnk file read-only and runs the native parser over it.
+static BOOL ReadShellLinkFile(const WCHAR* shortcutPath, ShellLinkInfo* info) {
+    BOOL success = FALSE;
+    HANDLE hFile = CreateFileW(shortcutPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart >= SHLLINK_HEADER_SIZE &&
+        fileSize.QuadPart <= 1024 * 1024) {
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping) {
+            const BYTE* data = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (data) {
+                success = ParseShellLink(data, (SIZE_T)fileSize.QuadPart, info);
+                UnmapViewOfFile(data);
+            }
+            CloseHandle(hMapping);
+        }
+    }
+
+    CloseHandle(hFile);
+
+    if (success && info->bTargetHasEnvVars) {
+        WCHAR expanded[MAX_PATH];
+        DWORD len = ExpandEnvironmentStringsW(info->szTarget, expanded, MAX_PATH);
+        if (len == 0 || len > MAX_PATH) return FALSE;
+        wcscpy_s(info->szTarget, MAX_PATH, expanded);
+    }
+    if (success && info->bIconHasEnvVars) {
+        WCHAR expanded[MAX_PATH];
+        DWORD len = ExpandEnvironmentStringsW(info->szIconPath, expanded, MAX_PATH);
+        if (len > 0 && len <= MAX_PATH) {
+            wcscpy_s(info->szIconPath, MAX_PATH, expanded);
+        }
+    }
+    return success;
+}
+
+// Native MS-SHLLINK writer, the counterpart of the parser above: serializes a
+// shortcut into a caller-supplied buffer without COM or Win32 calls. It emits
+// no ID list; the target is recorded in LinkInfo as a local base path, or for
+// a target on a network share as the share name and the path below it, which
+// the shell resolves on load just as it does for links it wrote itself.
+#define SHLLINK_LINKINFO_HEADER_SIZE 0x24
+#define SHLLINK_VOLUMEID_SIZE 0x11
+#define SHLLINK_MAX_SIZE 8192       // Header, LinkInfo, five MAX_PATH strings and an icon block
+#define SW_SHOWNORMAL_LINK 1
+
+typedef struct ShellLinkSpec {
+    const WCHAR* target;            // Absolute path, local or on netName
+    const WCHAR* netName;           // \\server\share holding the target, NULL if local
+    const WCHAR* deviceName;        // Drive letter mapped to netName ("Z:"), or NULL
+    const WCHAR* arguments;         // Optional strings may be NULL or empty
+    const WCHAR* workingDir;
+    const WCHAR* description;
+    const WCHAR* iconPath;          // May contain %VARIABLES%
+    int iconIndex;
+    DWORD targetAttributes;
+    FILETIME targetCreationTime;
+    FILETIME targetAccessTime;
+    FILETIME targetWriteTime;
+    DWORD targetSize;
+    DWORD driveType;
+    DWORD driveSerial;
+} ShellLinkSpec;
+
+static void WriteLE16(BYTE* p, WORD value) {
+    p[0] = (BYTE)value;
+    p[1] = (BYTE)(value >> 8);
+}
+
+static void WriteLE32(BYTE* p, DWORD value) {
+    p[0] = (BYTE)value;
+    p[1] = (BYTE)(value >> 8);
+    p[2] = (BYTE)(value >> 16);
+    p[3] = (BYTE)(value >> 24);
+}
+
+static void WriteFileTime(BYTE* p, const FILETIME* time) {
+    WriteLE32(p, time->dwLowDateTime);
+    WriteLE32(p + 4, time->dwHighDateTime);
+}
+
+// Single-byte copies of a path for readers that predate Unicode links. Only
+// 7-bit ASCII survives; the Unicode copy next to it is authoritative.
+static void WriteAnsiPath(BYTE* p, const WCHAR* text, SIZE_T length) {
+    for (SIZE_T i = 0; i < length; i++) {
+        p[i] = text[i] < 0x80 ? (BYTE)text[i] : '?';
+    }
+    p[length] = 0;
+}
+
+static void WriteUnicodePath(BYTE* p, const WCHAR* text, SIZE_T length) {
+    for (SIZE_T i = 0; i < length; i++) {
+        WriteLE16(p + i * 2, text[i]);
+    }
+    WriteLE16(p + length * 2, 0);
+}
+
+// StringData entry: a character count followed by unterminated UTF-16LE.
+static BOOL WriteLinkString(BYTE* out, SIZE_T capacity, SIZE_T* pos, const WCHAR* text) {
+    SIZE_T length = wcslen(text);
+    if (length >= MAX_PATH || capacity - *pos < 2 + length * 2) return FALSE;
+    WriteLE16(out + *pos, (WORD)length);
+    for (SIZE_T i = 0; i < length; i++) {
+        WriteLE16(out + *pos + 2 + i * 2, text[i]);
+    }
+    *pos += 2 + length * 2;
+    return TRUE;
+}
+
+// Returns the number of bytes written, or 0 if a path is too long or the
+// buffer too small.
+static SIZE_T WriteShellLink(const ShellLinkSpec* spec, BYTE* out, SIZE_T capacity) {
+    const WCHAR* arguments = spec->arguments ? spec->arguments : L"";
+    const WCHAR* workingDir = spec->workingDir ? spec->workingDir : L"";
+    const WCHAR* description = spec->description ? spec->description : L"";
+    const WCHAR* iconPath = spec->iconPath ? spec->iconPath : L"";
+
+    SIZE_T targetLength = wcslen(spec->target);
+    if (targetLength == 0 || targetLength >= MAX_PATH) return 0;
+    BOOL iconHasEnvVars = wcschr(iconPath, L'%') != NULL;
+
+    DWORD flags = SLDF_HAS_LINK_INFO | SLDF_UNICODE;
+    if (description[0]) flags |= SLDF_HAS_NAME;
+    if (workingDir[0]) flags |= SLDF_HAS_WORKINGDIR;
+    if (arguments[0]) flags |= SLDF_HAS_ARGS;
+    if (iconPath[0]) flags |= SLDF_HAS_ICONLOCATION;
+    if (iconHasEnvVars) flags |= SLDF_HAS_EXP_ICON_SZ;
+
+    // A target on a share is split into the share, named by the mapped drive
+    // letter if there is one, and the path below it
+    const WCHAR* netName = spec->netName;
+    const WCHAR* deviceName = netName ? spec->deviceName : NULL;
+    const WCHAR* suffix = L"";
+    SIZE_T netNameLength = netName ? wcslen(netName) : 0;
+    SIZE_T deviceNameLength = deviceName ? wcslen(deviceName) : 0;
+    if (netName) {
+        const WCHAR* prefix = deviceName ? deviceName : netName;
+        SIZE_T prefixLength = wcslen(prefix);
+        if (netNameLength == 0 || netNameLength >= MAX_PATH || deviceNameLength >= MAX_PATH ||
+            _wcsnicmp(spec->target, prefix, prefixLength) != 0 ||
+            spec->target[prefixLength] != L'\\') {
+            return 0;
+        }
+        suffix = spec->target + prefixLength + 1;
+    }
+    SIZE_T suffixLength = wcslen(suffix);
+
+    // LinkInfo: header, then either a VolumeID and the ANSI base path or a
+    // CommonNetworkRelativeLink naming the share, then the ANSI suffix and the
+    // Unicode strings the 0x24-byte header points at. Local targets keep the
+    // whole path in the base path and an empty suffix.
+    DWORD volumeOffset = 0;
+    DWORD localBaseOffset = 0;
+    DWORD networkOffset = 0;
+    DWORD netNameOffset = 0x1C;     // Past the fields, including the Unicode offsets
+    DWORD deviceNameOffset = 0;
+    DWORD netNameOffsetW = 0;
+    DWORD deviceNameOffsetW = 0;
+    DWORD networkSize = 0;
+    DWORD suffixOffset;
+    if (netName) {
+        networkOffset = SHLLINK_LINKINFO_HEADER_SIZE;
+        DWORD ansiEnd = netNameOffset + (DWORD)netNameLength + 1;
+        if (deviceName) {
+            deviceNameOffset = ansiEnd;
+            ansiEnd += (DWORD)deviceNameLength + 1;
+        }
+        netNameOffsetW = (ansiEnd + 1) & ~1u;
+        networkSize = netNameOffsetW + ((DWORD)netNameLength + 1) * 2;
+        if (deviceName) {
+            deviceNameOffsetW = networkSize;
+            networkSize += ((DWORD)deviceNameLength + 1) * 2;
+        }
+        suffixOffset = networkOffset + networkSize;
+    } else {
+        volumeOffset = SHLLINK_LINKINFO_HEADER_SIZE;
+        localBaseOffset = volumeOffset + SHLLINK_VOLUMEID_SIZE;
+        suffixOffset = localBaseOffset + (DWORD)targetLength + 1;
+    }
+    DWORD localBaseOffsetW = 0;
+    DWORD suffixOffsetW = (suffixOffset + (DWORD)suffixLength + 1 + 1) & ~1u;
+    if (!netName) {
+        localBaseOffsetW = suffixOffsetW;
+        suffixOffsetW = localBaseOffsetW + ((DWORD)targetLength + 1) * 2;
+    }
+    DWORD linkInfoSize = suffixOffsetW + ((DWORD)suffixLength + 1) * 2;
+
+    if (capacity < SHLLINK_HEADER_SIZE + linkInfoSize) return 0;
+    memset(out, 0, SHLLINK_HEADER_SIZE + linkInfoSize);
+
+    BYTE* header = out;
+    WriteLE32(header, SHLLINK_HEADER_SIZE);
+    memcpy(header + 4, g_shellLinkClsid, sizeof(g_shellLinkClsid));
+    WriteLE32(header + 20, flags);
+    WriteLE32(header + 24, spec->targetAttributes);
+    WriteFileTime(header + 28, &spec->targetCreationTime);
+    WriteFileTime(header + 36, &spec->targetAccessTime);
+    WriteFileTime(header + 44, &spec->targetWriteTime);
+    WriteLE32(header + 52, spec->targetSize);
+    WriteLE32(header + 56, (DWORD)spec->iconIndex);
+    WriteLE32(header + 60, SW_SHOWNORMAL_LINK);
+
+    BYTE* info = out + SHLLINK_HEADER_SIZE;
+    WriteLE32(info, linkInfoSize);
+    WriteLE32(info + 4, SHLLINK_LINKINFO_HEADER_SIZE);
+    WriteLE32(info + 8, netName ? LINKINFO_NETWORK_AND_PATHSUFFIX : LINKINFO_VOLUMEID_AND_LOCALBASEPATH);
+    WriteLE32(info + 12, volumeOffset);
+    WriteLE32(info + 16, localBaseOffset);
+    WriteLE32(info + 20, networkOffset);
+    WriteLE32(info + 24, suffixOffset);
+    WriteLE32(info + 28, localBaseOffsetW);
+    WriteLE32(info + 32, suffixOffsetW);
+
+    if (netName) {
+        // No provider type, which leaves the share to whichever network
+        // provider claims it
+        BYTE* network = info + networkOffset;
+        WriteLE32(network, networkSize);
+        WriteLE32(network + 4, deviceName ? CNRL_VALID_DEVICE : 0);
+        WriteLE32(network + 8, netNameOffset);
+        WriteLE32(network + 12, deviceNameOffset);
+        WriteLE32(network + 20, netNameOffsetW);
+        WriteLE32(network + 24, deviceNameOffsetW);
+        WriteAnsiPath(network + netNameOffset, netName, netNameLength);
+        WriteUnicodePath(network + netNameOffsetW, netName, netNameLength);
+        if (deviceName) {
+            WriteAnsiPath(network + deviceNameOffset, deviceName, deviceNameLength);
+            WriteUnicodePath(network + deviceNameOffsetW, deviceName, deviceNameLength);
+        }
+    } else {
+        BYTE* volume = info + volumeOffset;
+        WriteLE32(volume, SHLLINK_VOLUMEID_SIZE);
+        WriteLE32(volume + 4, spec->driveType);
+        WriteLE32(volume + 8, spec->driveSerial);
+        WriteLE32(volume + 12, 0x10);   // Empty ANSI volume label right after the fields
+
+        WriteAnsiPath(info + localBaseOffset, spec->target, targetLength);
+        WriteUnicodePath(info + localBaseOffsetW, spec->target, targetLength);
+    }
+    WriteAnsiPath(info + suffixOffset, suffix, suffixLength);
+    WriteUnicodePath(info + suffixOffsetW, suffix, suffixLength);
+
+    SIZE_T pos = SHLLINK_HEADER_SIZE + linkInfoSize;
+    if ((flags & SLDF_HAS_NAME) && !WriteLinkString(out, capacity, &pos, description)) return 0;
+    if ((flags & SLDF_HAS_WORKINGDIR) && !WriteLinkString(out, capacity, &pos, workingDir)) return 0;
+    if ((flags & SLDF_HAS_ARGS) && !WriteLinkString(out, capacity, &pos, arguments)) return 0;
+    if ((flags & SLDF_HAS_ICONLOCATION) && !WriteLinkString(out, capacity, &pos, iconPath)) return 0;
+
+    // The shell expands an icon path with variables from this block, keeping
+    // the link valid on machines where %SystemRoot% differs.
+    if (iconHasEnvVars) {
+        SIZE_T iconLength = wcslen(iconPath);
+        if (capacity - pos < EXP_SZ_BLOCK_SIZE) return 0;
+        BYTE* block = out + pos;
+        memset(block, 0, EXP_SZ_BLOCK_SIZE);
+        WriteLE32(block, EXP_SZ_BLOCK_SIZE);
+        WriteLE32(block + 4, EXP_SZ_ICON_SIG);
+        WriteAnsiPath(block + 8, iconPath, iconLength);
+        WriteUnicodePath(block + 8 + MAX_PATH, iconPath, iconLength);
+        pos += EXP_SZ_BLOCK_SIZE;
+    }
+
+    // TerminalBlock
+    if (capacity - pos < 4) return 0;
+    WriteLE32(out + pos, 0);
+    return pos + 4;
+}
+
+static BOOL ResolveShortcut(const WCHAR* shortcutPath, WCHAR* targetPath, int targetPathSize) {
+    // Fast path: parse the file ourselves
+    ShellLinkInfo linkInfo;
+    if (ReadShellLinkFile(shortcutPath, &linkInfo) && linkInfo.szTarget[0] != L'\0') {
+        return wcscpy_s(targetPath, targetPathSize, linkInfo.szTarget) == 0;
+    }
+
+    // Fallback: let the shell load links the parser rejects
+    BOOL success = FALSE;
+    IShellLinkW* pShellLink = NULL;
+    IPersistFile* pPersistFile = NULL;
+
+    HRESULT hr = CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER,
+                                   &IID_IShellLinkW, (void**)&pShellLink);
+    if (SUCCEEDED(hr)) {
+        hr = pShellLink->lpVtbl->QueryInterface(pShellLink, &IID_IPersistFile, (void**)&pPersistFile);
+        if (SUCCEEDED(hr)) {
+            hr = pPersistFile->lpVtbl->Load(pPersistFile, shortcutPath, STGM_READ);
+            if (SUCCEEDED(hr)) {
+                hr = pShellLink->lpVtbl->GetPath(pShellLink, targetPath, targetPathSize, NULL, 0);
+                if (SUCCEEDED(hr) && targetPath[0] != L'\0') {
+                    success = TRUE;
+                }
+            }
+            pPersistFile->lpVtbl->Release(pPersistFile);
+        }
+        pShellLink->lpVtbl->Release(pShellLink);
+    }
+
+    return success;
+}
+
+// Taskbar shortcuts (--add-to-taskbar, --add-to-taskbar-batch). Each folder
+// gets <folder>-shortcut.lnk next to it, launching FolderIcon.exe on that
+// folder with the folder's own icon. Everything about the target comes from
+// one look at FolderIcon.exe, so a shortcut costs a desktop.ini lookup and a
+// file write.
+#define SHORTCUT_MAX_THREADS 8
+#define SHORTCUT_PER_THREAD 16      // Smaller batches are not worth a thread
+#define SHORTCUT_SUFFIX L"-shortcut.lnk"
+
+typedef struct ShortcutTarget {
+    ShellLinkSpec spec;             // Target fields; per-folder strings are filled in per shortcut
+    WCHAR exeDir[MAX_PATH];
+    WCHAR netName[MAX_PATH];        // Share holding FolderIcon.exe, empty if local
+    WCHAR deviceName[3];            // Drive letter mapped to it, empty if none
+} ShortcutTarget;
+
+// Finds the share FolderIcon.exe lives on. A UNC volume root is the share
+// itself. For a mapped drive the share comes from the file's UNC name, minus
+// the path below the drive letter; if that tail does not match (a link on the
+// share), the share cannot be named and FALSE is returned.
+static BOOL GetShortcutShare(ShortcutTarget* target, const WCHAR* volumeRoot) {
+    SIZE_T rootLength = wcslen(volumeRoot);
+    if (rootLength > 0 && volumeRoot[rootLength - 1] == L'\\') rootLength--;
+    if (volumeRoot[0] == L'\\') {
+        wmemcpy(target->netName, volumeRoot, rootLength);
+        target->netName[rootLength] = L'\0';
+        return TRUE;
+    }
+    if (rootLength != 2 || volumeRoot[1] != L':') return FALSE;
+
+    HANDLE hFile = CreateFileW(g_exePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, 0, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    WCHAR uncPath[MAX_PATH + 8];    // \\?\UNC\server\share\...
+    DWORD uncLength = GetFinalPathNameByHandleW(hFile, uncPath, MAX_PATH + 8, FILE_NAME_NORMALIZED | VOLUME_NAME_DOS);
+    CloseHandle(hFile);
+    if (uncLength < 8 || uncLength >= MAX_PATH + 8 || _wcsnicmp(uncPath, L"\\\\?\\UNC\\", 8) != 0) return FALSE;
+
+    const WCHAR* below = g_exePath + rootLength;
+    SIZE_T belowLength = wcslen(below);
+    if (uncLength - 8 <= belowLength || _wcsicmp(uncPath + uncLength - belowLength, below) != 0) return FALSE;
+    SIZE_T shareLength = uncLength - 8 - belowLength;
+    if (2 + shareLength >= MAX_PATH) return FALSE;
+    target->netName[0] = L'\\';
+    target->netName[1] = L'\\';
+    wmemcpy(target->netName + 2, uncPath + 8, shareLength);
+    target->netName[2 + shareLength] = L'\0';
+    wmemcpy(target->deviceName, volumeRoot, 2);
+    target->deviceName[2] = L'\0';
+    return TRUE;
+}
+
+static BOOL GetShortcutTarget(ShortcutTarget* target) {
+    ZeroMemory(target, sizeof(*target));
+    if (!g_exePath[0]) return FALSE;
+
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExW(g_exePath, GetFileExInfoStandard, &attributes)) return FALSE;
+
+    WCHAR volumeRoot[MAX_PATH];
+    if (!GetVolumePathNameW(g_exePath, volumeRoot, MAX_PATH)) return FALSE;
+    DWORD serial = 0;
+    GetVolumeInformationW(volumeRoot, NULL, 0, &serial, NULL, NULL, NULL, 0);
+
+    wcscpy_s(target->exeDir, MAX_PATH, g_exePath);
+    WCHAR* lastSlash = wcsrchr(target->exeDir, L'\\');
+    if (lastSlash) *lastSlash = L'\0';
+
+    ShellLinkSpec* spec = &target->spec;
+    spec->target = g_exePath;
+    spec->workingDir = target->exeDir;
+    spec->targetAttributes = attributes.dwFileAttributes;
+    spec->targetCreationTime = attributes.ftCreationTime;
+    spec->targetAccessTime = attributes.ftLastAccessTime;
+    spec->targetWriteTime = attributes.ftLastWriteTime;
+    spec->targetSize = attributes.nFileSizeLow;
+    spec->driveType = GetDriveTypeW(volumeRoot);
+    spec->driveSerial = serial;
+
+    // A VolumeID only finds local volumes; on a share the link names the
+    // share instead
+    if (spec->driveType == DRIVE_REMOTE || volumeRoot[0] == L'\\') {
+        if (!GetShortcutShare(target, volumeRoot)) return FALSE;
+        spec->netName = target->netName;
+        spec->deviceName = target->deviceName[0] ? target->deviceName : NULL;
+    }
+    return TRUE;
+}
+
+// Writes the shortcut for one folder. Safe to call from several threads at
+// once. On failure the thread's last error says why.
+static BOOL WriteFolderShortcut(const ShortcutTarget* target, const WCHAR* folderPath) {
+    SIZE_T folderLength = wcslen(folderPath);
+    if (folderLength == 0 || folderLength + wcslen(SHORTCUT_SUFFIX) >= MAX_PATH) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    WCHAR args[MAX_PATH + 3];
+    swprintf_s(args, MAX_PATH + 3, L"\"%s\"", folderPath);
+
+    WCHAR iconPath[MAX_PATH];
+    int iconIndex = 0;
+    GetFolderIconLocation(folderPath, iconPath, &iconIndex);
+
+    const WCHAR* nameStart = wcsrchr(folderPath, L'\\');
+    const WCHAR* folderName = (nameStart && nameStart[1]) ? nameStart + 1 : L"FolderIcon";
+
+    ShellLinkSpec spec = target->spec;
+    spec.arguments = args;
+    spec.description = folderName;
+    spec.iconPath = iconPath;
+    spec.iconIndex = iconIndex;
+
+    BYTE link[SHLLINK_MAX_SIZE];
+    SIZE_T linkSize = WriteShellLink(&spec, link, sizeof(link));
+    if (!linkSize) {
+        SetLastError(ERROR_FILENAME_EXCED_RANGE);
+        return FALSE;
+    }
+
+    // Same location as the folder with a "-shortcut" suffix
+    // e.g., C:\Users\Name\MyFolder -> C:\Users\Name\MyFolder-shortcut.lnk
+    WCHAR shortcutPath[MAX_PATH];
+    swprintf_s(shortcutPath, MAX_PATH, L"%s" SHORTCUT_SUFFIX, folderPath);
+
+    HANDLE hFile = CreateFileW(shortcutPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    DWORD written = 0;
+    BOOL success = WriteFile(hFile, link, (DWORD)linkSize, &written, NULL) && written == linkSize;
+    DWORD error = GetLastError();
+    CloseHandle(hFile);
+    if (!success) {
+        DeleteFileW(shortcutPath);
+        SetLastError(error);
+    }
+    return success;
+}
+
+static BOOL CreateFolderIconShortcut(const WCHAR* folderPath) {
+    if (!folderPath || !folderPath[0]) {
+        return FALSE;
+    }
+
+    ShortcutTarget target;
+    if (!GetShortcutTarget(&target) || !WriteFolderShortcut(&target, folderPath)) {
+        ShowNotification(L"FolderIcon", L"Failed to create shortcut", TRUE);
+        return FALSE;
+    }
+
+    const WCHAR* nameStart = wcsrchr(folderPath, L'\\');
+    WCHAR msg[MAX_PATH];
+    swprintf_s(msg, MAX_PATH, L"Shortcut created: %s" SHORTCUT_SUFFIX,
+               (nameStart && nameStart[1]) ? nameStart + 1 : L"FolderIcon");
+    ShowNotification(L"FolderIcon", msg, FALSE);
+    return TRUE;
+}
+
+typedef struct ShortcutRequest {
+    WCHAR folderPath[MAX_PATH];
+    DWORD error;                    // ERROR_SUCCESS once written
+} ShortcutRequest;
+
+typedef struct ShortcutBatch {
+    const ShortcutTarget* target;
+    ShortcutRequest* requests;
+    int count;
+    volatile LONG next;
+} ShortcutBatch;
+
+static DWORD WINAPI ShortcutBatchThread(LPVOID param) {
+    ShortcutBatch* batch = (ShortcutBatch*)param;
+    for (;;) {
+        LONG i = InterlockedIncrement(&batch->next) - 1;
+        if (i >= batch->count) break;
+        ShortcutRequest* request = &batch->requests[i];
+        if (request->error != ERROR_SUCCESS) continue;  // Rejected while parsing the list
+        request->error = WriteFolderShortcut(batch->target, request->folderPath) ? ERROR_SUCCESS : GetLastError();
+    }
+    return 0;
+}
+
+static void WriteFolderShortcuts(const ShortcutTarget* target, ShortcutRequest* requests, int count) {
+    ShortcutBatch batch = { target, requests, count, 0 };
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int threadCount = min((int)si.dwNumberOfProcessors, SHORTCUT_MAX_THREADS);
+    threadCount = max(1, min(threadCount, count / SHORTCUT_PER_THREAD));
+
+    HANDLE threads[SHORTCUT_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < threadCount; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, ShortcutBatchThread, &batch, 0, NULL);
+        if (hThread) threads[started++] = hThread;
+    }
+    ShortcutBatchThread(&batch);
+
+    if (started > 0) WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+    for (int i = 0; i < started; i++) {
+        CloseHandle(threads[i]);
+    }
+}
+
+// Reads a whole text file (a folder list or a rules file), or stdin for
+// "-", and decodes it: UTF-16LE with a BOM, otherwise UTF-8 (with or without a BOM),
+// or the ANSI code page if the bytes are not valid UTF-8.
+static WCHAR* ReadTextFile(const WCHAR* source) {
+    HANDLE hInput;
+    BOOL isStdin = wcscmp(source, L"-") == 0;
+    if (isStdin) {
+        hInput = GetStdHandle(STD_INPUT_HANDLE);
+        if (!hInput || hInput == INVALID_HANDLE_VALUE) return NULL;
+    } else {
+        hInput = CreateFileW(source, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (hInput == INVALID_HANDLE_VALUE) return NULL;
+    }
+
+    SIZE_T size = 0, capacity = 64 * 1024;
+    BYTE* bytes = (BYTE*)malloc(capacity + 2);
+    while (bytes) {
+        if (size == capacity) {
+            BYTE* grown = (BYTE*)realloc(bytes, capacity * 2 + 2);
+            if (!grown) {
+                free(bytes);
+                bytes = NULL;
+                break;
+            }
+            bytes = grown;
+            capacity *= 2;
+        }
+        DWORD read = 0;
+        if (!ReadFile(hInput, bytes + size, (DWORD)min(capacity - size, 1u << 30), &read, NULL) || read == 0) break;
+        size += read;
+    }
+    if (!isStdin) CloseHandle(hInput);
+    if (!bytes) return NULL;
+
+    WCHAR* text = NULL;
+    if (size >= 2 && bytes[0] == 0xFF && bytes[1] == 0xFE) {
+        SIZE_T length = (size - 2) / 2;
+        text = (WCHAR*)malloc((length + 1) * sizeof(WCHAR));
+        if (text) {
+            memcpy(text, bytes + 2, length * sizeof(WCHAR));
+            text[length] = L'\0';
+        }
+    } else {
+        const BYTE* start = bytes;
+        if (size >= 3 && bytes[0] == 0xEF && bytes[1] == 0xBB && bytes[2] == 0xBF) {
+            start += 3;
+            size -= 3;
+        }
+        UINT codePage = CP_UTF8;
+        int length = size ? MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, (const char*)start, (int)size, NULL, 0) : 0;
+        if (size && !length) {
+            codePage = CP_ACP;
+            length = MultiByteToWideChar(CP_ACP, 0, (const char*)start, (int)size, NULL, 0);
+        }
+        text = (WCHAR*)malloc(((SIZE_T)length + 1) * sizeof(WCHAR));
+        if (text) {
+            if (length) MultiByteToWideChar(codePage, 0, (const char*)start, (int)size, text, length);
+            text[length] = L'\0';
+        }
+    }
+    free(bytes);
+    return text;
+}
+
+// Splits the list into requests: one folder per line, surrounding quotes and
+// whitespace ignored, blank lines and lines starting with '#' skipped.
+// Relative paths are taken from the current directory.
+static ShortcutRequest* ParseFolderList(WCHAR* text, int* count) {
+    int lines = 1;
+    for (const WCHAR* p = text; *p; p++) {
+        if (*p == L'\n') lines++;
+    }
+
+    ShortcutRequest* requests = (ShortcutRequest*)malloc((SIZE_T)lines * sizeof(ShortcutRequest));
+    *count = 0;
+    if (!requests) return NULL;
+
+    WCHAR* line = text;
+    while (line) {
+        WCHAR* next = wcschr(line, L'\n');
+        if (next) *next++ = L'\0';
+
+        WCHAR* end = line + wcslen(line);
+        while (*line == L' ' || *line == L'\t' || *line == L'"') line++;
+        while (end > line && (end[-1] == L' ' || end[-1] == L'\t' || end[-1] == L'\r' || end[-1] == L'"')) end--;
+        *end = L'\0';
+
+        if (line[0] && line[0] != L'#') {
+            ShortcutRequest* request = &requests[*count];
+            DWORD length = GetFullPathNameW(line, MAX_PATH, request->folderPath, NULL);
+            if (length == 0 || length >= MAX_PATH) {
+                wcsncpy_s(request->folderPath, MAX_PATH, line, _TRUNCATE);
+                request->error = ERROR_FILENAME_EXCED_RANGE;
+            } else {
+                // C:\Folder\ names the same folder as C:\Folder
+                if (length > 3 && request->folderPath[length - 1] == L'\\') {
+                    request->folderPath[length - 1] = L'\0';
+                }
+                request->error = ERROR_SUCCESS;
+            }
+            (*count)++;
+        }
+        line = next;
+    }
+    return requests;
+}
+
+static void ConsolePrintPath(const char* format, const WCHAR* path, DWORD error) {
+    char utf8[MAX_PATH * 3];
+    if (!WideCharToMultiByte(CP_UTF8, 0, path, -1, utf8, sizeof(utf8), NULL, NULL)) utf8[0] = '\0';
+    ConsolePrint(format, utf8, error);
+}
+
+// --add-to-taskbar-batch <file|->: one shortcut per listed folder, written in
+// parallel. Failures and a summary go to the console. Returns the exit code.
+static int CreateFolderIconShortcuts(const WCHAR* source) {
+    OpenConsoleOutput();
+
+    WCHAR* text = ReadTextFile(source);
+    if (!text) {
+        ConsolePrint("add-to-taskbar: cannot read the folder list (error %lu)\n", GetLastError());
+        return 1;
+    }
+    int count = 0;
+    ShortcutRequest* requests = ParseFolderList(text, &count);
+    free(text);
+    if (!requests) {
+        ConsolePrint("add-to-taskbar: out of memory\n");
+        return 1;
+    }
+
+    ShortcutTarget target;
+    if (!GetShortcutTarget(&target)) {
+        ConsolePrint("add-to-taskbar: cannot read FolderIcon.exe (error %lu)\n", GetLastError());
+        free(requests);
+        return 1;
+    }
+
+    LARGE_INTEGER frequency, start, end;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+    WriteFolderShortcuts(&target, requests, count);
+    QueryPerformanceCounter(&end);
+
+    int created = 0;
+    for (int i = 0; i < count; i++) {
+        if (requests[i].error == ERROR_SUCCESS) {
+            created++;
+        } else {
+            ConsolePrintPath("add-to-taskbar: %s: failed (error %lu)\n", requests[i].folderPath, requests[i].error);
+        }
+    }
+    ConsolePrint("add-to-taskbar: created %d of %d shortcuts in %.1f ms\n", created, count,
+                 (end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart);
+
+    free(requests);
+    return created == count ? 0 : 1;
+}
+
+// Persistent icon cache. Two files under %LOCALAPPDATA%\FolderIcon hold
+// ICON_MASTER_SIZE x ICON_MASTER_SIZE 32bpp premultiplied bitmaps keyed by
+// icon source path, size and last-write time: iconcache.bin, and
+// iconcache-recent.bin with the misses since iconcache.bin was last
+// rewritten. Both are mapped read-only and hits are resampled straight from
+// the mapped pages to the popup's icon level; the recent file wins. A load's
+// misses are merged into the recent file once loading is done, so a new icon
+// costs a rewrite of that small file only. Once it holds more than
+// ICON_CACHE_RECENT_MAX_ENTRIES it is folded into iconcache.bin.
+//
+// Layout of either file: IconCacheHeader, entryCount IconCacheEntry records
+// sorted by keyHash, then entryCount pixel blocks.
+#define ICON_CACHE_MAGIC 0x43434946 // "FICC"
+#define ICON_CACHE_VERSION 2
+#define ICON_CACHE_MAX_ENTRIES 4096
+#define ICON_CACHE_RECENT_MAX_ENTRIES 256   // 4 MB of masters
+#define ICON_CACHE_FILE L"iconcache.bin"
+#define ICON_CACHE_RECENT_FILE L"iconcache-recent.bin"
+#define ICON_PIXEL_BYTES (ICON_MASTER_SIZE * ICON_MASTER_SIZE * 4)
+
+typedef struct IconCacheHeader {
+    DWORD magic;
+    DWORD version;
+    DWORD iconSize;
+    DWORD entryCount;
+} IconCacheHeader;
+
+typedef struct IconCacheEntry {
+    ULONGLONG keyHash;
+    ULONGLONG lastWriteTime;
+    ULONGLONG fileSize;
+    DWORD pixelOffset;
+    DWORD checksum;
+} IconCacheEntry;
+
+typedef struct IconCacheKey {
+    ULONGLONG keyHash;
+    ULONGLONG lastWriteTime;
+    ULONGLONG fileSize;
+} IconCacheKey;
+
+typedef struct IconCacheFile {
+    HANDLE hFile;
+    HANDLE hMapping;
+    const BYTE* view;
+    SIZE_T viewSize;
+    const IconCacheEntry* entries;  // NULL unless the file is valid
+    DWORD entryCount;
+} IconCacheFile;
+
+typedef struct IconCache {
+    IconCacheFile main;
+    IconCacheFile recent;
+    BOOL needsRewrite;      // iconcache.bin is missing or damaged: fold into it
+
+    // Misses collected during this load
+    IconCacheEntry* pending;
+    BYTE* pendingPixels;
+    DWORD pendingCount;
+    DWORD pendingCapacity;
+
+    volatile LONG hits;
+    volatile LONG misses;
+} IconCache;
+
+// Checks that a mapped cache file is internally consistent. Anything that
+// fails here is treated as an empty cache and rebuilt.
+static BOOL IconCacheValidate(const BYTE* data, SIZE_T size, DWORD iconSize) {
+    if (size < sizeof(IconCacheHeader)) return FALSE;
+
+    const IconCacheHeader* header = (const IconCacheHeader*)data;
+    if (header->magic != ICON_CACHE_MAGIC || header->version != ICON_CACHE_VERSION ||
+        header->iconSize != iconSize || header->entryCount > ICON_CACHE_MAX_ENTRIES) {
+        return FALSE;
+    }
+
+    SIZE_T pixelBytes = (SIZE_T)iconSize * iconSize * 4;
+    SIZE_T tableEnd = sizeof(IconCacheHeader) + (SIZE_T)header->entryCount * sizeof(IconCacheEntry);
+    if (size != tableEnd + (SIZE_T)header->entryCount * pixelBytes) return FALSE;
+
+    const IconCacheEntry* entries = (const IconCacheEntry*)(data + sizeof(IconCacheHeader));
+    for (DWORD i = 0; i < header->entryCount; i++) {
+        if (i > 0 && entries[i].keyHash <= entries[i - 1].keyHash) return FALSE;
+        if (entries[i].pixelOffset < tableEnd || entries[i].pixelOffset > size - pixelBytes) return FALSE;
+    }
+    return TRUE;
+}
+
+// Binary search over the sorted entry table. Returns the pixels for a fresh
+// entry, or NULL when the key is missing, stale or its pixels are damaged.
+// The entry checksum is the low half of the pixels' HashPixels value, which
+// is returned in *pixelHash.
+static const BYTE* IconCacheFind(const BYTE* data, const IconCacheEntry* entries, DWORD count,
+                                 const IconCacheKey* key, BOOL* corrupt, ULONGLONG* pixelHash) {
+    DWORD lo = 0, hi = count;
+    while (lo < hi) {
+        DWORD mid = lo + (hi - lo) / 2;
+        if (entries[mid].keyHash < key->keyHash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo >= count || entries[lo].keyHash != key->keyHash) return NULL;
+
+    const IconCacheEntry* entry = &entries[lo];
+    if (entry->lastWriteTime != key->lastWriteTime || entry->fileSize != key->fileSize) return NULL;
+
+    const BYTE* pixels = data + entry->pixelOffset;
+    *pixelHash = HashPixels(pixels, ICON_PIXEL_BYTES);
+    if ((DWORD)*pixelHash != entry->checksum) {
+        *corrupt = TRUE;
+        return NULL;
+    }
+    return pixels;
+}
+
+// Maps a cache file. Returns FALSE if it is missing or not valid.
+static BOOL IconCacheFileOpen(IconCacheFile* file, const WCHAR* fileName) {
+    ZeroMemory(file, sizeof(*file));
+    file->hFile = INVALID_HANDLE_VALUE;
+
+    WCHAR cachePath[MAX_PATH];
+    if (!GetIconCachePath(cachePath, fileName)) return FALSE;
+
+    file->hFile = CreateFileW(cachePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file->hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(file->hFile, &fileSize) && fileSize.QuadPart > 0) {
+        file->hMapping = CreateFileMappingW(file->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (file->hMapping) {
+            file->view = (const BYTE*)MapViewOfFile(file->hMapping, FILE_MAP_READ, 0, 0, 0);
+            file->viewSize = (SIZE_T)fileSize.QuadPart;
+        }
+    }
+
+    if (!file->view || !IconCacheValidate(file->view, file->viewSize, ICON_MASTER_SIZE)) return FALSE;
+    file->entries = (const IconCacheEntry*)(file->view + sizeof(IconCacheHeader));
+    file->entryCount = ((const IconCacheHeader*)file->view)->entryCount;
+    return TRUE;
+}
+
+static void IconCacheFileClose(IconCacheFile* file) {
+    if (file->view) UnmapViewOfFile(file->view);
+    if (file->hMapping) CloseHandle(file->hMapping);
+    if (file->hFile != INVALID_HANDLE_VALUE) CloseHandle(file->hFile);
+    file->view = NULL;
+    file->hMapping = NULL;
+    file->hFile = INVALID_HANDLE_VALUE;
+    file->entries = NULL;
+    file->entryCount = 0;
+}
+
+static void IconCacheOpen(IconCache* cache) {
+    ZeroMemory(cache, sizeof(*cache));
+    if (!IconCacheFileOpen(&cache->main, ICON_CACHE_FILE)) cache->needsRewrite = TRUE;
+    IconCacheFileOpen(&cache->recent, ICON_CACHE_RECENT_FILE);
+}
+
+// Looks a key up in the recent file, then in iconcache.bin. Returns the
+// mapped pixels and their HashPixels value, or NULL.
+static const BYTE* IconCacheLookup(IconCache* cache, const IconCacheKey* key, ULONGLONG* pixelHash) {
+    BOOL corrupt = FALSE;
+    const BYTE* pixels = NULL;
+    if (cache->recent.entries) {
+        pixels = IconCacheFind(cache->recent.view, cache->recent.entries, cache->recent.entryCount, key,
+                               &corrupt, pixelHash);
+    }
+    if (!pixels && cache->main.entries) {
+        pixels = IconCacheFind(cache->main.view, cache->main.entries, cache->main.entryCount, key,
+                               &corrupt, pixelHash);
+    }
+    if (corrupt) cache->needsRewrite = TRUE;
+    return pixels;
+}
+
+static BOOL GetIconCacheKey(const WCHAR* iconPath, IconCacheKey* key) {
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExW(iconPath, GetFileExInfoStandard, &fad)) return FALSE;
+
+    // Folder icons come from desktop.ini, whose edits do not touch the
+    // folder's own timestamp, so folders are never cached
+    if (fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) return FALSE;
+
+    key->keyHash = HashPath(iconPath);
+    key->lastWriteTime = ((ULONGLONG)fad.ftLastWriteTime.dwHighDateTime << 32) | fad.ftLastWriteTime.dwLowDateTime;
+    key->fileSize = ((ULONGLONG)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+    return TRUE;
+}
+
+static void IconCacheAdd(IconCache* cache, const IconCacheKey* key, const BYTE* pixels, ULONGLONG pixelHash) {
+    if (cache->pendingCount >= ICON_CACHE_MAX_ENTRIES) return;
+
+    if (cache->pendingCount == cache->pendingCapacity) {
+        DWORD newCapacity = cache->pendingCapacity ? cache->pendingCapacity * 2 : 32;
+        IconCacheEntry* entries = realloc(cache->pending, newCapacity * sizeof(IconCacheEntry));
+        if (!entries) return;
+        cache->pending = entries;
+        BYTE* newPixels = realloc(cache->pendingPixels, (SIZE_T)newCapacity * ICON_PIXEL_BYTES);
+        if (!newPixels) return;
+        cache->pendingPixels = newPixels;
+        cache->pendingCapacity = newCapacity;
+    }
+
+    IconCacheEntry* entry = &cache->pending[cache->pendingCount];
+    entry->keyHash = key->keyHash;
+    entry->lastWriteTime = key->lastWriteTime;
+    entry->fileSize = key->fileSize;
+    entry->pixelOffset = cache->pendingCount * ICON_PIXEL_BYTES;
+    entry->checksum = (DWORD)pixelHash;
+    memcpy(cache->pendingPixels + entry->pixelOffset, pixels, ICON_PIXEL_BYTES);
+    cache->pendingCount++;
+}
+
+static int CompareCacheEntries(const void* a, const void* b) {
+    ULONGLONG ha = ((const IconCacheEntry*)a)->keyHash;
+    ULONGLONG hb = ((const IconCacheEntry*)b)->keyHash;
+    return ha < hb ? -1 : ha > hb ? 1 : 0;
+}
+
+// Merges two tables sorted by keyHash into merged. a's pixels are given per
+// entry; b's are at their pixelOffset in bView. On equal keys a wins (b's
+// entry is stale), and b contributes only as many entries as fit in
+// maxCount after all of a's. Returns the merged count.
+static DWORD IconCacheMerge(const IconCacheEntry* a, const BYTE* const* aSources, DWORD aCount,
+                            const IconCacheEntry* b, const BYTE* bView, DWORD bCount, DWORD maxCount,
+                            IconCacheEntry* merged, const BYTE** sources) {
+    DWORD bBudget = maxCount > aCount ? maxCount - aCount : 0;
+    DWORD count = 0, i = 0, j = 0;
+    while (i < aCount || j < bCount) {
+        if (j < bCount && (i >= aCount || b[j].keyHash < a[i].keyHash)) {
+            if (bBudget > 0) {
+                bBudget--;
+                merged[count] = b[j];
+                sources[count++] = bView + b[j].pixelOffset;
+            }
+            j++;
+        } else {
+            if (j < bCount && b[j].keyHash == a[i].keyHash) j++;
+            merged[count] = a[i];
+            sources[count++] = aSources[i];
+            i++;
+        }
+    }
+    return count;
+}
+
+// Writes a cache file to tempPath. The pixel offsets in entries are
+// rewritten for the new layout.
+static BOOL IconCacheWriteFile(const WCHAR* tempPath, IconCacheEntry* entries, const BYTE* const* sources,
+                               DWORD count) {
+    DWORD tableEnd = (DWORD)(sizeof(IconCacheHeader) + count * sizeof(IconCacheEntry));
+    for (DWORD i = 0; i < count; i++) {
+        entries[i].pixelOffset = tableEnd + i * ICON_PIXEL_BYTES;
+    }
+
+    HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    IconCacheHeader header = { ICON_CACHE_MAGIC, ICON_CACHE_VERSION, ICON_MASTER_SIZE, count };
+    DWORD written;
+    BOOL ok = WriteFile(hFile, &header, sizeof(header), &written, NULL) &&
+              WriteFile(hFile, entries, count * sizeof(IconCacheEntry), &written, NULL);
+    for (DWORD i = 0; ok && i < count; i++) {
+        ok = WriteFile(hFile, sources[i], ICON_PIXEL_BYTES, &written, NULL);
+    }
+    CloseHandle(hFile);
+    if (!ok) DeleteFileW(tempPath);
+    return ok;
+}
+
+// Merges the misses from this load into the recent file, or folds
+// everything into iconcache.bin once the recent file is full (or the main
+// file needs replacing). Files are written to a temporary file first and
+// moved into place, so a crash or a concurrent popup never sees a torn file.
+// Old entries are copied as they are: a damaged one fails its checksum on
+// lookup and is replaced by a fresh miss.
+static void IconCacheWrite(IconCache* cache) {
+    WCHAR mainPath[MAX_PATH], recentPath[MAX_PATH], tempPath[MAX_PATH];
+    if (!GetIconCachePath(mainPath, ICON_CACHE_FILE) || !GetIconCachePath(recentPath, ICON_CACHE_RECENT_FILE)) {
+        return;
+    }
+
+    // Several items can share an icon source, so a miss can repeat
+    qsort(cache->pending, cache->pendingCount, sizeof(IconCacheEntry), CompareCacheEntries);
+    DWORD pendingCount = 0;
+    for (DWORD i = 0; i < cache->pendingCount; i++) {
+        if (pendingCount > 0 && cache->pending[i].keyHash == cache->pending[pendingCount - 1].keyHash) continue;
+        cache->pending[pendingCount++] = cache->pending[i];
+    }
+
+    DWORD recentMax = pendingCount + cache->recent.entryCount;
+    DWORD mainMax = min(recentMax + cache->main.entryCount, ICON_CACHE_MAX_ENTRIES);
+    IconCacheEntry* recent = malloc((recentMax + 1) * sizeof(IconCacheEntry));
+    const BYTE** recentSources = malloc((recentMax + 1) * sizeof(BYTE*));
+    IconCacheEntry* merged = malloc((mainMax + 1) * sizeof(IconCacheEntry));
+    const BYTE** sources = malloc((mainMax + 1) * sizeof(BYTE*));
+    if (!recent || !recentSources || !merged || !sources) {
+        free(recent);
+        free(recentSources);
+        free(merged);
+        free(sources);
+        return;
+    }
+
+    for (DWORD i = 0; i < pendingCount; i++) {
+        sources[i] = cache->pendingPixels + cache->pending[i].pixelOffset;
+    }
+    DWORD recentCount = IconCacheMerge(cache->pending, sources, pendingCount, cache->recent.entries,
+                                       cache->recent.view, cache->recent.entryCount, ICON_CACHE_MAX_ENTRIES,
+                                       recent, recentSources);
+
+    swprintf_s(tempPath, MAX_PATH, L"%s.%lu.tmp", mainPath, GetCurrentProcessId());
+    if (recentCount <= ICON_CACHE_RECENT_MAX_ENTRIES && !cache->needsRewrite) {
+        BOOL ok = IconCacheWriteFile(tempPath, recent, recentSources, recentCount);
+
+        // A mapped file cannot be replaced
+        IconCacheFileClose(&cache->recent);
+        if (ok && !MoveFileExW(tempPath, recentPath, MOVEFILE_REPLACE_EXISTING)) {
+            DeleteFileW(tempPath);
+        }
+    } else {
+        DWORD count = IconCacheMerge(recent, recentSources, recentCount, cache->main.entries, cache->main.view,
+                                     cache->main.entryCount, ICON_CACHE_MAX_ENTRIES, merged, sources);
+        BOOL ok = IconCacheWriteFile(tempPath, merged, sources, count);
+
+        IconCacheFileClose(&cache->main);
+        IconCacheFileClose(&cache->recent);
+        if (ok) {
+            if (MoveFileExW(tempPath, mainPath, MOVEFILE_REPLACE_EXISTING)) {
+                DeleteFileW(recentPath);
+            } else {
+                DeleteFileW(tempPath);
+            }
+        }
+    }
+
+    free(recent);
+    free(recentSources);
+    free(merged);
+    free(sources);
+}
+
+// Unmaps the cache; with persist, misses collected by this load are written
+// back first.
+static void IconCacheClose(IconCache* cache, BOOL persist) {
+    if (persist && (cache->pendingCount > 0 || cache->needsRewrite)) {
+        IconCacheWrite(cache);
+    }
+
+    IconCacheFileClose(&cache->main);
+    IconCacheFileClose(&cache->recent);
+    free(cache->pending);
+    free(cache->pendingPixels);
+    TraceCounter("IconCache", "hits", cache->hits, "misses", cache->misses);
+}
+
+static void PremultiplyPixels(BYTE* pixels, int count) {
+    for (int i = 0; i < count; i++, pixels += 4) {
+        BYTE a = pixels[3];
+        if (a != 255) {
+            pixels[0] = (BYTE)((pixels[0] * a + 127) / 255);
+            pixels[1] = (BYTE)((pixels[1] * a + 127) / 255);
+            pixels[2] = (BYTE)((pixels[2] * a + 127) / 255);
+        }
+    }
+}
+
+// Per-monitor DPI. Layout constants are at 96 DPI. Icons come in levels: the
+// icon cache keeps one ICON_MASTER_SIZE master per icon, and each popup
+// resamples masters down to the level for its monitor, so moving to another
+// monitor rebuilds the image list without going back to the source files.
+static int ScaleForDpi(int value) {
+    return MulDiv(value, (int)g_dpi, USER_DEFAULT_SCREEN_DPI);
+}
+
+// ICON_SIZE scaled to the nearest multiple of 8 (40 at 125%, 48 at 150%),
+// capped at the master size.
+static int IconSizeForDpi(UINT dpi) {
+    int size = (MulDiv(ICON_SIZE, (int)dpi, USER_DEFAULT_SCREEN_DPI) + 4) / 8 * 8;
+    return max(ICON_SIZE, min(size, ICON_MASTER_SIZE));
+}
+
+static int IconCellSize(void) {
+    return g_iconSize + ScaleForDpi(ICON_PADDING) * 2;
+}
+
+// Resampling of premultiplied BGRA. Filtering happens in linear light with
+// alpha premultiplied there (averaging sRGB values darkens edges and thin
+// strokes), as a box filter over each destination pixel's footprint when
+// shrinking and a tent filter when enlarging. Both passes work on float rows
+// with plain loops the compiler vectorises.
+#define SRGB_LINEAR_STEPS 16384
+
+static float g_srgbToLinear[256];
+static BYTE g_linearToSrgb[SRGB_LINEAR_STEPS];
+static INIT_ONCE g_srgbTablesOnce = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK InitSrgbTables(PINIT_ONCE once, PVOID param, PVOID* context) {
+    (void)once;
+    (void)param;
+    (void)context;
+    for (int i = 0; i < 256; i++) {
+        double c = i / 255.0;
+        g_srgbToLinear[i] = (float)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+    }
+    for (int i = 0; i < SRGB_LINEAR_STEPS; i++) {
+        double l = i / (double)(SRGB_LINEAR_STEPS - 1);
+        double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+        g_linearToSrgb[i] = (BYTE)(c * 255.0 + 0.5);
+    }
+    return TRUE;
+}
+
+// Filter taps along one axis: destination i reads count[i] source pixels
+// from first[i] with weights[i * taps...]. Returns the tap count, or 0.
+static int ResampleWeights(int srcLength, int destLength, int** first, int** count, float** weights) {
+    int taps = srcLength > destLength ? (srcLength + destLength - 1) / destLength + 1 : 2;
+    *first = malloc(destLength * sizeof(int));
+    *count = malloc(destLength * sizeof(int));
+    *weights = malloc((SIZE_T)destLength * taps * sizeof(float));
+    if (!*first || !*count || !*weights) {
+        free(*first);
+        free(*count);
+        free(*weights);
+        return 0;
+    }
+
+    for (int i = 0; i < destLength; i++) {
+        float* w = *weights + (SIZE_T)i * taps;
+        if (srcLength > destLength) {
+            // Destination i covers [i * srcLength, (i + 1) * srcLength) in
+            // units of 1/destLength source pixel
+            int start = i * srcLength, end = start + srcLength;
+            int s = start / destLength, n = 0;
+            for (; s < srcLength && s * destLength < end; s++) {
+                int overlap = min(end, (s + 1) * destLength) - max(start, s * destLength);
+                w[n++] = (float)overlap / srcLength;
+            }
+            (*first)[i] = start / destLength;
+            (*count)[i] = n;
+        } else {
+            float center = (i + 0.5f) * srcLength / destLength - 0.5f;
+            int s = (int)floorf(center);
+            float t = center - s;
+            if (s < 0) {
+                s = 0;
+                t = 0;
+            }
+            if (s >= srcLength - 1) {
+                s = srcLength - 1;
+                t = 0;
+            }
+            w[0] = 1 - t;
+            w[1] = t;
+            (*first)[i] = s;
+            (*count)[i] = t > 0 ? 2 : 1;
+        }
+    }
+    return taps;
+}
+
+// Resamples width x height premultiplied BGRA to size x size.
+static BOOL ResamplePixels(const BYTE* src, int width, int height, int size, BYTE* dest) {
+    if (width == size && height == size) {
+        memcpy(dest, src, (SIZE_T)size * size * 4);
+        return TRUE;
+    }
+    InitOnceExecuteOnce(&g_srgbTablesOnce, InitSrgbTables, NULL, NULL);
+
+    int *firstX, *countX, *firstY, *countY;
+    float *weightsX, *weightsY;
+    int tapsX = ResampleWeights(width, size, &firstX, &countX, &weightsX);
+    if (!tapsX) return FALSE;
+    int tapsY = ResampleWeights(height, size, &firstY, &countY, &weightsY);
+    float* linear = malloc((SIZE_T)width * 4 * sizeof(float));
+    float* columns = malloc((SIZE_T)size * height * 4 * sizeof(float));
+    float* row = malloc((SIZE_T)size * 4 * sizeof(float));
+    BOOL success = tapsY && linear && columns && row;
+
+    // Rows: to linear premultiplied, then filtered horizontally
+    for (int y = 0; success && y < height; y++) {
+        const BYTE* srcRow = src + (SIZE_T)y * width * 4;
+        for (int x = 0; x < width; x++) {
+            const BYTE* p = srcRow + x * 4;
+            float* l = linear + x * 4;
+            int a = p[3];
+            if (a == 255) {
+                for (int c = 0; c < 3; c++) l[c] = g_srgbToLinear[p[c]];
+                l[3] = 1;
+                continue;
+            }
+            if (a == 0) {
+                l[0] = l[1] = l[2] = l[3] = 0;
+                continue;
+            }
+            float alpha = a / 255.0f;
+            for (int c = 0; c < 3; c++) {
+                l[c] = g_srgbToLinear[min(255, (p[c] * 255 + a / 2) / a)] * alpha;
+            }
+            l[3] = alpha;
+        }
+
+        float* out = columns + (SIZE_T)y * size * 4;
+        for (int x = 0; x < size; x++) {
+            const float* w = weightsX + (SIZE_T)x * tapsX;
+            const float* in = linear + firstX[x] * 4;
+            float sum[4] = {0};
+            for (int t = 0; t < countX[x]; t++) {
+                for (int c = 0; c < 4; c++) sum[c] += w[t] * in[t * 4 + c];
+            }
+            for (int c = 0; c < 4; c++) out[x * 4 + c] = sum[c];
+        }
+    }
+
+    // Columns: filtered vertically a whole row at a time, then back to sRGB
+    for (int y = 0; success && y < size; y++) {
+        const float* w = weightsY + (SIZE_T)y * tapsY;
+        for (int i = 0; i < size * 4; i++) row[i] = 0;
+        for (int t = 0; t < countY[y]; t++) {
+            const float* in = columns + (SIZE_T)(firstY[y] + t) * size * 4;
+            float weight = w[t];
+            for (int i = 0; i < size * 4; i++) row[i] += weight * in[i];
+        }
+
+        BYTE* out = dest + (SIZE_T)y * size * 4;
+        for (int x = 0; x < size; x++) {
+            const float* l = row + x * 4;
+            int a = (int)(l[3] * 255.0f + 0.5f);
+            if (a <= 0) {
+                out[x * 4] = out[x * 4 + 1] = out[x * 4 + 2] = out[x * 4 + 3] = 0;
+                continue;
+            }
+            a = min(a, 255);
+            float unpremultiply = 1 / l[3];
+            for (int c = 0; c < 3; c++) {
+                float straight = min(1.0f, max(0.0f, l[c] * unpremultiply));
+                int srgb = g_linearToSrgb[(int)(straight * (SRGB_LINEAR_STEPS - 1) + 0.5f)];
+                out[x * 4 + c] = (BYTE)((srgb * a + 127) / 255);
+            }
+            out[x * 4 + 3] = (BYTE)a;
+        }
+    }
+
+    free(firstX);
+    free(countX);
+    free(weightsX);
+    if (tapsY) {
+        free(firstY);
+        free(countY);
+        free(weightsY);
+    }
+    free(linear);
+    free(columns);
+    free(row);
+    return success;
+}
+
+// Reads an icon at its own size into malloc'd top-down premultiplied BGRA.
+// Icons without an alpha channel get one from their AND mask.
+static BYTE* ReadIconPixels(HICON hIcon, int* width, int* height) {
+    ICONINFO ii;
+    if (!GetIconInfo(hIcon, &ii)) return NULL;
+
+    BYTE* pixels = NULL;
+    BYTE* mask = NULL;
+    HDC hdc = GetDC(NULL);
+
+    BITMAP bm;
+    if (ii.hbmColor && GetObjectW(ii.hbmColor, sizeof(bm), &bm) &&
+        bm.bmWidth > 0 && bm.bmWidth <= 256 && bm.bmHeight > 0 && bm.bmHeight <= 256) {
+        int w = bm.bmWidth, h = bm.bmHeight;
+        BITMAPINFO bmi = {0};
+        bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+        bmi.bmiHeader.biWidth = w;
+        bmi.bmiHeader.biHeight = -h;
+        bmi.bmiHeader.biPlanes = 1;
+        bmi.bmiHeader.biBitCount = 32;
+        bmi.bmiHeader.biCompression = BI_RGB;
+
+        pixels = malloc((SIZE_T)w * h * 4);
+        BOOL hasAlpha = FALSE;
+        if (pixels && GetDIBits(hdc, ii.hbmColor, 0, h, pixels, &bmi, DIB_RGB_COLORS) == h) {
+            for (int i = 0; i < w * h && !hasAlpha; i++) {
+                hasAlpha = pixels[i * 4 + 3] != 0;
+            }
+
+            mask = hasAlpha || !ii.hbmMask ? NULL : malloc((SIZE_T)w * h * 4);
+            if (mask && GetDIBits(hdc, ii.hbmMask, 0, h, mask, &bmi, DIB_RGB_COLORS) == h) {
+                for (int i = 0; i < w * h; i++) {
+                    pixels[i * 4 + 3] = mask[i * 4] ? 0 : 255;
+                }
+                hasAlpha = TRUE;
+            }
+        }
+
+        if (hasAlpha) {
+            PremultiplyPixels(pixels, w * h);
+            *width = w;
+            *height = h;
+        } else {
+            free(pixels);
+            pixels = NULL;
+        }
+    }
+
+    free(mask);
+    ReleaseDC(NULL, hdc);
+    if (ii.hbmColor) DeleteObject(ii.hbmColor);
+    if (ii.hbmMask) DeleteObject(ii.hbmMask);
+    return pixels;
+}
+
+// Reads an icon into size x size top-down premultiplied BGRA.
+static BOOL IconToPixels(HICON hIcon, int size, BYTE* pixels) {
+    int width, height;
+    BYTE* src = ReadIconPixels(hIcon, &width, &height);
+    if (!src) return FALSE;
+    BOOL success = ResamplePixels(src, width, height, size, pixels);
+    free(src);
+    return success;
+}
+
+// IID_IImageList, which the system image lists are requested through
+static const GUID g_iidImageList = { 0x46eb5926, 0x582e, 0x4017, { 0x9f, 0xdf, 0xe8, 0x99, 0x8d, 0xaa, 0x09, 0x50 } };
+
+// Shell icon for a path as an ICON_MASTER_SIZE master, taken from the jumbo
+// system image list so it is only ever scaled down. Items without a 256px
+// image sit small in the top-left corner of their jumbo cell; those are
+// cropped to the 48 or 32px image before scaling. Pass SHGFI_USEFILEATTRIBUTES
+// in flags for a generic icon by name and attributes.
+// Returns the shell's large icon instead (caller destroys it) if it cannot
+// be read back as pixels.
+static BOOL ShellIconToPixels(const WCHAR* path, DWORD attributes, UINT flags, BYTE* pixels, HICON* unreadable) {
+    *unreadable = NULL;
+    SHFILEINFOW sfi = {0};
+    if (SHGetFileInfoW(path, attributes, &sfi, sizeof(sfi), flags | SHGFI_SYSICONINDEX)) {
+        IUnknown* jumbo = NULL;
+        if (SUCCEEDED(SHGetImageList(SHIL_JUMBO, &g_iidImageList, (void**)&jumbo))) {
+            HICON hIcon = ImageList_GetIcon((HIMAGELIST)jumbo, sfi.iIcon, ILD_TRANSPARENT);
+            jumbo->lpVtbl->Release(jumbo);
+
+            int width = 0, height = 0;
+            BYTE* src = hIcon ? ReadIconPixels(hIcon, &width, &height) : NULL;
+            if (hIcon) DestroyIcon(hIcon);
+            if (src) {
+                int right = 0, bottom = 0;
+                for (int y = 0; y < height; y++) {
+                    for (int x = 0; x < width; x++) {
+                        if (src[((SIZE_T)y * width + x) * 4 + 3]) {
+                            right = max(right, x + 1);
+                            bottom = max(bottom, y + 1);
+                        }
+                    }
+                }
+                int crop = width;
+                if (width == 256 && height == 256 && right <= 48 && bottom <= 48) {
+                    crop = right <= 32 && bottom <= 32 ? 32 : 48;
+                    for (int y = 1; y < crop; y++) {
+                        memmove(src + (SIZE_T)y * crop * 4, src + (SIZE_T)y * width * 4, (SIZE_T)crop * 4);
+                    }
+                    height = crop;
+                }
+                BOOL success = ResamplePixels(src, crop, height, ICON_MASTER_SIZE, pixels);
+                free(src);
+                if (success) return TRUE;
+            }
+        }
+    }
+
+    ZeroMemory(&sfi, sizeof(sfi));
+    SHGetFileInfoW(path, attributes, &sfi, sizeof(sfi), flags | SHGFI_ICON | SHGFI_LARGEICON);
+    if (!sfi.hIcon) return FALSE;
+    if (IconToPixels(sfi.hIcon, ICON_MASTER_SIZE, pixels)) {
+        DestroyIcon(sfi.hIcon);
+        return TRUE;
+    }
+    *unreadable = sfi.hIcon;
+    return FALSE;
+}
+
+// Adds premultiplied pixels to the image list. Image lists store straight
+// alpha, so the pixels are un-premultiplied into the upload bitmap. The
+// pixels are at the image list's icon size.
+static int AddPixelsToImageList(HIMAGELIST imageList, const BYTE* pixels) {
+    int size, height;
+    if (!ImageList_GetIconSize(imageList, &size, &height)) return -1;
+
+    BITMAPINFO bmi = {0};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = size;
+    bmi.bmiHeader.biHeight = -size;
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    BYTE* bits = NULL;
+    HBITMAP hbm = CreateDIBSection(NULL, &bmi, DIB_RGB_COLORS, (void**)&bits, NULL, 0);
+    if (!hbm) return -1;
+
+    for (int i = 0; i < size * size * 4; i += 4) {
+        BYTE a = pixels[i + 3];
+        if (a == 0) {
+            bits[i] = bits[i + 1] = bits[i + 2] = bits[i + 3] = 0;
+        } else if (a == 255) {
+            memcpy(bits + i, pixels + i, 4);
+        } else {
+            bits[i] = (BYTE)min(255, (pixels[i] * 255 + a / 2) / a);
+            bits[i + 1] = (BYTE)min(255, (pixels[i + 1] * 255 + a / 2) / a);
+            bits[i + 2] = (BYTE)min(255, (pixels[i + 2] * 255 + a / 2) / a);
+            bits[i + 3] = a;
+        }
+    }
+
+    int index = ImageList_Add(imageList, hbm, NULL);
+    DeleteObject(hbm);
+    return index;
+}
+
+// Content-addressed image list slots. The image list is the icon atlas (one
+// packed 32bpp strip); this table maps each uploaded icon's HashPixels value
+// to its index, so items whose icons come out pixel-identical (generic
+// document icons, many shortcuts to one program) share one slot instead of
+// each costing an upload. The table lives and dies with its image list.
+typedef struct IconSlotTable {
+    ULONGLONG* hashes;      // 0 = empty
+    int* indices;
+    DWORD mask;
+    int count;
+    int requests;           // Icons asked for, to report the sharing ratio
+} IconSlotTable;
+
+static IconSlotTable g_iconSlots;
+
+static void IconSlotFree(IconSlotTable* table) {
+    free(table->hashes);
+    free(table->indices);
+    ZeroMemory(table, sizeof(*table));
+}
+
+static int IconSlotFind(const IconSlotTable* table, ULONGLONG hash, DWORD* slot) {
+    *slot = (DWORD)hash & table->mask;
+    while (table->hashes[*slot]) {
+        if (table->hashes[*slot] == hash) return table->indices[*slot];
+        *slot = (*slot + 1) & table->mask;
+    }
+    return -1;
+}
+
+static BOOL IconSlotGrow(IconSlotTable* table) {
+    DWORD capacity = table->hashes ? (table->mask + 1) * 2 : 64;
+    ULONGLONG* hashes = calloc(capacity, sizeof(ULONGLONG));
+    int* indices = malloc(capacity * sizeof(int));
+    if (!hashes || !indices) {
+        free(hashes);
+        free(indices);
+        return FALSE;
+    }
+
+    IconSlotTable grown = { hashes, indices, capacity - 1, table->count, table->requests };
+    for (DWORD i = 0; table->hashes && i <= table->mask; i++) {
+        if (!table->hashes[i]) continue;
+        DWORD slot;
+        IconSlotFind(&grown, table->hashes[i], &slot);
+        grown.hashes[slot] = table->hashes[i];
+        grown.indices[slot] = table->indices[i];
+    }
+    free(table->hashes);
+    free(table->indices);
+    *table = grown;
+    return TRUE;
+}
+
+static void IconSlotReport(const IconSlotTable* table) {
+    if (table->requests) TraceCounter("IconSlots", "icons", table->requests, "slots", table->count);
+}
+
+// Returns the image list index holding these pixels, uploading them only if
+// no identical icon is there yet.
+static int IconSlotAdd(IconSlotTable* table, HIMAGELIST imageList, const BYTE* pixels, ULONGLONG hash) {
+    if (!hash) hash = 1;  // 0 marks empty slots
+    table->requests++;
+    if ((!table->hashes || (DWORD)(table->count + 1) * 2 > table->mask + 1) && !IconSlotGrow(table)) {
+        return AddPixelsToImageList(imageList, pixels);
+    }
+
+    DWORD slot;
+    int index = IconSlotFind(table, hash, &slot);
+    if (index >= 0) return index;
+
+    index = AddPixelsToImageList(imageList, pixels);
+    if (index >= 0) {
+        table->hashes[slot] = hash;
+        table->indices[slot] = index;
+        table->count++;
+    }
+    return index;
+}
+
+// Native icon decoder. Renders icons straight from .ico files and from the
+// RT_GROUP_ICON / RT_ICON resources of PE images (.exe, .dll), so the common
+// launcher targets never go through the shell and its extensions. Like the
+// .lnk parser it works on a raw byte buffer (normally a read-only file
+// mapping), bounds-checks every read and makes no Win32 calls. Images are
+// either BMP-style DIBs with an AND mask or PNG streams, and come out as
+// iconSize x iconSize top-down premultiplied BGRA.
+//
+// index follows the shell's "path,index" convention: a non-negative index
+// is the position of the icon group in the resource directory, a negative
+// one is the resource ID of the group.
+#define ICON_DECODE_MAX_SIZE 1024   // Larger images are left to the shell
+#define RT_ICON_ID 3
+#define RT_GROUP_ICON_ID 14
+
+static DWORD ReadBE32(const BYTE* p) {
+    return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | (DWORD)p[3];
+}
+
+// Inflate (RFC 1950/1951). Huffman codes up to INFLATE_FAST_BITS long are
+// decoded with one table lookup, longer ones bit by bit from the canonical
+// code counts. The output size is fixed up front; overruns are errors.
+#define INFLATE_FAST_BITS 9
+
+typedef struct HuffmanTable {
+    WORD counts[16];
+    WORD symbols[288];
+    WORD fast[1 << INFLATE_FAST_BITS];  // Symbol | length << 9, 0 = slow path
+} HuffmanTable;
+
+typedef struct InflateState {
+    const BYTE* in;
+    SIZE_T inSize;
+    SIZE_T inPos;
+    DWORD bitBuffer;
+    int bitCount;
+    BYTE* out;
+    SIZE_T outSize;
+    SIZE_T outPos;
+    BOOL error;
+} InflateState;
+
+static const WORD g_lengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const BYTE g_lengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const WORD g_distanceBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const BYTE g_distanceExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static void InflateFill(InflateState* s) {
+    while (s->bitCount <= 16 && s->inPos < s->inSize) {
+        s->bitBuffer |= (DWORD)s->in[s->inPos++] << s->bitCount;
+        s->bitCount += 8;
+    }
+}
+
+static DWORD InflateBits(InflateState* s, int count) {
+    if (count == 0) return 0;
+    InflateFill(s);
+    if (s->bitCount < count) {
+        s->error = TRUE;
+        return 0;
+    }
+    DWORD value = s->bitBuffer & ((1u << count) - 1);
+    s->bitBuffer >>= count;
+    s->bitCount -= count;
+    return value;
+}
+
+// Builds the decoding tables from code lengths. Over-subscribed code sets
+// are rejected; incomplete ones are allowed (deflate uses them for a single
+// distance code) and fail only if a missing code is actually read.
+static BOOL HuffmanBuild(HuffmanTable* table, const BYTE* lengths, int count) {
+    ZeroMemory(table->counts, sizeof(table->counts));
+    ZeroMemory(table->fast, sizeof(table->fast));
+    for (int i = 0; i < count; i++) table->counts[lengths[i]]++;
+
+    int left = 1;
+    for (int length = 1; length < 16; length++) {
+        left = (left << 1) - table->counts[length];
+        if (left < 0) return FALSE;
+    }
+
+    WORD offsets[16];
+    offsets[1] = 0;
+    for (int length = 1; length < 15; length++) offsets[length + 1] = offsets[length] + table->counts[length];
+    for (int i = 0; i < count; i++) {
+        if (lengths[i]) table->symbols[offsets[lengths[i]]++] = (WORD)i;
+    }
+
+    // Codes are packed starting from their most significant bit, so the
+    // lookup index is the bit-reversed code
+    int code = 0, index = 0;
+    for (int length = 1; length <= INFLATE_FAST_BITS; length++) {
+        for (int i = 0; i < table->counts[length]; i++, code++, index++) {
+            int reversed = 0;
+            for (int b = 0; b < length; b++) reversed |= ((code >> b) & 1) << (length - 1 - b);
+            for (int fill = reversed; fill < (1 << INFLATE_FAST_BITS); fill += 1 << length) {
+                table->fast[fill] = (WORD)(table->symbols[index] | (length << 9));
+            }
+        }
+        code <<= 1;
+    }
+    return TRUE;
+}
+
+static int HuffmanDecode(InflateState* s, const HuffmanTable* table) {
+    InflateFill(s);
+    WORD entry = table->fast[s->bitBuffer & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (entry && (entry >> 9) <= s->bitCount) {
+        s->bitBuffer >>= entry >> 9;
+        s->bitCount -= entry >> 9;
+        return entry & 0x1FF;
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (int length = 1; length < 16; length++) {
+        if (s->bitCount == 0) break;
+        code |= s->bitBuffer & 1;
+        s->bitBuffer >>= 1;
+        s->bitCount--;
+
+        int count = table->counts[length];
+        if (code - first < count) return table->symbols[index + code - first];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    s->error = TRUE;
+    return -1;
+}
+
+static BOOL InflateCodes(InflateState* s, const HuffmanTable* lengths, const HuffmanTable* distances) {
+    for (;;) {
+        int symbol = HuffmanDecode(s, lengths);
+        if (s->error) return FALSE;
+        if (symbol < 256) {
+            if (s->outPos >= s->outSize) return FALSE;
+            s->out[s->outPos++] = (BYTE)symbol;
+            continue;
+        }
+        if (symbol == 256) return TRUE;
+
+        symbol -= 257;
+        if (symbol >= 29) return FALSE;
+        SIZE_T length = g_lengthBase[symbol] + InflateBits(s, g_lengthExtra[symbol]);
+
+        symbol = HuffmanDecode(s, distances);
+        if (s->error || symbol >= 30) return FALSE;
+        SIZE_T distance = g_distanceBase[symbol] + InflateBits(s, g_distanceExtra[symbol]);
+        if (s->error || distance > s->outPos || length > s->outSize - s->outPos) return FALSE;
+
+        BYTE* dest = s->out + s->outPos;
+        const BYTE* src = dest - distance;
+        for (SIZE_T i = 0; i < length; i++) dest[i] = src[i];  // May overlap
+        s->outPos += length;
+    }
+}
+
+static BOOL InflateDynamic(InflateState* s, HuffmanTable* lengths, HuffmanTable* distances) {
+    static const BYTE order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+    int lengthCount = (int)InflateBits(s, 5) + 257;
+    int distanceCount = (int)InflateBits(s, 5) + 1;
+    int codeCount = (int)InflateBits(s, 4) + 4;
+    if (s->error || lengthCount > 286 || distanceCount > 30) return FALSE;
+
+    BYTE codeLengths[320] = {0};
+    for (int i = 0; i < codeCount; i++) codeLengths[order[i]] = (BYTE)InflateBits(s, 3);
+    if (s->error || !HuffmanBuild(lengths, codeLengths, 19)) return FALSE;
+
+    ZeroMemory(codeLengths, sizeof(codeLengths));
+    int index = 0;
+    while (index < lengthCount + distanceCount) {
+        int symbol = HuffmanDecode(s, lengths);
+        if (s->error) return FALSE;
+        if (symbol < 16) {
+            codeLengths[index++] = (BYTE)symbol;
+            continue;
+        }
+
+        BYTE repeat = 0;
+        int count;
+        if (symbol == 16) {
+            if (index == 0) return FALSE;
+            repeat = codeLengths[index - 1];
+            count = 3 + (int)InflateBits(s, 2);
+        } else if (symbol == 17) {
+            count = 3 + (int)InflateBits(s, 3);
+        } else {
+            count = 11 + (int)InflateBits(s, 7);
+        }
+        if (s->error || index + count > lengthCount + distanceCount) return FALSE;
+        while (count--) codeLengths[index++] = repeat;
+    }
+
+    if (codeLengths[256] == 0) return FALSE;
+    return HuffmanBuild(lengths, codeLengths, lengthCount) &&
+           HuffmanBuild(distances, codeLengths + lengthCount, distanceCount);
+}
+
+// Inflates a zlib stream into exactly outSize bytes.
+static BOOL ZlibInflate(const BYTE* in, SIZE_T inSize, BYTE* out, SIZE_T outSize) {
+    if (inSize < 2 || (in[0] & 0x0F) != 8 || (in[0] >> 4) > 7 || (in[1] & 0x20) ||
+        ((in[0] << 8) | in[1]) % 31 != 0) {
+        return FALSE;
+    }
+
+    HuffmanTable* tables = malloc(2 * sizeof(HuffmanTable));
+    if (!tables) return FALSE;
+
+    InflateState s = { in, inSize, 2, 0, 0, out, outSize, 0, FALSE };
+    BOOL last = FALSE, ok = TRUE;
+    while (ok && !last) {
+        last = InflateBits(&s, 1) != 0;
+        DWORD type = InflateBits(&s, 2);
+        if (s.error) {
+            ok = FALSE;
+        } else if (type == 0) {
+            // Stored block: drop to a byte boundary and copy
+            s.bitBuffer >>= s.bitCount & 7;
+            s.bitCount -= s.bitCount & 7;
+            DWORD length = InflateBits(&s, 16);
+            DWORD inverse = InflateBits(&s, 16);
+            if (s.error || (length ^ 0xFFFF) != inverse) {
+                ok = FALSE;
+                break;
+            }
+            while (length && s.bitCount >= 8) {
+                if (s.outPos >= s.outSize) break;
+                s.out[s.outPos++] = (BYTE)s.bitBuffer;
+                s.bitBuffer >>= 8;
+                s.bitCount -= 8;
+                length--;
+            }
+            if (length > s.inSize - s.inPos || length > s.outSize - s.outPos) {
+                ok = FALSE;
+                break;
+            }
+            memcpy(s.out + s.outPos, s.in + s.inPos, length);
+            s.inPos += length;
+            s.outPos += length;
+        } else if (type == 1) {
+            BYTE lengths[288 + 30];
+            int i = 0;
+            for (; i < 144; i++) lengths[i] = 8;
+            for (; i < 256; i++) lengths[i] = 9;
+            for (; i < 280; i++) lengths[i] = 7;
+            for (; i < 288; i++) lengths[i] = 8;
+            for (; i < 288 + 30; i++) lengths[i] = 5;
+            HuffmanBuild(&tables[0], lengths, 288);
+            HuffmanBuild(&tables[1], lengths + 288, 30);
+            ok = InflateCodes(&s, &tables[0], &tables[1]);
+        } else if (type == 2) {
+            ok = InflateDynamic(&s, &tables[0], &tables[1]) && InflateCodes(&s, &tables[0], &tables[1]);
+        } else {
+            ok = FALSE;
+        }
+    }
+
+    free(tables);
+    return ok && s.outPos == outSize;
+}
+
+static BYTE PaethPredictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc) return (BYTE)a;
+    return (BYTE)(pb <= pc ? b : c);
+}
+
+// Sample `index` of a PNG row at its full precision
+static int PngSample(const BYTE* row, DWORD index, int bitDepth) {
+    if (bitDepth == 8) return row[index];
+    if (bitDepth == 16) return (row[index * 2] << 8) | row[index * 2 + 1];
+    int shift = 8 - bitDepth - (int)(index * bitDepth % 8);
+    return (row[index * bitDepth / 8] >> shift) & ((1 << bitDepth) - 1);
+}
+
+static BYTE PngSampleTo8(int sample, int bitDepth) {
+    if (bitDepth == 16) return (BYTE)(sample >> 8);
+    if (bitDepth == 8) return (BYTE)sample;
+    return (BYTE)(sample * 255 / ((1 << bitDepth) - 1));
+}
+
+// PNG decoder for icon images: every color type and bit depth, without
+// interlacing. CRCs and the zlib checksum are not verified; every read is
+// bounds-checked instead, so a damaged image decodes to noise or fails.
+static BOOL DecodePng(const BYTE* data, SIZE_T size, int iconSize, BYTE* pixels) {
+    static const BYTE signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+    if (size < 8 || memcmp(data, signature, 8) != 0) return FALSE;
+
+    DWORD width = 0, height = 0;
+    int bitDepth = 0, colorType = -1;
+    BYTE palette[256][4];
+    int transparent[3] = { -1, -1, -1 };    // Gray or RGB color key from tRNS
+    memset(palette, 0, sizeof(palette));
+
+    // First walk: header chunks, and the total size of the image data
+    SIZE_T compressedSize = 0;
+    SIZE_T pos = 8;
+    while (pos + 12 <= size) {
+        DWORD length = ReadBE32(data + pos);
+        const BYTE* type = data + pos + 4;
+        const BYTE* chunk = data + pos + 8;
+        if (length > size - pos - 12) return FALSE;
+
+        if (memcmp(type, "IHDR", 4) == 0 && length >= 13) {
+            width = ReadBE32(chunk);
+            height = ReadBE32(chunk + 4);
+            bitDepth = chunk[8];
+            colorType = chunk[9];
+            if (chunk[10] != 0 || chunk[11] != 0 || chunk[12] != 0) return FALSE;
+        } else if (memcmp(type, "PLTE", 4) == 0) {
+            for (DWORD i = 0; i < length / 3 && i < 256; i++) {
+                palette[i][0] = chunk[i * 3 + 2];
+                palette[i][1] = chunk[i * 3 + 1];
+                palette[i][2] = chunk[i * 3];
+                palette[i][3] = 255;
+            }
+        } else if (memcmp(type, "tRNS", 4) == 0) {
+            if (colorType == 3) {
+                for (DWORD i = 0; i < length && i < 256; i++) palette[i][3] = chunk[i];
+            } else if (colorType == 0 && length >= 2) {
+                transparent[0] = (chunk[0] << 8) | chunk[1];
+            } else if (colorType == 2 && length >= 6) {
+                for (int c = 0; c < 3; c++) transparent[c] = (chunk[c * 2] << 8) | chunk[c * 2 + 1];
+            }
+        } else if (memcmp(type, "IDAT", 4) == 0) {
+            compressedSize += length;
+        } else if (memcmp(type, "IEND", 4) == 0) {
+            break;
+        }
+        pos += 12 + length;
+    }
+
+    int channels;
+    switch (colorType) {
+        case 0: channels = 1; break;
+        case 2: channels = 3; break;
+        case 3: channels = 1; break;
+        case 4: channels = 2; break;
+        case 6: channels = 4; break;
+        default: return FALSE;
+    }
+    BOOL validDepth = (colorType == 0 && (bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16)) ||
+                      (colorType == 3 && (bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8)) ||
+                      ((colorType == 2 || colorType == 4 || colorType == 6) && (bitDepth == 8 || bitDepth == 16));
+    if (!validDepth || width == 0 || height == 0 || width > ICON_DECODE_MAX_SIZE ||
+        height > ICON_DECODE_MAX_SIZE || compressedSize == 0) {
+        return FALSE;
+    }
+
+    SIZE_T stride = ((SIZE_T)width * channels * bitDepth + 7) / 8;
+    SIZE_T rawSize = (stride + 1) * height;
+    int filterBytes = max(1, channels * bitDepth / 8);
+
+    BYTE* compressed = malloc(compressedSize);
+    BYTE* raw = malloc(rawSize);
+    BYTE* image = malloc((SIZE_T)width * height * 4);
+    BOOL success = FALSE;
+    if (!compressed || !raw || !image) goto done;
+
+    // Second walk: gather the image data, which may be split across chunks
+    SIZE_T gathered = 0;
+    for (pos = 8; pos + 12 <= size; pos += 12 + ReadBE32(data + pos)) {
+        DWORD length = ReadBE32(data + pos);
+        if (memcmp(data + pos + 4, "IDAT", 4) == 0) {
+            memcpy(compressed + gathered, data + pos + 8, length);
+            gathered += length;
+        } else if (memcmp(data + pos + 4, "IEND", 4) == 0) {
+            break;
+        }
+    }
+    if (!ZlibInflate(compressed, compressedSize, raw, rawSize)) goto done;
+
+    // Undo the per-row filters in place
+    for (DWORD y = 0; y < height; y++) {
+        BYTE* row = raw + y * (stride + 1);
+        BYTE filter = row[0];
+        BYTE* cur = row + 1;
+        const BYTE* prev = y > 0 ? cur - (stride + 1) : NULL;
+        if (filter > 4) goto done;
+
+        for (SIZE_T i = 0; i < stride; i++) {
+            int a = i >= (SIZE_T)filterBytes ? cur[i - filterBytes] : 0;
+            int b = prev ? prev[i] : 0;
+            int c = prev && i >= (SIZE_T)filterBytes ? prev[i - filterBytes] : 0;
+            switch (filter) {
+                case 1: cur[i] = (BYTE)(cur[i] + a); break;
+                case 2: cur[i] = (BYTE)(cur[i] + b); break;
+                case 3: cur[i] = (BYTE)(cur[i] + ((a + b) >> 1)); break;
+                case 4: cur[i] = (BYTE)(cur[i] + PaethPredictor(a, b, c)); break;
+            }
+        }
+    }
+
+    for (DWORD y = 0; y < height; y++) {
+        const BYTE* row = raw + y * (stride + 1) + 1;
+        BYTE* out = image + (SIZE_T)y * width * 4;
+        for (DWORD x = 0; x < width; x++, out += 4) {
+            DWORD index = x * channels;
+            if (colorType == 3) {
+                memcpy(out, palette[PngSample(row, index, bitDepth)], 4);
+            } else if (colorType == 0 || colorType == 4) {
+                int gray = PngSample(row, index, bitDepth);
+                out[0] = out[1] = out[2] = PngSampleTo8(gray, bitDepth);
+                out[3] = colorType == 4 ? PngSampleTo8(PngSample(row, index + 1, bitDepth), bitDepth) :
+                         gray == transparent[0] ? 0 : 255;
+            } else {
+                int r = PngSample(row, index, bitDepth);
+                int g = PngSample(row, index + 1, bitDepth);
+                int b = PngSample(row, index + 2, bitDepth);
+                out[0] = PngSampleTo8(b, bitDepth);
+                out[1] = PngSampleTo8(g, bitDepth);
+                out[2] = PngSampleTo8(r, bitDepth);
+                out[3] = colorType == 6 ? PngSampleTo8(PngSample(row, index + 3, bitDepth), bitDepth) :
+                         (r == transparent[0] && g == transparent[1] && b == transparent[2]) ? 0 : 255;
+            }
+        }
+    }
+
+    PremultiplyPixels(image, (int)(width * height));
+    success = ResamplePixels(image, (int)width, (int)height, iconSize, pixels);
+
+done:
+    free(compressed);
+    free(raw);
+    free(image);
+    return success;
+}
+
+// Decodes a BMP-style icon image: a BITMAPINFOHEADER whose height covers
+// the color rows and the 1bpp AND mask below them, both stored bottom-up.
+// 32bpp images carry their own alpha unless it is all zero; for every other
+// depth the AND mask decides what is transparent.
+static BOOL DecodeIconBitmap(const BYTE* data, SIZE_T size, int iconSize, BYTE* pixels) {
+    if (size < 40) return FALSE;
+
+    DWORD headerSize = ReadLE32(data);
+    LONG width = (LONG)ReadLE32(data + 4);
+    LONG height = (LONG)ReadLE32(data + 8) / 2;
+    int bitCount = ReadLE16(data + 14);
+    DWORD compression = ReadLE32(data + 16);
+    DWORD colorsUsed = ReadLE32(data + 32);
+    if (headerSize < 40 || headerSize > size || compression != 0 || width <= 0 || height <= 0 ||
+        width > ICON_DECODE_MAX_SIZE || height > ICON_DECODE_MAX_SIZE) {
+        return FALSE;
+    }
+    if (bitCount != 1 && bitCount != 4 && bitCount != 8 && bitCount != 24 && bitCount != 32) return FALSE;
+
+    DWORD paletteCount = 0;
+    if (bitCount <= 8) paletteCount = colorsUsed && colorsUsed <= (1u << bitCount) ? colorsUsed : 1u << bitCount;
+    SIZE_T colorOffset = headerSize + paletteCount * 4;
+    SIZE_T colorStride = (((SIZE_T)width * bitCount + 31) / 32) * 4;
+    SIZE_T maskOffset = colorOffset + colorStride * height;
+    SIZE_T maskStride = (((SIZE_T)width + 31) / 32) * 4;
+    if (maskOffset > size) return FALSE;
+    const BYTE* palette = data + headerSize;
+
+    // Some 32bpp icons omit the mask altogether
+    BOOL haveMask = maskOffset + maskStride * height <= size;
+    if (!haveMask && bitCount != 32) return FALSE;
+
+    BYTE* image = malloc((SIZE_T)width * height * 4);
+    if (!image) return FALSE;
+
+    BOOL hasAlpha = FALSE;
+    for (LONG y = 0; y < height; y++) {
+        const BYTE* row = data + colorOffset + (SIZE_T)(height - 1 - y) * colorStride;
+        BYTE* out = image + (SIZE_T)y * width * 4;
+        for (LONG x = 0; x < width; x++, out += 4) {
+            if (bitCount == 32) {
+                memcpy(out, row + x * 4, 4);
+                hasAlpha |= out[3] != 0;
+                continue;
+            }
+            if (bitCount == 24) {
+                memcpy(out, row + x * 3, 3);
+            } else {
+                int shift = 8 - bitCount - (x * bitCount) % 8;
+                DWORD color = (row[x * bitCount / 8] >> shift) & ((1 << bitCount) - 1);
+                if (color < paletteCount) {
+                    memcpy(out, palette + color * 4, 3);
+                } else {
+                    out[0] = out[1] = out[2] = 0;
+                }
+            }
+            out[3] = 255;
+        }
+    }
+
+    if (!hasAlpha && haveMask) {
+        for (LONG y = 0; y < height; y++) {
+            const BYTE* row = data + maskOffset + (SIZE_T)(height - 1 - y) * maskStride;
+            BYTE* out = image + (SIZE_T)y * width * 4;
+            for (LONG x = 0; x < width; x++) {
+                out[x * 4 + 3] = (row[x / 8] >> (7 - x % 8)) & 1 ? 0 : 255;
+            }
+        }
+    } else if (!hasAlpha) {
+        for (SIZE_T i = 0; i < (SIZE_T)width * height; i++) image[i * 4 + 3] = 255;
+    }
+
+    PremultiplyPixels(image, width * height);
+    BOOL success = ResamplePixels(image, width, height, iconSize, pixels);
+    free(image);
+    return success;
+}
+
+static BOOL DecodeIconImage(const BYTE* data, SIZE_T size, int iconSize, BYTE* pixels) {
+    if (size >= 8 && data[0] == 0x89 && data[1] == 'P' && data[2] == 'N' && data[3] == 'G') {
+        return DecodePng(data, size, iconSize, pixels);
+    }
+    return DecodeIconBitmap(data, size, iconSize, pixels);
+}
+
+// Picks the directory entry to render at iconSize: the exact size, else
+// the nearest larger one (scaling down looks better than up), else the
+// largest. Deeper color wins between entries of the same size. ICONDIRENTRY
+// and GRPICONDIRENTRY share these leading fields; a width of 0 means 256.
+static int PickIconEntry(const BYTE* entries, int count, int entrySize, int iconSize) {
+    int best = -1, bestRank = 0, bestDepth = 0;
+    for (int i = 0; i < count; i++) {
+        const BYTE* entry = entries + i * entrySize;
+        int size = entry[0] ? entry[0] : 256;
+        int depth = ReadLE16(entry + 6);
+        int rank = size == iconSize ? 0 : size > iconSize ? size - iconSize : 1000 + iconSize - size;
+        if (best < 0 || rank < bestRank || (rank == bestRank && depth > bestDepth)) {
+            best = i;
+            bestRank = rank;
+            bestDepth = depth;
+        }
+    }
+    return best;
+}
+
+static BOOL DecodeIcoFile(const BYTE* data, SIZE_T size, int iconSize, BYTE* pixels) {
+    if (size < 6 || ReadLE16(data) != 0 || ReadLE16(data + 2) != 1) return FALSE;
+    int count = ReadLE16(data + 4);
+    if (count == 0 || 6 + (SIZE_T)count * 16 > size) return FALSE;
+
+    int pick = PickIconEntry(data + 6, count, 16, iconSize);
+    const BYTE* entry = data + 6 + pick * 16;
+    DWORD imageSize = ReadLE32(entry + 8);
+    DWORD imageOffset = ReadLE32(entry + 12);
+    if (imageOffset > size || imageSize > size - imageOffset) return FALSE;
+    return DecodeIconImage(data + imageOffset, imageSize, iconSize, pixels);
+}
+
+// Section table and resource directory of a PE image mapped as a file
+// (not as an image), so RVAs are translated through the section headers.
+typedef struct PeImage {
+    const BYTE* data;
+    SIZE_T size;
+    const BYTE* sections;
+    int sectionCount;
+    const BYTE* resources;
+    DWORD resourceSize;
+} PeImage;
+
+// Maps an RVA to file data. Returns NULL unless at least size bytes are
+// present; *available (optional) receives how many are.
+static const BYTE* PeRvaToPointer(const PeImage* pe, DWORD rva, DWORD size, DWORD* available) {
+    for (int i = 0; i < pe->sectionCount; i++) {
+        const BYTE* section = pe->sections + i * 40;
+        DWORD virtualAddress = ReadLE32(section + 12);
+        DWORD rawSize = ReadLE32(section + 16);
+        DWORD rawOffset = ReadLE32(section + 20);
+        if (rva < virtualAddress || rva - virtualAddress >= rawSize) continue;
+
+        DWORD offset = rva - virtualAddress;
+        SIZE_T fileOffset = (SIZE_T)rawOffset + offset;
+        if (fileOffset > pe->size) return NULL;
+        SIZE_T left = min((SIZE_T)(rawSize - offset), pe->size - fileOffset);
+        if (left < size) return NULL;
+        if (available) *available = (DWORD)left;
+        return pe->data + fileOffset;
+    }
+    return NULL;
+}
+
+static BOOL PeOpen(PeImage* pe, const BYTE* data, SIZE_T size) {
+    ZeroMemory(pe, sizeof(*pe));
+    if (size < 0x40 || data[0] != 'M' || data[1] != 'Z') return FALSE;
+
+    DWORD peOffset = ReadLE32(data + 0x3C);
+    if (peOffset > size - 24 || memcmp(data + peOffset, "PE\0\0", 4) != 0) return FALSE;
+
+    int sectionCount = ReadLE16(data + peOffset + 6);
+    DWORD optionalSize = ReadLE16(data + peOffset + 20);
+    SIZE_T optional = peOffset + 24;
+    if (optional + optionalSize > size) return FALSE;
+
+    // Resource table is data directory 2, after 96 (PE32) or 112 (PE32+) bytes
+    WORD magic = optionalSize >= 2 ? ReadLE16(data + optional) : 0;
+    DWORD directories = magic == 0x10B ? 96 : magic == 0x20B ? 112 : 0;
+    if (!directories || optionalSize < directories + 3 * 8 || ReadLE32(data + optional + directories - 4) < 3) return FALSE;
+
+    SIZE_T sections = optional + optionalSize;
+    if (sections + (SIZE_T)sectionCount * 40 > size) return FALSE;
+
+    pe->data = data;
+    pe->size = size;
+    pe->sections = data + sections;
+    pe->sectionCount = sectionCount;
+
+    DWORD resourceRva = ReadLE32(data + optional + directories + 16);
+    DWORD resourceSize = ReadLE32(data + optional + directories + 20);
+    if (!resourceRva || resourceSize < 16) return FALSE;
+
+    // Some linkers overstate the directory size; the section data is the limit
+    DWORD available;
+    pe->resources = PeRvaToPointer(pe, resourceRva, 16, &available);
+    pe->resourceSize = min(resourceSize, available);
+    return pe->resources != NULL;
+}
+
+// Finds an entry in the resource directory at dirOffset: the index-th entry
+// (named entries come first, as EnumResourceNames reports them) when index
+// is non-negative, else the entry whose integer ID is -index. Returns the
+// entry's OffsetToData field, or 0.
+static DWORD PeFindDirectoryEntry(const PeImage* pe, DWORD dirOffset, int index) {
+    if (dirOffset > pe->resourceSize - 16) return 0;
+    const BYTE* dir = pe->resources + dirOffset;
+    DWORD count = (DWORD)ReadLE16(dir + 12) + ReadLE16(dir + 14);
+    if (count > (pe->resourceSize - dirOffset - 16) / 8) return 0;
+
+    for (DWORD i = 0; i < count; i++) {
+        const BYTE* entry = dir + 16 + i * 8;
+        DWORD name = ReadLE32(entry);
+        BOOL match = index >= 0 ? i == (DWORD)index : !(name & 0x80000000) && name == (DWORD)-index;
+        if (match) return ReadLE32(entry + 4);
+    }
+    return 0;
+}
+
+// Looks up type / name / first language. Returns the resource data.
+static const BYTE* PeFindResource(const PeImage* pe, int type, int index, DWORD* size) {
+    DWORD entry = PeFindDirectoryEntry(pe, 0, -type);
+    if (!(entry & 0x80000000)) return NULL;
+    entry = PeFindDirectoryEntry(pe, entry & 0x7FFFFFFF, index);
+    if (!(entry & 0x80000000)) return NULL;
+    entry = PeFindDirectoryEntry(pe, entry & 0x7FFFFFFF, 0);
+    if (!entry || (entry & 0x80000000) || entry > pe->resourceSize - 16) return NULL;
+
+    const BYTE* dataEntry = pe->resources + entry;
+    *size = ReadLE32(dataEntry + 4);
+    return PeRvaToPointer(pe, ReadLE32(dataEntry), *size, NULL);
+}
+
+static BOOL DecodePeIcon(const BYTE* data, SIZE_T size, int index, int iconSize, BYTE* pixels) {
+    PeImage pe;
+    if (!PeOpen(&pe, data, size)) return FALSE;
+
+    DWORD groupSize;
+    const BYTE* group = PeFindResource(&pe, RT_GROUP_ICON_ID, index, &groupSize);
+    if (!group || groupSize < 6 || ReadLE16(group + 2) != 1) return FALSE;
+    int count = ReadLE16(group + 4);
+    if (count == 0 || 6 + (SIZE_T)count * 14 > groupSize) return FALSE;
+
+    // GRPICONDIRENTRY: the ICONDIRENTRY fields with an RT_ICON ID in place
+    // of the file offset
+    int pick = PickIconEntry(group + 6, count, 14, iconSize);
+    int iconId = ReadLE16(group + 6 + pick * 14 + 12);
+    if (iconId == 0) return FALSE;
+
+    DWORD imageSize;
+    const BYTE* image = PeFindResource(&pe, RT_ICON_ID, -iconId, &imageSize);
+    return image && DecodeIconImage(image, imageSize, iconSize, pixels);
+}
+
+// Renders icon `index` of an .ico file or PE image held in memory.
+static BOOL DecodeIcon(const BYTE* data, SIZE_T size, int index, int iconSize, BYTE* pixels) {
+    if (size >= 4 && ReadLE16(data) == 0 && ReadLE16(data + 2) == 1) {
+        return index == 0 && DecodeIcoFile(data, size, iconSize, pixels);
+    }
+    return DecodePeIcon(data, size, index, iconSize, pixels);
+}
+
+static BOOL IsIconSource(const WCHAR* path) {
+    const WCHAR* ext = wcsrchr(path, L'.');
+    return ext && (_wcsicmp(ext, L".exe") == 0 || _wcsicmp(ext, L".dll") == 0 || _wcsicmp(ext, L".ico") == 0);
+}
+
+// Maps the icon source read-only and runs the native decoder over it.
+static BOOL DecodeIconFile(const WCHAR* path, int index, int iconSize, BYTE* pixels) {
+    BOOL success = FALSE;
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= 0x7FFFFFFF) {
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (hMapping) {
+            const BYTE* data = (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0);
+            if (data) {
+                success = DecodeIcon(data, (SIZE_T)fileSize.QuadPart, index, iconSize, pixels);
+                UnmapViewOfFile(data);
+            }
+            CloseHandle(hMapping);
+        }
+    }
+
+    CloseHandle(hFile);
+    return success;
+}
+
+// Grid layout for the icon view. The list view arranges items row by row in
+// ICON_CELL_SIZE cells, so cell rectangles, the visible range and hit-tests
+// are all plain arithmetic on the client size and scroll offset. The item
+// offset inside a cell is measured once from the list view after creation.
+typedef struct GridLayout {
+    int cellSize;
+    int columns;
+    int viewWidth;
+    int viewHeight;
+    int scrollY;
+    int itemCount;
+
+    // Bounds of item 0 in content coordinates
+    int itemOffsetX;
+    int itemOffsetY;
+    int itemWidth;
+    int itemHeight;
+} GridLayout;
+
+static GridLayout g_grid;
+
+static void GridInit(GridLayout* grid, int cellSize) {
+    ZeroMemory(grid, sizeof(*grid));
+    grid->cellSize = cellSize;
+    grid->columns = 1;
+    grid->itemWidth = cellSize;
+    grid->itemHeight = cellSize;
+}
+
+static void GridResize(GridLayout* grid, int viewWidth, int viewHeight) {
+    grid->viewWidth = viewWidth;
+    grid->viewHeight = viewHeight;
+    grid->columns = max(1, viewWidth / grid->cellSize);
+}
+
+static void GridSetItemBounds(GridLayout* grid, int offsetX, int offsetY, int width, int height) {
+    grid->itemOffsetX = offsetX;
+    grid->itemOffsetY = offsetY;
+    grid->itemWidth = max(1, min(width, grid->cellSize));
+    grid->itemHeight = max(1, min(height, grid->cellSize));
+}
+
+// Item bounds in view (client) coordinates.
+static void GridItemRect(const GridLayout* grid, int index, RECT* rc) {
+    int column = index % grid->columns;
+    int row = index / grid->columns;
+    rc->left = grid->itemOffsetX + column * grid->cellSize;
+    rc->top = grid->itemOffsetY + row * grid->cellSize - grid->scrollY;
+    rc->right = rc->left + grid->itemWidth;
+    rc->bottom = rc->top + grid->itemHeight;
+}
+
+// Returns the item under a view-space point, or -1.
+static int GridHitTest(const GridLayout* grid, int x, int y) {
+    int cx = x - grid->itemOffsetX;
+    int cy = y + grid->scrollY - grid->itemOffsetY;
+    if (cx < 0 || cy < 0 || x >= grid->viewWidth) return -1;
+
+    int column = cx / grid->cellSize;
+    int row = cy / grid->cellSize;
+    if (column >= grid->columns) return -1;
+    if (cx - column * grid->cellSize >= grid->itemWidth) return -1;
+    if (cy - row * grid->cellSize >= grid->itemHeight) return -1;
+
+    int index = row * grid->columns + column;
+    return index < grid->itemCount ? index : -1;
+}
+
+// Range of items intersecting the view; last < first when nothing is visible.
+static void GridVisibleRange(const GridLayout* grid, int* first, int* last) {
+    int top = max(0, grid->scrollY - grid->itemOffsetY);
+    int bottom = grid->scrollY + grid->viewHeight - grid->itemOffsetY;
+    int firstRow = top / grid->cellSize;
+    int lastRow = max(firstRow, bottom / grid->cellSize);
+
+    *first = min(firstRow * grid->columns, grid->itemCount);
+    *last = min((lastRow + 1) * grid->columns, grid->itemCount) - 1;
+}
+
+// Type-ahead filter. Typing narrows the view to matching names, ranked
+// prefix matches first, then word-start matches ("pad" finds "Notepad++"
+// only as a subsequence, but "Visual Studio Code" as "code"), then
+// subsequence matches, each group in sort order. The index is built on the
+// first keystroke: the case-folded names plus a suffix-sorted array of every
+// word start, so prefix and word-start matches are one binary search.
+// Appending a character only narrows, so the range and the subsequence
+// candidates are taken from the previous query's results.
+#define FILTER_MAX_QUERY 64
+#define FILTER_RANK_PREFIX 0
+#define FILTER_RANK_WORD 1
+#define FILTER_RANK_SUBSEQUENCE 2
+
+typedef struct FilterIndex {
+    BOOL built;
+    int itemCount;
+    WCHAR* text;            // Case-folded names, each null terminated
+    DWORD* nameOffset;      // Per item: start of its name in text
+    ULONGLONG* charMask;    // Per item: characters present, see FilterCharBit
+    DWORD* starts;          // Word starts in text, sorted by the text that follows
+    int* startItem;         // Item each word start belongs to
+    int startCount;
+
+    // Per item scratch for ranking; rank[i] is valid when stamp[i] == generation
+    BYTE* rank;
+    DWORD* stamp;
+    DWORD generation;
+
+    WCHAR query[FILTER_MAX_QUERY + 1];         // As typed, for display and editing
+    WCHAR foldedQuery[FILTER_MAX_QUERY + 1];   // Case-folded, what matching uses
+    int queryLength;
+    int rangeFirst;         // starts[rangeFirst..rangeLast) begin with foldedQuery
+    int rangeLast;
+    int* matches;           // Ranked item indices: the filtered view
+    int matchCount;
+    ULONGLONG* sortKeys;    // rank << 32 | item, for ordering matches
+} FilterIndex;
+
+static FilterIndex g_filter;
+
+// The list view shows view indices. Without a filter the view is the store
+// itself; with one, view index i is item g_filter.matches[i].
+static int ViewCount(void) {
+    return g_filter.queryLength ? g_filter.matchCount : g_store.count;
+}
+
+static int ViewItem(int viewIndex) {
+    return g_filter.queryLength ? g_filter.matches[viewIndex] : viewIndex;
+}
+
+static int FilterCharBit(WCHAR c) {
+    if (c >= L'a' && c <= L'z') return c - L'a';
+    if (c >= L'0' && c <= L'9') return 26 + (c - L'0');
+    return 36 + c % 28;
+}
+
+// Character classes for word starts: 0 = separator, 1 = lower, 2 = upper,
+// 3 = digit, 4 = other letter. ASCII skips the CRT classification calls.
+static int FilterCharClass(WCHAR c) {
+    if (c < 0x80) {
+        if (c >= L'a' && c <= L'z') return 1;
+        if (c >= L'A' && c <= L'Z') return 2;
+        if (c >= L'0' && c <= L'9') return 3;
+        return 0;
+    }
+    if (!iswalnum(c)) return 0;
+    return iswlower(c) ? 1 : iswupper(c) ? 2 : 4;
+}
+
+static BOOL IsWordStart(int prevClass, int charClass) {
+    if (charClass == 0) return FALSE;
+    if (prevClass == 0) return TRUE;
+    if (prevClass == 1 && charClass == 2) return TRUE;          // camelCase
+    return (prevClass == 3) != (charClass == 3);                // v2, 7zip
+}
+
+// Word starts are sorted on their first four characters packed into an
+// integer, falling back to the full text only on ties.
+typedef struct WordStart {
+    ULONGLONG prefix;
+    DWORD offset;
+    int item;
+} WordStart;
+
+static const WCHAR* g_filterSortText;
+
+static int CompareWordStarts(const void* a, const void* b) {
+    const WordStart* startA = a;
+    const WordStart* startB = b;
+    if (startA->prefix != startB->prefix) return startA->prefix < startB->prefix ? -1 : 1;
+    return wcscmp(g_filterSortText + startA->offset, g_filterSortText + startB->offset);
+}
+
+static void FilterFreeIndex(FilterIndex* filter) {
+    free(filter->text);
+    free(filter->nameOffset);
+    free(filter->charMask);
+    free(filter->starts);
+    free(filter->startItem);
+    free(filter->rank);
+    free(filter->stamp);
+    free(filter->matches);
+    free(filter->sortKeys);
+    filter->text = NULL;
+    filter->nameOffset = NULL;
+    filter->charMask = NULL;
+    filter->starts = NULL;
+    filter->startItem = NULL;
+    filter->rank = NULL;
+    filter->stamp = NULL;
+    filter->matches = NULL;
+    filter->sortKeys = NULL;
+    filter->built = FALSE;
+    filter->matchCount = 0;
+}
+
+static BOOL FilterBuildIndex(FilterIndex* filter) {
+    int count = g_store.count;
+    SIZE_T chars = 0;
+    int startCount = 0;
+    for (int i = 0; i < count; i++) {
+        const WCHAR* name = ItemName(i);
+        int prevClass = 0;
+        for (; *name; name++, chars++) {
+            int charClass = FilterCharClass(*name);
+            if (IsWordStart(prevClass, charClass)) startCount++;
+            prevClass = charClass;
+        }
+        chars++;
+    }
+
+    filter->itemCount = count;
+    filter->text = malloc(max(chars, 1) * sizeof(WCHAR));
+    filter->nameOffset = malloc(max(count, 1) * sizeof(DWORD));
+    filter->charMask = malloc(max(count, 1) * sizeof(ULONGLONG));
+    filter->starts = malloc(max(startCount, 1) * sizeof(DWORD));
+    filter->startItem = malloc(max(startCount, 1) * sizeof(int));
+    WordStart* sorted = malloc(max(startCount, 1) * sizeof(WordStart));
+    filter->rank = malloc(max(count, 1));
+    filter->stamp = calloc(max(count, 1), sizeof(DWORD));
+    filter->matches = malloc(max(count, 1) * sizeof(int));
+    filter->sortKeys = malloc(max(count, 1) * sizeof(ULONGLONG));
+    if (!filter->text || !filter->nameOffset || !filter->charMask || !filter->starts ||
+        !filter->startItem || !filter->rank || !filter->stamp || !filter->matches || !filter->sortKeys ||
+        !sorted) {
+        free(sorted);
+        FilterFreeIndex(filter);
+        return FALSE;
+    }
+
+    SIZE_T offset = 0;
+    int start = 0;
+    for (int i = 0; i < count; i++) {
+        const WCHAR* name = ItemName(i);
+        ULONGLONG mask = 0;
+        int prevClass = 0;
+        filter->nameOffset[i] = (DWORD)offset;
+        for (; *name; name++) {
+            int charClass = FilterCharClass(*name);
+            WCHAR folded = *name >= 0x80 ? towlower(*name) : charClass == 2 ? *name + (L'a' - L'A') : *name;
+            filter->text[offset] = folded;
+            mask |= 1ULL << FilterCharBit(folded);
+            if (IsWordStart(prevClass, charClass)) {
+                sorted[start].offset = (DWORD)offset;
+                sorted[start++].item = i;
+            }
+            prevClass = charClass;
+            offset++;
+        }
+        filter->text[offset++] = 0;
+        filter->charMask[i] = mask;
+    }
+
+    for (int k = 0; k < startCount; k++) {
+        const WCHAR* text = filter->text + sorted[k].offset;
+        ULONGLONG prefix = 0;
+        for (int c = 0, ended = FALSE; c < 4; c++) {
+            ended = ended || !text[c];
+            prefix = (prefix << 16) | (ended ? 0 : text[c]);
+        }
+        sorted[k].prefix = prefix;
+    }
+    g_filterSortText = filter->text;
+    qsort(sorted, startCount, sizeof(WordStart), CompareWordStarts);
+    for (int k = 0; k < startCount; k++) {
+        filter->starts[k] = sorted[k].offset;
+        filter->startItem[k] = sorted[k].item;
+    }
+    free(sorted);
+
+    filter->startCount = startCount;
+    filter->generation = 0;
+    filter->built = TRUE;
+    return TRUE;
+}
+
+// First entry in starts[first..last) whose text compares >= query over the
+// first length characters (or > when upper is set).
+static int FilterBound(const FilterIndex* filter, const WCHAR* query, int length,
+                       int first, int last, BOOL upper) {
+    while (first < last) {
+        int mid = first + (last - first) / 2;
+        int cmp = wcsncmp(filter->text + filter->starts[mid], query, length);
+        if (cmp < 0 || (upper && cmp == 0)) first = mid + 1;
+        else last = mid;
+    }
+    return first;
+}
+
+static BOOL IsSubsequence(const WCHAR* query, const WCHAR* text) {
+    for (; *query; query++) {
+        text = wcschr(text, *query);
+        if (!text) return FALSE;
+        text++;
+    }
+    return TRUE;
+}
+
+static int CompareFilterKeys(const void* a, const void* b) {
+    ULONGLONG keyA = *(const ULONGLONG*)a, keyB = *(const ULONGLONG*)b;
+    return keyA < keyB ? -1 : keyA > keyB;
+}
+
+// Sets the filter text and recomputes the view. An empty query shows
+// everything.
+static void FilterSetQuery(FilterIndex* filter, const WCHAR* text) {
+    WCHAR query[FILTER_MAX_QUERY + 1];
+    int length = 0;
+    ULONGLONG queryMask = 0;
+    for (; text[length] && length < FILTER_MAX_QUERY; length++) {
+        query[length] = towlower(text[length]);
+        queryMask |= 1ULL << FilterCharBit(query[length]);
+    }
+    query[length] = 0;
+
+    BOOL narrowing = filter->built && filter->queryLength > 0 && length > filter->queryLength &&
+                     wcsncmp(query, filter->foldedQuery, filter->queryLength) == 0;
+    wcsncpy_s(filter->query, FILTER_MAX_QUERY + 1, text, length);
+    wcscpy_s(filter->foldedQuery, FILTER_MAX_QUERY + 1, query);
+    filter->queryLength = length;
+    if (length == 0) return;
+
+    if (!filter->built && !FilterBuildIndex(filter)) {
+        filter->queryLength = 0;
+        return;
+    }
+
+    if (++filter->generation == 0) {
+        ZeroMemory(filter->stamp, filter->itemCount * sizeof(DWORD));
+        filter->generation = 1;
+    }
+
+    // Prefix and word-start matches: one contiguous run of starts
+    int first = narrowing ? filter->rangeFirst : 0;
+    int last = narrowing ? filter->rangeLast : filter->startCount;
+    first = FilterBound(filter, query, length, first, last, FALSE);
+    last = FilterBound(filter, query, length, first, last, TRUE);
+    filter->rangeFirst = first;
+    filter->rangeLast = last;
+
+    int found = 0;
+    for (int k = first; k < last; k++) {
+        int item = filter->startItem[k];
+        BYTE rank = filter->starts[k] == filter->nameOffset[item] ? FILTER_RANK_PREFIX : FILTER_RANK_WORD;
+        if (filter->stamp[item] != filter->generation) {
+            filter->stamp[item] = filter->generation;
+            filter->rank[item] = rank;
+            filter->sortKeys[found++] = item;
+        } else if (rank < filter->rank[item]) {
+            filter->rank[item] = rank;
+        }
+    }
+
+    // Subsequence matches among the previous results, or all items
+    int candidates = narrowing ? filter->matchCount : filter->itemCount;
+    for (int c = 0; c < candidates; c++) {
+        int item = narrowing ? filter->matches[c] : c;
+        if (filter->stamp[item] == filter->generation) continue;
+        if (queryMask & ~filter->charMask[item]) continue;
+        if (!IsSubsequence(query, filter->text + filter->nameOffset[item])) continue;
+        filter->stamp[item] = filter->generation;
+        filter->rank[item] = FILTER_RANK_SUBSEQUENCE;
+        filter->sortKeys[found++] = item;
+    }
+
+    for (int i = 0; i < found; i++) {
+        int item = (int)filter->sortKeys[i];
+        filter->sortKeys[i] = ((ULONGLONG)filter->rank[item] << 32) | (ULONGLONG)item;
+    }
+    qsort(filter->sortKeys, found, sizeof(ULONGLONG), CompareFilterKeys);
+    for (int i = 0; i < found; i++) {
+        filter->matches[i] = (int)(filter->sortKeys[i] & 0xFFFFFFFF);
+    }
+    filter->matchCount = found;
+}
+
+// Drops the index after the store changed and re-runs the current query.
+static void FilterRebuild(FilterIndex* filter) {
+    WCHAR query[FILTER_MAX_QUERY + 1];
+    wcscpy_s(query, FILTER_MAX_QUERY + 1, filter->query);
+    FilterFreeIndex(filter);
+    filter->queryLength = 0;
+    FilterSetQuery(filter, query);
+}
+
+static void FilterClear(FilterIndex* filter) {
+    FilterFreeIndex(filter);
+    filter->query[0] = 0;
+    filter->foldedQuery[0] = 0;
+    filter->queryLength = 0;
+}
+
+// Asynchronous icon loading. LoadFolderContents only enumerates and sorts,
+// giving every item a placeholder icon, so the popup can paint at once. A
+// small pool of worker threads then resolves shortcuts and extracts icons,
+// visible cells first, and hands the results back to the UI thread in batches
+// through WM_APP_ICONS_READY. Image list updates stay on the UI thread.
+// Each run is its own refcounted IconLoader working from a copy of the
+// items, so a worker stuck in the shell can outlive its run (or its popup)
+// without touching what came after; the last reference frees it.
+#define WM_APP_ICONS_READY (WM_APP + 1)
+#define ICON_LOADER_MAX_THREADS 4
+#define ICON_LOADER_CLOSE_WAIT_MS 500   // Grace period for workers when a run is cut short
+#define ICON_PRIORITY_VISIBLE 0
+#define ICON_PRIORITY_OFFSCREEN 1
+// An item that takes longer than this (a network share that stopped
+// answering) switches the rest of the run to generic icons
+#define ICON_SLOW_ITEM_MS 2000
+
+typedef struct IconJob {
+    int priority;
+    int item;
+} IconJob;
+
+typedef struct IconResult {
+    int item;
+    HICON hIcon;            // Shell icon that could not be read back, or NULL
+    BYTE* pixels;           // At the loader's icon size (owned), or NULL
+    ULONGLONG pixelHash;    // HashPixels of the master the pixels came from
+} IconResult;
+
+typedef struct IconLoader {
+    volatile LONG references;   // The popup's, plus one per worker
+    SRWLOCK lock;
+    HWND hwndNotify;            // Cleared once the run is detached
+    ItemStore items;            // Copy of g_store when the run started
+
+    // Min-heap of jobs ordered by (priority, item). Re-prioritising pushes
+    // duplicates; items already taken are skipped when popped.
+    IconJob* heap;
+    int heapCount;
+    int heapCapacity;
+    BYTE* taken;            // Per store item; items outside the run start taken
+    int itemCount;          // Items in the run, each extracted once
+
+    IconResult* results;
+    int resultCount;
+    int resultCapacity;
+    int applied;
+    int iconSize;           // Level the results are resampled to
+
+    volatile LONG cancelled;
+    volatile LONG slow;     // Generic icons only, see ICON_SLOW_ITEM_MS
+    HANDLE threads[ICON_LOADER_MAX_THREADS];
+    int threadCount;
+
+    IconCache cache;
+    BOOL persist;           // Joined cleanly: write the cache back on release
+} IconLoader;
+
+static IconLoader* g_iconLoader = NULL;
+
+// State of the image list across runs: some items still show a placeholder
+// because a run was cut short, or got a generic icon from a slow run
+static BOOL g_iconsIncomplete = FALSE;
+static BOOL g_iconsSlow = FALSE;
+static int g_placeholderFileIcon = -1;
+static int g_placeholderFolderIcon = -1;
+
+static BOOL IconJobBefore(const IconJob* a, const IconJob* b) {
+    if (a->priority != b->priority) return a->priority < b->priority;
+    return a->item < b->item;
+}
+
+// Caller holds the loader lock.
+static void IconHeapPush(IconLoader* loader, int item, int priority) {
+    if (loader->heapCount == loader->heapCapacity) {
+        int newCapacity = loader->heapCapacity ? loader->heapCapacity * 2 : 256;
+        IconJob* heap = realloc(loader->heap, newCapacity * sizeof(IconJob));
+        if (!heap) return;
+        loader->heap = heap;
+        loader->heapCapacity = newCapacity;
+    }
+
+    int i = loader->heapCount++;
+    IconJob job = { priority, item };
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!IconJobBefore(&job, &loader->heap[parent])) break;
+        loader->heap[i] = loader->heap[parent];
+        i = parent;
+    }
+    loader->heap[i] = job;
+}
+
+// Caller holds the loader lock.
+static BOOL IconHeapPop(IconLoader* loader, IconJob* out) {
+    if (loader->heapCount == 0) return FALSE;
+
+    *out = loader->heap[0];
+    IconJob last = loader->heap[--loader->heapCount];
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= loader->heapCount) break;
+        if (child + 1 < loader->heapCount && IconJobBefore(&loader->heap[child + 1], &loader->heap[child])) {
+            child++;
+        }
+        if (!IconJobBefore(&loader->heap[child], &last)) break;
+        loader->heap[i] = loader->heap[child];
+        i = child;
+    }
+    if (loader->heapCount > 0) loader->heap[i] = last;
+    return TRUE;
+}
+
+// Worker side: resolves the item's icon source and produces cached pixels,
+// natively decoded pixels or a shell icon. Runs without the loader lock held.
+// knownTarget is a shortcut's target from the folder manifest, if any.
+static void ExtractIconForPath(IconLoader* loader, const WCHAR* itemPath, const WCHAR* knownTarget,
+                               BOOL isDirectory, IconResult* result) {
+    IconCache* cache = &loader->cache;
+    BYTE* master;
+
+    // Generic icon by name, without touching the file or the cache
+    if (loader->slow) {
+        master = malloc(ICON_PIXEL_BYTES);
+        if (!master) return;
+        DWORD attributes = isDirectory ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+        if (!ShellIconToPixels(itemPath, attributes, SHGFI_USEFILEATTRIBUTES, master, &result->hIcon)) {
+            free(master);
+            return;
+        }
+        result->pixelHash = HashPixels(master, ICON_PIXEL_BYTES);
+        goto resample;
+    }
+
+    // Get icon - for shortcuts, get the target's icon without overlay arrow
+    WCHAR targetPath[MAX_PATH];
+    const WCHAR* iconPath = itemPath;
+
+    if (knownTarget) {
+        iconPath = knownTarget;
+    } else if (IsShortcut(itemPath)) {
+        LONGLONG resolveStart = TraceBegin();
+        if (ResolveShortcut(itemPath, targetPath, MAX_PATH)) {
+            iconPath = targetPath;
+        }
+        TraceEndArg("ResolveShortcut", resolveStart, result->item);
+    }
+
+    IconCacheKey key;
+    BOOL haveKey = GetIconCacheKey(iconPath, &key);
+
+    if (haveKey) {
+        const BYTE* master = IconCacheLookup(cache, &key, &result->pixelHash);
+        if (master) {
+            InterlockedIncrement(&cache->hits);
+            result->pixels = malloc((SIZE_T)loader->iconSize * loader->iconSize * 4);
+            if (result->pixels && !ResamplePixels(master, ICON_MASTER_SIZE, ICON_MASTER_SIZE,
+                                                  loader->iconSize, result->pixels)) {
+                free(result->pixels);
+                result->pixels = NULL;
+            }
+            return;
+        }
+    }
+
+    InterlockedIncrement(&cache->misses);
+
+    // Icons inside .exe, .dll and .ico files, and folder icons set through
+    // desktop.ini (which the shell only honours on read-only or system
+    // folders), are decoded in-process. Everything else goes to the shell.
+    WCHAR location[MAX_PATH], decodePath[MAX_PATH];
+    int decodeIndex = 0;
+    BOOL decodable = FALSE;
+    if (isDirectory) {
+        DWORD attributes = GetFileAttributesW(iconPath);
+        if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_SYSTEM)) &&
+            wcslen(iconPath) < MAX_PATH - 12 && GetFolderIconLocation(iconPath, location, &decodeIndex)) {
+            DWORD len = ExpandEnvironmentStringsW(location, decodePath, MAX_PATH);
+            decodable = len > 0 && len <= MAX_PATH;
+        }
+    } else if (IsIconSource(iconPath) && wcslen(iconPath) < MAX_PATH) {
+        wcscpy_s(decodePath, MAX_PATH, iconPath);
+        decodable = TRUE;
+    }
+
+    master = malloc(ICON_PIXEL_BYTES);
+    if (!master) return;
+
+    BOOL decoded = FALSE;
+    if (decodable) {
+        LONGLONG decodeStart = TraceBegin();
+        decoded = DecodeIconFile(decodePath, decodeIndex, ICON_MASTER_SIZE, master);
+        TraceEndArg("DecodeIcon", decodeStart, result->item);
+    }
+
+    // Shell icons are read back into pixels too, so that every icon can
+    // share an image list slot with identical ones
+    if (!decoded) {
+        LONGLONG extractStart = TraceBegin();
+        decoded = ShellIconToPixels(iconPath, 0, 0, master, &result->hIcon);
+        TraceEndArg("ExtractIcon", extractStart, result->item);
+        if (!decoded) {
+            free(master);
+            return;
+        }
+    }
+
+    result->pixelHash = HashPixels(master, ICON_PIXEL_BYTES);
+    if (haveKey) {
+        AcquireSRWLockExclusive(&loader->lock);
+        IconCacheAdd(cache, &key, master, result->pixelHash);
+        ReleaseSRWLockExclusive(&loader->lock);
+    }
+
+resample:
+    if (loader->iconSize == ICON_MASTER_SIZE) {
+        result->pixels = master;
+        return;
+    }
+    result->pixels = malloc((SIZE_T)loader->iconSize * loader->iconSize * 4);
+    if (result->pixels && !ResamplePixels(master, ICON_MASTER_SIZE, ICON_MASTER_SIZE,
+                                          loader->iconSize, result->pixels)) {
+        free(result->pixels);
+        result->pixels = NULL;
+    }
+    free(master);
+}
+
+static void ExtractItemIcon(IconLoader* loader, int itemIndex, IconResult* result) {
+    const ItemStore* items = &loader->items;
+    const WCHAR* itemPath = items->arena + items->pathOffset[itemIndex];
+    const WCHAR* knownTarget = items->targetOffset[itemIndex] == ITEM_NO_TARGET
+        ? NULL : items->arena + items->targetOffset[itemIndex];
+    BOOL isDirectory = (items->flags[itemIndex] & ITEM_FLAG_DIRECTORY) != 0;
+
+    result->item = itemIndex;
+    result->hIcon = NULL;
+    result->pixels = NULL;
+    result->pixelHash = 0;
+
+    // Paths past MAX_PATH need the extended-length prefix for file APIs
+    SIZE_T length = wcslen(itemPath);
+    if (length >= MAX_PATH) {
+        WCHAR* extendedPath = malloc((length + 5) * sizeof(WCHAR));
+        if (extendedPath) {
+            swprintf_s(extendedPath, length + 5, L"\\\\?\\%s", itemPath);
+            ExtractIconForPath(loader, extendedPath, knownTarget, isDirectory, result);
+            free(extendedPath);
+        }
+        return;
+    }
+
+    ExtractIconForPath(loader, itemPath, knownTarget, isDirectory, result);
+}
+
+static void IconLoaderRelease(IconLoader* loader) {
+    if (InterlockedDecrement(&loader->references) != 0) return;
+
+    for (int i = 0; i < loader->resultCount; i++) {
+        if (loader->results[i].hIcon) DestroyIcon(loader->results[i].hIcon);
+        free(loader->results[i].pixels);
+    }
+    IconCacheClose(&loader->cache, loader->persist);
+    FreeItemStore(&loader->items);
+    free(loader->heap);
+    free(loader->taken);
+    free(loader->results);
+    free(loader);
+}
+
+static DWORD WINAPI IconWorkerThread(LPVOID param) {
+    IconLoader* loader = (IconLoader*)param;
+    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+
+    for (;;) {
+        IconJob job;
+        BOOL haveJob = FALSE;
+
+        AcquireSRWLockExclusive(&loader->lock);
+        while (!loader->cancelled && IconHeapPop(loader, &job)) {
+            if (!loader->taken[job.item]) {
+                loader->taken[job.item] = 1;
+                haveJob = TRUE;
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&loader->lock);
+
+        // Every item is queued up front, so an empty heap means all work
+        // has been handed out
+        if (!haveJob) break;
+
+        IconResult result;
+        ULONGLONG itemStart = GetTickCount64();
+        ExtractItemIcon(loader, job.item, &result);
+        if (!loader->slow && GetTickCount64() - itemStart > ICON_SLOW_ITEM_MS) {
+            InterlockedExchange(&loader->slow, 1);
+        }
+
+        AcquireSRWLockExclusive(&loader->lock);
+        if (loader->resultCount == loader->resultCapacity) {
+            int newCapacity = loader->resultCapacity ? loader->resultCapacity * 2 : 64;
+            IconResult* results = realloc(loader->results, newCapacity * sizeof(IconResult));
+            if (results) {
+                loader->results = results;
+                loader->resultCapacity = newCapacity;
+            }
+        }
+        if (loader->resultCount < loader->resultCapacity) {
+            // Only the first result of a batch needs to wake the UI thread
+            if (loader->resultCount++ == 0 && loader->hwndNotify) {
+                PostMessageW(loader->hwndNotify, WM_APP_ICONS_READY, 0, 0);
+            }
+            loader->results[loader->resultCount - 1] = result;
+        } else {
+            if (result.hIcon) DestroyIcon(result.hIcon);
+            free(result.pixels);
+        }
+        ReleaseSRWLockExclusive(&loader->lock);
+    }
+
+    CoUninitialize();
+    IconLoaderRelease(loader);
+    return 0;
+}
+
+// Moves the items on screen to the front of the extraction queue.
+static void IconLoaderPrioritizeVisible(void) {
+    IconLoader* loader = g_iconLoader;
+    if (!loader) return;
+
+    int first, last;
+    GridVisibleRange(&g_grid, &first, &last);
+
+    AcquireSRWLockExclusive(&loader->lock);
+    for (int i = first; i <= last; i++) {
+        int item = ViewItem(i);
+        if (!loader->taken[item]) IconHeapPush(loader, item, ICON_PRIORITY_VISIBLE);
+    }
+    ReleaseSRWLockExclusive(&loader->lock);
+}
+
+// Ends the current run. Workers get up to waitMs to finish; anything short
+// of INFINITE also cancels the items not started yet. A run whose workers
+// all stopped writes its icon cache misses back when released. Workers
+// still stuck in the shell are left to release the run themselves, and it
+// no longer reports to the popup.
+static void IconLoaderStop(DWORD waitMs) {
+    IconLoader* loader = g_iconLoader;
+    if (!loader) return;
+    g_iconLoader = NULL;
+
+    if (waitMs != INFINITE) {
+        InterlockedExchange(&loader->cancelled, 1);
+    }
+
+    BOOL joined = TRUE;
+    if (loader->threadCount > 0) {
+        joined = WaitForMultipleObjects(loader->threadCount, loader->threads, TRUE, waitMs) != WAIT_TIMEOUT;
+    }
+    for (int i = 0; i < loader->threadCount; i++) {
+        CloseHandle(loader->threads[i]);
+    }
+
+    AcquireSRWLockExclusive(&loader->lock);
+    loader->hwndNotify = NULL;
+    loader->persist = joined;
+    ReleaseSRWLockExclusive(&loader->lock);
+
+    if (loader->slow) g_iconsSlow = TRUE;
+    if (joined) IconSlotReport(&g_iconSlots);
+    IconLoaderRelease(loader);
+}
+
+// Starts extracting icons for the given items, or for every item when
+// items is NULL. Any run still going is cancelled first.
+static void IconLoaderStart(HWND hwnd, const int* items, int count) {
+    IconLoaderStop(0);
+
+    // A folder that was slow a moment ago still is, unless every icon is
+    // being extracted afresh
+    if (!items) {
+        g_iconsIncomplete = FALSE;
+        g_iconsSlow = FALSE;
+    }
+
+    int itemCount = items ? count : g_store.count;
+    if (itemCount == 0) return;
+    g_iconsIncomplete = TRUE;
+
+    IconLoader* loader = calloc(1, sizeof(IconLoader));
+    if (!loader) return;
+    loader->references = 1;
+    InitializeSRWLock(&loader->lock);
+    loader->hwndNotify = hwnd;
+    loader->iconSize = g_iconSize;
+    loader->slow = g_iconsSlow;
+
+    loader->items.sortMode = g_store.sortMode;
+    loader->items.rootLength = g_store.rootLength;
+    loader->taken = calloc(g_store.count, 1);
+    BOOL copied = loader->taken != NULL;
+    for (int i = 0; copied && i < g_store.count; i++) {
+        copied = ItemStoreAppend(&loader->items, &g_store, i) >= 0;
+    }
+    if (!copied) {
+        FreeItemStore(&loader->items);
+        free(loader->taken);
+        free(loader);
+        return;
+    }
+
+    // A subset run must not extract (and count) the items the visible-first
+    // pushes of IconLoaderPrioritizeVisible would add from the rest
+    if (items) {
+        memset(loader->taken, 1, g_store.count);
+        for (int i = 0; i < count; i++) {
+            if (loader->taken[items[i]]) {
+                loader->taken[items[i]] = 0;
+                loader->itemCount++;
+            }
+        }
+    } else {
+        loader->itemCount = itemCount;
+    }
+
+    IconCacheOpen(&loader->cache);
+
+    int first, last;
+    GridVisibleRange(&g_grid, &first, &last);
+    for (int i = 0; i < g_store.count; i++) {
+        if (loader->taken[i]) continue;
+        BOOL visible = i >= first && i <= last;
+        IconHeapPush(loader, i, visible ? ICON_PRIORITY_VISIBLE : ICON_PRIORITY_OFFSCREEN);
+    }
+
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    int threadCount = (int)si.dwNumberOfProcessors;
+    threadCount = max(1, min(threadCount, ICON_LOADER_MAX_THREADS));
+    threadCount = min(threadCount, loader->itemCount);
+
+    for (int i = 0; i < threadCount; i++) {
+        InterlockedIncrement(&loader->references);
+        HANDLE hThread = CreateThread(NULL, 0, IconWorkerThread, loader, 0, NULL);
+        if (hThread) {
+            SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+            loader->threads[loader->threadCount++] = hThread;
+        } else {
+            InterlockedDecrement(&loader->references);
+        }
+    }
+    g_iconLoader = loader;
+}
+
+// UI side of WM_APP_ICONS_READY: uploads a batch of finished icons and
+// repaints the affected range once.
+static void IconLoaderApplyResults(void) {
+    IconLoader* loader = g_iconLoader;
+    if (!loader) return;
+
+    AcquireSRWLockExclusive(&loader->lock);
+    IconResult* batch = loader->results;
+    int batchCount = loader->resultCount;
+    loader->results = NULL;
+    loader->resultCount = 0;
+    loader->resultCapacity = 0;
+    ReleaseSRWLockExclusive(&loader->lock);
+
+    LONGLONG traceStart = TraceBegin();
+    int firstChanged = g_store.count, lastChanged = -1;
+    for (int i = 0; i < batchCount; i++) {
+        IconResult* result = &batch[i];
+        int index = -1;
+        if (result->pixels) {
+            index = IconSlotAdd(&g_iconSlots, g_imageList, result->pixels, result->pixelHash);
+            free(result->pixels);
+        } else if (result->hIcon) {
+            index = ImageList_AddIcon(g_imageList, result->hIcon);
+            DestroyIcon(result->hIcon);
+        }
+
+        if (index >= 0) {
+            g_store.iconIndex[result->item] = index;
+            firstChanged = min(firstChanged, result->item);
+            lastChanged = max(lastChanged, result->item);
+        }
+    }
+    free(batch);
+
+    loader->applied += batchCount;
+    if (lastChanged >= 0 && g_filter.queryLength) {
+        InvalidateRect(g_hwndListView, NULL, FALSE);  // Items are not in store order
+    } else if (lastChanged >= 0) {
+        ListView_RedrawItems(g_hwndListView, firstChanged, lastChanged);
+    }
+    TraceEnd("ApplyIconBatch", traceStart);
+
+    if (loader->applied >= loader->itemCount) {
+        IconLoaderStop(INFINITE);
+        g_iconsIncomplete = FALSE;
+    }
+}
+
+// Placeholders go through the slot table like any other icon, so items whose
+// real icon is the generic one keep pointing at the placeholder's slot.
+static int AddPlaceholderIcon(const WCHAR* name, DWORD attributes) {
+    BYTE master[ICON_PIXEL_BYTES];
+    BYTE pixels[ICON_PIXEL_BYTES];
+    HICON unreadable;
+    if (ShellIconToPixels(name, attributes, SHGFI_USEFILEATTRIBUTES, master, &unreadable) &&
+        ResamplePixels(master, ICON_MASTER_SIZE, ICON_MASTER_SIZE, g_iconSize, pixels)) {
+        g_iconSlots.requests--;  // Not an item's icon
+        return IconSlotAdd(&g_iconSlots, g_imageList, pixels, HashPixels(master, ICON_PIXEL_BYTES));
+    }
+    if (!unreadable) return -1;
+
+    int index = ImageList_AddIcon(g_imageList, unreadable);
+    DestroyIcon(unreadable);
+    return index;
+}
+
+static void AddPlaceholderIcons(void) {
+    g_placeholderFileIcon = AddPlaceholderIcon(L"file", FILE_ATTRIBUTE_NORMAL);
+    g_placeholderFolderIcon = AddPlaceholderIcon(L"folder", FILE_ATTRIBUTE_DIRECTORY);
+}
+
+// Directory enumeration. Entries come from GetFileInformationByHandleEx in
+// batches of FILE_FULL_DIR_INFO records: one call returns hundreds of
+// entries, and no short names are generated. File systems that do not
+// support it fall back to FindFirstFileExW with the basic info level and
+// large fetches. "." and ".." are never returned.
+#define DIR_READER_BATCH_BYTES 65536    // The most an SMB server returns per call
+
+typedef struct DirEntry {
+    const WCHAR* name;      // Valid until the next DirReaderNext
+    int nameLength;
+    DWORD attributes;
+    ULONGLONG size;
+    ULONGLONG lastWrite;    // FILETIME
+} DirEntry;
+
+typedef struct DirReader {
+    HANDLE hDirectory;      // Batched reads, or INVALID_HANDLE_VALUE
+    HANDLE hFind;           // FindFirstFileExW fallback, or INVALID_HANDLE_VALUE
+    BYTE* batch;
+    DWORD offset;           // Of the next record in batch
+    BOOL batchPending;      // batch holds records not returned yet
+    BOOL findPending;       // findData holds an entry not returned yet
+    WIN32_FIND_DATAW findData;
+    WCHAR name[MAX_PATH];
+} DirReader;
+
+// Returns FALSE if the folder cannot be listed; otherwise the reader must
+// be closed with DirReaderClose.
+static BOOL DirReaderOpen(DirReader* reader, const WCHAR* folderPath) {
+    ZeroMemory(reader, sizeof(*reader));
+    reader->hDirectory = INVALID_HANDLE_VALUE;
+    reader->hFind = INVALID_HANDLE_VALUE;
+
+    SIZE_T pathLength = wcslen(folderPath);
+    WCHAR* path = malloc((pathLength + 8) * sizeof(WCHAR));
+    if (!path) return FALSE;
+    int length = swprintf_s(path, pathLength + 8, L"%s%s", pathLength + 2 >= MAX_PATH ? L"\\\\?\\" : L"", folderPath);
+
+    reader->batch = malloc(DIR_READER_BATCH_BYTES);
+    if (reader->batch) {
+        reader->hDirectory = CreateFileW(path, FILE_LIST_DIRECTORY,
+                                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                         OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    }
+    if (reader->hDirectory != INVALID_HANDLE_VALUE) {
+        if (GetFileInformationByHandleEx(reader->hDirectory, FileFullDirectoryInfo, reader->batch,
+                                         DIR_READER_BATCH_BYTES)) {
+            reader->batchPending = TRUE;
+            free(path);
+            return TRUE;
+        }
+        if (GetLastError() == ERROR_NO_MORE_FILES) {
+            free(path);
+            return TRUE;
+        }
+        CloseHandle(reader->hDirectory);
+        reader->hDirectory = INVALID_HANDLE_VALUE;
+    }
+    free(reader->batch);
+    reader->batch = NULL;
+
+    wcscpy_s(path + length, pathLength + 8 - length, L"\\*");
+    reader->hFind = FindFirstFileExW(path, FindExInfoBasic, &reader->findData, FindExSearchNameMatch, NULL,
+                                     FIND_FIRST_EX_LARGE_FETCH);
+    free(path);
+    reader->findPending = TRUE;
+    return reader->hFind != INVALID_HANDLE_VALUE;
+}
+
+static BOOL DirReaderNext(DirReader* reader, DirEntry* entry) {
+    for (;;) {
+        if (reader->hFind != INVALID_HANDLE_VALUE) {
+            if (!reader->findPending && !FindNextFileW(reader->hFind, &reader->findData)) return FALSE;
+            reader->findPending = FALSE;
+            const WIN32_FIND_DATAW* findData = &reader->findData;
+            entry->name = findData->cFileName;
+            entry->nameLength = (int)wcslen(findData->cFileName);
+            entry->attributes = findData->dwFileAttributes;
+            entry->size = ((ULONGLONG)findData->nFileSizeHigh << 32) | findData->nFileSizeLow;
+            entry->lastWrite = ((ULONGLONG)findData->ftLastWriteTime.dwHighDateTime << 32) |
+                               findData->ftLastWriteTime.dwLowDateTime;
+        } else {
+            if (!reader->batchPending) {
+                if (reader->hDirectory == INVALID_HANDLE_VALUE ||
+                    !GetFileInformationByHandleEx(reader->hDirectory, FileFullDirectoryInfo, reader->batch,
+                                                  DIR_READER_BATCH_BYTES)) {
+                    return FALSE;
+                }
+                reader->offset = 0;
+                reader->batchPending = TRUE;
+            }
+            const FILE_FULL_DIR_INFO* info = (const FILE_FULL_DIR_INFO*)(reader->batch + reader->offset);
+            if (info->NextEntryOffset) {
+                reader->offset += info->NextEntryOffset;
+            } else {
+                reader->batchPending = FALSE;
+            }
+
+            // Names are not terminated in the batch
+            int nameLength = (int)(info->FileNameLength / sizeof(WCHAR));
+            if (nameLength >= MAX_PATH) continue;
+            wmemcpy(reader->name, info->FileName, nameLength);
+            reader->name[nameLength] = L'\0';
+            entry->name = reader->name;
+            entry->nameLength = nameLength;
+            entry->attributes = info->FileAttributes;
+            entry->size = (ULONGLONG)info->EndOfFile.QuadPart;
+            entry->lastWrite = (ULONGLONG)info->LastWriteTime.QuadPart;
+        }
+
+        if (entry->name[0] == L'.' && (entry->nameLength == 1 || (entry->nameLength == 2 && entry->name[1] == L'.'))) {
+            continue;
+        }
+        return TRUE;
+    }
+}
+
+static void DirReaderClose(DirReader* reader) {
+    if (reader->hDirectory != INVALID_HANDLE_VALUE) CloseHandle(reader->hDirectory);
+    if (reader->hFind != INVALID_HANDLE_VALUE) FindClose(reader->hFind);
+    free(reader->batch);
+}
+
+// Listing rules (--include, --exclude, and a .foldericon file in the folder).
+// Patterns are wildcards (* for any run of characters, ? for one) matched
+// against item names without regard to case; a trailing \ or / limits a
+// pattern to folders. Excludes win over includes, and includes only narrow
+// the files, so subfolders stay listed (and walked) unless excluded.
+//
+// The rules are compiled once per listing. Exact names and one-extension
+// patterns ("*.tmp") share a hash table keyed by HashPath, so the usual
+// rules cost one or two lookups per entry however many there are; "abc*",
+// "*abc" and "*abc*" compare one literal, and only other shapes run the
+// general matcher.
+#define RULES_FILE_NAME L".foldericon"
+#define RULES_MAX_NAME 260
+
+typedef enum PatternKind {
+    PATTERN_EXACT,
+    PATTERN_EXTENSION,      // "*.ext" with no other dot
+    PATTERN_PREFIX,         // "abc*"
+    PATTERN_SUFFIX,         // "*abc"
+    PATTERN_CONTAINS,       // "*abc*"
+    PATTERN_WILDCARD        // Anything else
+} PatternKind;
+
+typedef struct NamePattern {
+    BYTE kind;
+    BYTE directoriesOnly;
+    WORD length;            // Of text
+    ULONGLONG hash;         // HashPath of text, for the hashed kinds
+    WCHAR* text;            // Lower-cased literal, or the whole pattern for PATTERN_WILDCARD
+} NamePattern;
+
+typedef struct PatternSet {
+    NamePattern* patterns;
+    int count;
+    int capacity;
+    int* slots;             // Exact and extension patterns by hash: index + 1, 0 = empty
+    DWORD mask;
+    int* scan;              // The other patterns, tried in turn
+    int scanCount;
+} PatternSet;
+
+typedef struct ListingRules {
+    PatternSet include;
+    PatternSet exclude;
+    ULONGLONG hash;         // Of the rule text; 0 without rules
+} ListingRules;
+
+static ListingRules g_listingRules;
+
+static void PatternSetFree(PatternSet* set) {
+    for (int i = 0; i < set->count; i++) free(set->patterns[i].text);
+    free(set->patterns);
+    free(set->slots);
+    free(set->scan);
+    ZeroMemory(set, sizeof(*set));
+}
+
+static void RulesFree(ListingRules* rules) {
+    PatternSetFree(&rules->include);
+    PatternSetFree(&rules->exclude);
+    rules->hash = 0;
+}
+
+// * matches any run, ? any one character. Both strings are lower-cased.
+static BOOL WildcardMatch(const WCHAR* pattern, const WCHAR* name) {
+    const WCHAR* star = NULL;
+    const WCHAR* resume = NULL;
+    while (*name) {
+        if (*pattern == L'*') {
+            star = pattern++;
+            resume = name;
+        } else if (*pattern == L'?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return FALSE;
+        }
+    }
+    while (*pattern == L'*') pattern++;
+    return *pattern == L'\0';
+}
+
+static BOOL PatternSetAdd(PatternSet* set, const WCHAR* pattern, int length) {
+    BOOL directoriesOnly = length > 0 && (pattern[length - 1] == L'\\' || pattern[length - 1] == L'/');
+    if (directoriesOnly) length--;
+    if (length <= 0 || length >= RULES_MAX_NAME) return FALSE;
+
+    if (set->count == set->capacity) {
+        int capacity = set->capacity ? set->capacity * 2 : 16;
+        NamePattern* patterns = realloc(set->patterns, capacity * sizeof(NamePattern));
+        if (!patterns) return FALSE;
+        set->patterns = patterns;
+        set->capacity = capacity;
+    }
+
+    int stars = 0, questions = 0;
+    for (int i = 0; i < length; i++) {
+        stars += pattern[i] == L'*';
+        questions += pattern[i] == L'?';
+    }
+    BOOL leading = pattern[0] == L'*';
+    BOOL trailing = length > 1 && pattern[length - 1] == L'*';
+
+    // The literal is the pattern without its outer stars
+    int start = 0, end = length;
+    PatternKind kind = PATTERN_WILDCARD;
+    if (!stars && !questions) {
+        kind = PATTERN_EXACT;
+    } else if (!questions && stars == leading + trailing) {
+        start = leading;
+        end = length - trailing;
+        kind = leading && trailing ? PATTERN_CONTAINS : leading ? PATTERN_SUFFIX : PATTERN_PREFIX;
+        if (kind == PATTERN_SUFFIX && end - start > 1 && pattern[start] == L'.' &&
+            !wmemchr(pattern + start + 1, L'.', end - start - 1)) {
+            kind = PATTERN_EXTENSION;
+        }
+    }
+
+    WCHAR* text = malloc((end - start + 1) * sizeof(WCHAR));
+    if (!text) return FALSE;
+    for (int i = start; i < end; i++) text[i - start] = towlower(pattern[i]);
+    text[end - start] = L'\0';
+
+    NamePattern* added = &set->patterns[set->count++];
+    added->kind = (BYTE)kind;
+    added->directoriesOnly = (BYTE)directoriesOnly;
+    added->length = (WORD)(end - start);
+    added->hash = HashPath(text);
+    added->text = text;
+    return TRUE;
+}
+
+// Indexes the patterns once they are all added
+static BOOL PatternSetIndex(PatternSet* set) {
+    int hashed = 0;
+    for (int i = 0; i < set->count; i++) {
+        hashed += set->patterns[i].kind == PATTERN_EXACT || set->patterns[i].kind == PATTERN_EXTENSION;
+    }
+
+    set->scan = malloc(max(1, set->count - hashed) * sizeof(int));
+    if (!set->scan) return FALSE;
+    if (hashed) {
+        DWORD capacity = 16;
+        while (capacity < (DWORD)hashed * 2) capacity *= 2;
+        set->slots = calloc(capacity, sizeof(int));
+        if (!set->slots) return FALSE;
+        set->mask = capacity - 1;
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        const NamePattern* pattern = &set->patterns[i];
+        if (pattern->kind == PATTERN_EXACT || pattern->kind == PATTERN_EXTENSION) {
+            DWORD slot = (DWORD)(pattern->hash ^ (pattern->hash >> 32)) & set->mask;
+            while (set->slots[slot]) slot = (slot + 1) & set->mask;
+            set->slots[slot] = i + 1;
+        } else {
+            set->scan[set->scanCount++] = i;
+        }
+    }
+    return TRUE;
+}
+
+static BOOL PatternSetLookup(const PatternSet* set, PatternKind kind, const WCHAR* text, int length,
+                             BOOL isDirectory) {
+    ULONGLONG hash = HashPath(text);
+    for (DWORD slot = (DWORD)(hash ^ (hash >> 32)) & set->mask; set->slots[slot]; slot = (slot + 1) & set->mask) {
+        const NamePattern* pattern = &set->patterns[set->slots[slot] - 1];
+        if (pattern->hash == hash && pattern->kind == kind && pattern->length == length &&
+            (isDirectory || !pattern->directoriesOnly) && wmemcmp(pattern->text, text, length) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// name is lower-cased, length characters long
+static BOOL PatternSetMatch(const PatternSet* set, const WCHAR* name, int length, BOOL isDirectory) {
+    if (set->slots) {
+        if (PatternSetLookup(set, PATTERN_EXACT, name, length, isDirectory)) return TRUE;
+        const WCHAR* extension = wcsrchr(name, L'.');
+        if (extension && PatternSetLookup(set, PATTERN_EXTENSION, extension, (int)(name + length - extension),
+                                          isDirectory)) {
+            return TRUE;
+        }
+    }
+
+    for (int i = 0; i < set->scanCount; i++) {
+        const NamePattern* pattern = &set->patterns[set->scan[i]];
+        if (pattern->directoriesOnly && !isDirectory) continue;
+        int literal = pattern->length;
+        BOOL matched;
+        switch (pattern->kind) {
+            case PATTERN_PREFIX:
+                matched = length >= literal && wmemcmp(name, pattern->text, literal) == 0;
+                break;
+            case PATTERN_SUFFIX:
+            case PATTERN_EXTENSION:
+                matched = length >= literal && wmemcmp(name + length - literal, pattern->text, literal) == 0;
+                break;
+            case PATTERN_CONTAINS:
+                matched = wcsstr(name, pattern->text) != NULL;
+                break;
+            default:
+                matched = WildcardMatch(pattern->text, name);
+                break;
+        }
+        if (matched) return TRUE;
+    }
+    return FALSE;
+}
+
+// Adds rules, one per line: "include <pattern>", "exclude <pattern>", or a
+// bare pattern to exclude. Blank lines and lines starting with # are skipped.
+static void RulesAddText(ListingRules* rules, const WCHAR* text) {
+    while (*text) {
+        const WCHAR* lineEnd = text;
+        while (*lineEnd && *lineEnd != L'\n' && *lineEnd != L'\r') lineEnd++;
+
+        const WCHAR* start = text;
+        const WCHAR* end = lineEnd;
+        while (start < end && (*start == L' ' || *start == L'\t')) start++;
+        while (end > start && (end[-1] == L' ' || end[-1] == L'\t')) end--;
+
+        if (start < end && *start != L'#') {
+            PatternSet* set = &rules->exclude;
+            if (end - start > 8 && _wcsnicmp(start, L"include", 7) == 0 && (start[7] == L' ' || start[7] == L'\t')) {
+                set = &rules->include;
+                start += 8;
+            } else if (end - start > 8 && _wcsnicmp(start, L"exclude", 7) == 0 && (start[7] == L' ' || start[7] == L'\t')) {
+                start += 8;
+            }
+            while (start < end && (*start == L' ' || *start == L'\t')) start++;
+            PatternSetAdd(set, start, (int)(end - start));
+        }
+
+        text = lineEnd;
+        while (*text == L'\n' || *text == L'\r') text++;
+    }
+}
+
+// Compiles the command-line rules and the folder's rules file into rules
+static void RulesBuild(ListingRules* rules, const WCHAR* ruleText, const WCHAR* folderPath) {
+    RulesFree(rules);
+
+    // A folder too deep for the rules file beside it gets no rules file
+    WCHAR rulesPath[MAX_PATH];
+    WCHAR* fileText = NULL;
+    if (wcslen(folderPath) + 1 + wcslen(RULES_FILE_NAME) < MAX_PATH) {
+        swprintf_s(rulesPath, MAX_PATH, L"%s\\%s", folderPath, RULES_FILE_NAME);
+        if (GetFileAttributesW(rulesPath) != INVALID_FILE_ATTRIBUTES) fileText = ReadTextFile(rulesPath);
+    }
+
+    if (ruleText) RulesAddText(rules, ruleText);
+    if (fileText) RulesAddText(rules, fileText);
+    if (rules->include.count + rules->exclude.count == 0) {
+        free(fileText);
+        return;
+    }
+
+    if (!PatternSetIndex(&rules->include) || !PatternSetIndex(&rules->exclude)) {
+        RulesFree(rules);
+    } else {
+        rules->hash = HashPath(ruleText ? ruleText : L"") ^ (fileText ? HashPath(fileText) * 31 : 0);
+        if (!rules->hash) rules->hash = 1;
+    }
+    free(fileText);
+}
+
+// Whether an entry passes the rules. The rules file itself is never listed.
+static BOOL RulesAccept(const ListingRules* rules, const WCHAR* name, BOOL isDirectory) {
+    if (_wcsicmp(name, RULES_FILE_NAME) == 0) return FALSE;
+    if (!rules->hash) return TRUE;
+
+    // No file system allows a name this long; let it through unchecked
+    WCHAR folded[RULES_MAX_NAME];
+    int length = 0;
+    for (; name[length]; length++) {
+        if (length == RULES_MAX_NAME - 1) return TRUE;
+        folded[length] = towlower(name[length]);
+    }
+    folded[length] = L'\0';
+
+    if (PatternSetMatch(&rules->exclude, folded, length, isDirectory)) return FALSE;
+    return isDirectory || !rules->include.count || PatternSetMatch(&rules->include, folded, length, FALSE);
+}
+
+// Recursive listing (--recursive[=depth]). Subfolders are walked by a small
+// pool of threads, each with its own deque of directories: a worker pushes
+// the subfolders it finds and pops its newest one, and an idle worker steals
+// the oldest from someone else, so one deep branch on a slow disk does not
+// hold the others up. Items go into per-worker stores (keys included, so key
+// building is parallel too) and are merged by directory path, which makes the
+// result independent of thread timing. Directories below the depth limit,
+// and reparse points (which could loop), are listed as ordinary items.
+#define WALK_MAX_THREADS 8
+
+typedef struct WalkTask {
+    WCHAR* path;
+    int depth;
+} WalkTask;
+
+typedef struct WalkBlock {
+    int first;              // The items of one directory in the worker store
+    int count;
+} WalkBlock;
+
+typedef struct WalkWorker {
+    SRWLOCK lock;
+    WalkTask* tasks;        // Owner uses the tail, thieves the head
+    int head;
+    int tail;
+    int capacity;
+
+    ItemStore store;
+    WalkBlock* blocks;
+    int blockCount;
+    int blockCapacity;
+    struct TreeWalk* walk;
+} WalkWorker;
+
+typedef struct TreeWalk {
+    WalkWorker workers[WALK_MAX_THREADS];
+    int workerCount;
+    int maxDepth;
+    const ListingRules* rules;
+    volatile LONG* cancelled;   // Optional: stops the walk when set
+    volatile LONG pending;  // Directories queued or being listed
+} TreeWalk;
+
+static BOOL WalkPush(WalkWorker* worker, WCHAR* path, int depth) {
+    AcquireSRWLockExclusive(&worker->lock);
+    if (worker->head == worker->tail) {
+        worker->head = worker->tail = 0;
+    }
+    if (worker->tail == worker->capacity) {
+        int newCapacity = worker->capacity ? worker->capacity * 2 : 64;
+        WalkTask* tasks = realloc(worker->tasks, newCapacity * sizeof(WalkTask));
+        if (!tasks) {
+            ReleaseSRWLockExclusive(&worker->lock);
+            return FALSE;
+        }
+        worker->tasks = tasks;
+        worker->capacity = newCapacity;
+    }
+    InterlockedIncrement(&worker->walk->pending);
+    worker->tasks[worker->tail].path = path;
+    worker->tasks[worker->tail++].depth = depth;
+    ReleaseSRWLockExclusive(&worker->lock);
+    return TRUE;
+}
+
+static BOOL WalkTake(WalkWorker* worker, BOOL steal, WalkTask* task) {
+    BOOL taken = FALSE;
+    AcquireSRWLockExclusive(&worker->lock);
+    if (worker->head < worker->tail) {
+        *task = steal ? worker->tasks[worker->head++] : worker->tasks[--worker->tail];
+        taken = TRUE;
+    }
+    ReleaseSRWLockExclusive(&worker->lock);
+    return taken;
+}
+
+static void WalkDirectory(WalkWorker* worker, const WalkTask* task) {
+    ItemStore* store = &worker->store;
+    TreeWalk* walk = worker->walk;
+    SIZE_T pathLength = wcslen(task->path);
+    DirReader reader;
+    if ((walk->cancelled && *walk->cancelled) || !DirReaderOpen(&reader, task->path)) return;
+
+    int first = store->count;
+    DirEntry entry;
+    while (!(walk->cancelled && *walk->cancelled) && DirReaderNext(&reader, &entry)) {
+        if (entry.attributes & FILE_ATTRIBUTE_HIDDEN) continue;
+
+        BOOL isDirectory = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (!RulesAccept(walk->rules, entry.name, isDirectory)) continue;
+        BOOL isReparse = (entry.attributes & FILE_ATTRIBUTE_REPARSE_POINT) != 0;
+        if (isDirectory && !isReparse && task->depth < walk->maxDepth) {
+            SIZE_T childLength = pathLength + 1 + entry.nameLength + 1;
+            WCHAR* child = malloc(childLength * sizeof(WCHAR));
+            if (child) {
+                wmemcpy(child, task->path, pathLength);
+                child[pathLength] = L'\\';
+                wmemcpy(child + pathLength + 1, entry.name, entry.nameLength + 1);
+                if (WalkPush(worker, child, task->depth + 1)) continue;
+                free(child);
+            }
+        }
+
+        if (ItemStoreAddName(store, task->path, pathLength, entry.name, entry.nameLength,
+                             isDirectory ? ITEM_FLAG_DIRECTORY : 0,
+                             isDirectory ? g_placeholderFolderIcon : g_placeholderFileIcon) < 0) {
+            break;
+        }
+    }
+    DirReaderClose(&reader);
+
+    if (store->count > first) {
+        if (worker->blockCount == worker->blockCapacity) {
+            int newCapacity = worker->blockCapacity ? worker->blockCapacity * 2 : 64;
+            WalkBlock* blocks = realloc(worker->blocks, newCapacity * sizeof(WalkBlock));
+            if (!blocks) {
+                store->count = first;
+                return;
+            }
+            worker->blocks = blocks;
+            worker->blockCapacity = newCapacity;
+        }
+        worker->blocks[worker->blockCount].first = first;
+        worker->blocks[worker->blockCount++].count = store->count - first;
+    }
+}
+
+static DWORD WINAPI WalkWorkerThread(LPVOID param) {
+    WalkWorker* worker = (WalkWorker*)param;
+    TreeWalk* walk = worker->walk;
+    int self = (int)(worker - walk->workers);
+    int idle = 0;
+
+    for (;;) {
+        WalkTask task;
+        BOOL found = WalkTake(worker, FALSE, &task);
+        for (int i = 1; i < walk->workerCount && !found; i++) {
+            found = WalkTake(&walk->workers[(self + i) % walk->workerCount], TRUE, &task);
+        }
+
+        if (found) {
+            WalkDirectory(worker, &task);
+            free(task.path);
+            InterlockedDecrement(&walk->pending);
+            idle = 0;
+        } else if (walk->pending == 0) {
+            break;
+        } else if (++idle < 64) {
+            SwitchToThread();
+        } else {
+            Sleep(1);
+        }
+    }
+    return 0;
+}
+
+typedef struct WalkMergeBlock {
+    const ItemStore* store;
+    int first;
+    int count;
+} WalkMergeBlock;
+
+static int CompareWalkBlocks(const void* a, const void* b) {
+    const WalkMergeBlock* blockA = a;
+    const WalkMergeBlock* blockB = b;
+    const WCHAR* pathA = blockA->store->arena + blockA->store->pathOffset[blockA->first];
+    const WCHAR* pathB = blockB->store->arena + blockB->store->pathOffset[blockB->first];
+    int lengthA = blockA->store->nameStart[blockA->first];
+    int lengthB = blockB->store->nameStart[blockB->first];
+    int result = wcsncmp(pathA, pathB, min(lengthA, lengthB));
+    return result ? result : lengthA - lengthB;
+}
+
+// Lists root and its subfolders down to maxDepth into store (which must be
+// reset, with rootLength set) using threadCount workers, the calling thread
+// being one of them. Setting *cancelled, if given, cuts the walk short.
+static void WalkFolderTree(ItemStore* store, const WCHAR* root, int maxDepth, int threadCount,
+                           const ListingRules* rules, volatile LONG* cancelled) {
+    TreeWalk* walk = calloc(1, sizeof(TreeWalk));
+    WCHAR* rootCopy = _wcsdup(root);
+    if (!walk || !rootCopy) {
+        free(walk);
+        free(rootCopy);
+        return;
+    }
+
+    walk->workerCount = max(1, min(threadCount, WALK_MAX_THREADS));
+    walk->maxDepth = maxDepth;
+    walk->rules = rules;
+    walk->cancelled = cancelled;
+    for (int i = 0; i < walk->workerCount; i++) {
+        WalkWorker* worker = &walk->workers[i];
+        InitializeSRWLock(&worker->lock);
+        worker->walk = walk;
+        worker->store.sortMode = store->sortMode;
+        worker->store.rootLength = store->rootLength;
+    }
+    if (!WalkPush(&walk->workers[0], rootCopy, 0)) free(rootCopy);
+
+    HANDLE threads[WALK_MAX_THREADS];
+    int started = 0;
+    for (int i = 1; i < walk->workerCount; i++) {
+        HANDLE hThread = CreateThread(NULL, 0, WalkWorkerThread, &walk->workers[i], 0, NULL);
+        if (hThread) threads[started++] = hThread;
+    }
+    WalkWorkerThread(&walk->workers[0]);
+    if (started > 0) {
+        WaitForMultipleObjects(started, threads, TRUE, INFINITE);
+        for (int i = 0; i < started; i++) CloseHandle(threads[i]);
+    }
+
+    // Merge in directory order so the result does not depend on which
+    // worker listed what
+    int blockCount = 0;
+    for (int i = 0; i < walk->workerCount; i++) blockCount += walk->workers[i].blockCount;
+    WalkMergeBlock* blocks = malloc(max(blockCount, 1) * sizeof(WalkMergeBlock));
+    if (blocks) {
+        int b = 0;
+        for (int i = 0; i < walk->workerCount; i++) {
+            WalkWorker* worker = &walk->workers[i];
+            for (int k = 0; k < worker->blockCount; k++, b++) {
+                blocks[b].store = &worker->store;
+                blocks[b].first = worker->blocks[k].first;
+                blocks[b].count = worker->blocks[k].count;
+            }
+        }
+        qsort(blocks, blockCount, sizeof(WalkMergeBlock), CompareWalkBlocks);
+        for (b = 0; b < blockCount; b++) {
+            for (int k = 0; k < blocks[b].count; k++) {
+                if (ItemStoreAppend(store, blocks[b].store, blocks[b].first + k) < 0) break;
+            }
+        }
+        free(blocks);
+    }
+
+    for (int i = 0; i < walk->workerCount; i++) {
+        WalkWorker* worker = &walk->workers[i];
+        free(worker->tasks);
+        free(worker->blocks);
+        FreeItemStore(&worker->store);
+    }
+    free(walk);
+}
+
+static int WalkThreadCount(void) {
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return max(1, min((int)si.dwNumberOfProcessors, WALK_MAX_THREADS));
+}
+
+// Last-write time of the folder as of the last time g_store was brought up
+// to date, taken before reading so any later change shows up as a mismatch.
+static FILETIME g_storeLastWrite;
+
+static BOOL GetFolderLastWrite(const WCHAR* folderPath, FILETIME* lastWrite) {
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExW(folderPath, GetFileExInfoStandard, &fad)) return FALSE;
+    *lastWrite = fad.ftLastWriteTime;
+    return TRUE;
+}
+
+// Folder manifests. Once a listing has been checked against the disk, its
+// names, attributes and resolved shortcut targets are saved in display order
+// to manifest-<folder hash>.dat under %LOCALAPPDATA%\FolderIcon. The next
+// open of a folder whose last-write time and entry count still match builds
+// the store straight from the mapped file: no .lnk parsing, no filtering and,
+// when the sort mode is the same, no sorting. Counting the entries costs one
+// batched directory read, and catches changes that file systems with coarse
+// timestamps (FAT, some network shares) leave out of the last-write time. A background check then lists the
+// folder and re-reads its shortcuts (editing a shortcut does not touch the
+// folder's timestamp). If anything differs the popup rescans; otherwise the
+// manifest is rewritten if it changed.
+//
+// Layout: ManifestHeader, entryCount ManifestEntry records, then the string
+// area: the folder path followed by the NUL-terminated names and targets.
+// The checksum covers everything after it, so a file torn by a crash is
+// ignored. Writers build the file under a name of their own and
+// move it into place, so readers and concurrent writers only ever see a
+// complete manifest.
+#define MANIFEST_MAGIC 0x464D4946       // "FIMF"
+#define MANIFEST_VERSION 3
+#define MANIFEST_MAX_ENTRIES 65536
+#define MANIFEST_NO_TARGET MAXDWORD
+#define MANIFEST_REPLACE_ATTEMPTS 20
+
+typedef struct ManifestHeader {
+    DWORD magic;
+    DWORD version;
+    DWORD checksum;             // Low half of HashPixels over the rest of the file
+    DWORD entryCount;
+    ULONGLONG folderLastWrite;  // FILETIME of the folder when it was listed
+    ULONGLONG rulesHash;        // ListingRules the listing was filtered with
+    DWORD sortMode;             // Order the entries are in
+    DWORD stringChars;          // Size of the string area in WCHARs
+    DWORD folderEntries;        // Everything in the folder, hidden and excluded entries too
+    DWORD reserved;
+} ManifestHeader;
+
+#define MANIFEST_CHECKSUM_START (offsetof(ManifestHeader, checksum) + sizeof(DWORD))
+
+typedef struct ManifestEntry {
+    DWORD nameOffset;           // In WCHARs from the start of the string area
+    DWORD targetOffset;         // Or MANIFEST_NO_TARGET
+    DWORD attributes;
+} ManifestEntry;
+
+typedef struct ManifestItem {
+    const WCHAR* name;
+    const WCHAR* target;        // NULL unless a resolved shortcut
+    DWORD attributes;
+} ManifestItem;
+
+// Serializes a listing. Returns a malloc'd buffer, or NULL.
+static BYTE* ManifestBuild(const WCHAR* folderPath, ULONGLONG folderLastWrite, DWORD folderEntries,
+                           ULONGLONG rulesHash, int sortMode, const ManifestItem* items, int count, SIZE_T* size) {
+    if (count < 0 || count > MANIFEST_MAX_ENTRIES) return NULL;
+
+    SIZE_T chars = wcslen(folderPath) + 1;
+    for (int i = 0; i < count; i++) {
+        chars += wcslen(items[i].name) + 1;
+        if (items[i].target) chars += wcslen(items[i].target) + 1;
+    }
+    if (chars >= MAXDWORD / sizeof(WCHAR)) return NULL;
+
+    SIZE_T entriesSize = (SIZE_T)count * sizeof(ManifestEntry);
+    *size = sizeof(ManifestHeader) + entriesSize + chars * sizeof(WCHAR);
+    BYTE* data = malloc(*size);
+    if (!data) return NULL;
+
+    ManifestHeader* header = (ManifestHeader*)data;
+    ManifestEntry* entries = (ManifestEntry*)(data + sizeof(ManifestHeader));
+    WCHAR* strings = (WCHAR*)(data + sizeof(ManifestHeader) + entriesSize);
+
+    SIZE_T length = wcslen(folderPath) + 1;
+    wmemcpy(strings, folderPath, length);
+    for (int i = 0; i < count; i++) {
+        ManifestEntry* entry = &entries[i];
+        SIZE_T nameLength = wcslen(items[i].name) + 1;
+        entry->nameOffset = (DWORD)length;
+        wmemcpy(strings + length, items[i].name, nameLength);
+        length += nameLength;
+
+        entry->targetOffset = MANIFEST_NO_TARGET;
+        if (items[i].target) {
+            SIZE_T targetLength = wcslen(items[i].target) + 1;
+            entry->targetOffset = (DWORD)length;
+            wmemcpy(strings + length, items[i].target, targetLength);
+            length += targetLength;
+        }
+        entry->attributes = items[i].attributes;
+    }
+
+    ZeroMemory(header, sizeof(*header));
+    header->magic = MANIFEST_MAGIC;
+    header->version = MANIFEST_VERSION;
+    header->folderLastWrite = folderLastWrite;
+    header->rulesHash = rulesHash;
+    header->entryCount = (DWORD)count;
+    header->sortMode = (DWORD)sortMode;
+    header->stringChars = (DWORD)chars;
+    header->folderEntries = folderEntries;
+    header->checksum = (DWORD)HashPixels(data + MANIFEST_CHECKSUM_START, *size - MANIFEST_CHECKSUM_START);
+    return data;
+}
+
+// Checks that a manifest is intact and describes folderPath as of
+// folderLastWrite, when it held folderEntries entries, listed with the same
+// rules. Anything that fails here means a cold load.
+static BOOL ManifestValidate(const BYTE* data, SIZE_T size, const WCHAR* folderPath, ULONGLONG folderLastWrite,
+                             DWORD folderEntries, ULONGLONG rulesHash) {
+    if (size < sizeof(ManifestHeader)) return FALSE;
+
+    const ManifestHeader* header = (const ManifestHeader*)data;
+    if (header->magic != MANIFEST_MAGIC || header->version != MANIFEST_VERSION ||
+        header->folderLastWrite != folderLastWrite || header->folderEntries != folderEntries ||
+        header->rulesHash != rulesHash ||
+        header->entryCount > MANIFEST_MAX_ENTRIES ||
+        header->stringChars == 0) {
+        return FALSE;
+    }
+
+    SIZE_T entriesSize = (SIZE_T)header->entryCount * sizeof(ManifestEntry);
+    if (size != sizeof(ManifestHeader) + entriesSize + (SIZE_T)header->stringChars * sizeof(WCHAR)) return FALSE;
+    if ((DWORD)HashPixels(data + MANIFEST_CHECKSUM_START, size - MANIFEST_CHECKSUM_START) != header->checksum) {
+        return FALSE;
+    }
+
+    // Every string ends inside the area because the area ends with a NUL
+    const ManifestEntry* entries = (const ManifestEntry*)(data + sizeof(ManifestHeader));
+    const WCHAR* strings = (const WCHAR*)(data + sizeof(ManifestHeader) + entriesSize);
+    if (strings[header->stringChars - 1] != L'\0' || _wcsicmp(strings, folderPath) != 0) return FALSE;
+
+    for (DWORD i = 0; i < header->entryCount; i++) {
+        const ManifestEntry* entry = &entries[i];
+        if (entry->nameOffset == 0 || entry->nameOffset >= header->stringChars) return FALSE;
+        const WCHAR* name = strings + entry->nameOffset;
+        if (!name[0] || wcschr(name, L'\\')) return FALSE;
+        if (entry->targetOffset != MANIFEST_NO_TARGET &&
+            (entry->targetOffset == 0 || entry->targetOffset >= header->stringChars)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Counts everything in the folder the way DirReader lists it, without
+// looking at the entries
+static BOOL CountFolderEntries(const WCHAR* folderPath, DWORD* count) {
+    DirReader reader;
+    if (!DirReaderOpen(&reader, folderPath)) return FALSE;
+    DirEntry entry;
+    *count = 0;
+    while (DirReaderNext(&reader, &entry)) (*count)++;
+    DirReaderClose(&reader);
+    return TRUE;
+}
+
+static BOOL GetManifestPath(const WCHAR* folderPath, WCHAR* path) {
+    WCHAR fileName[MAX_PATH];
+    swprintf_s(fileName, MAX_PATH, L"manifest-%016llx.dat", HashPath(folderPath));
+    return GetIconCachePath(path, fileName);
+}
+
+// Replaces the manifest at path. The temporary name includes the thread, so
+// two popups (or two checks in a resident instance) never share one, and the
+// last move wins with a complete file either way. A reader that has the old
+// file open can make the move fail for a moment.
+static BOOL ManifestWriteFile(const WCHAR* path, const BYTE* data, SIZE_T size) {
+    WCHAR tempPath[MAX_PATH];
+    swprintf_s(tempPath, MAX_PATH, L"%s.%lu.%lu.tmp", path, GetCurrentProcessId(), GetCurrentThreadId());
+
+    HANDLE hFile = CreateFileW(tempPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+    DWORD written = 0;
+    BOOL ok = WriteFile(hFile, data, (DWORD)size, &written, NULL) && written == size;
+    CloseHandle(hFile);
+
+    for (int attempt = 0; ok && attempt < MANIFEST_REPLACE_ATTEMPTS; attempt++) {
+        if (MoveFileExW(tempPath, path, MOVEFILE_REPLACE_EXISTING)) return TRUE;
+        DWORD error = GetLastError();
+        if (error != ERROR_ACCESS_DENIED && error != ERROR_SHARING_VIOLATION) break;
+        Sleep(5);
+    }
+    DeleteFileW(tempPath);
+    return FALSE;
+}
+
+// TRUE if the file at path already holds exactly these bytes
+static BOOL ManifestFileMatches(const WCHAR* path, const BYTE* data, SIZE_T size) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                               FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    BOOL matches = FALSE;
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart == (LONGLONG)size) {
+        BYTE* existing = malloc(max(size, 1));
+        DWORD read = 0;
+        matches = existing && ReadFile(hFile, existing, (DWORD)size, &read, NULL) && read == size &&
+                  memcmp(existing, data, size) == 0;
+        free(existing);
+    }
+    CloseHandle(hFile);
+    return matches;
+}
+
+// Fills store from the folder's manifest when it is intact and the folder's
+// last-write time, entry count and listing rules still match. *sortMode is the order the
+// items are in. Returns FALSE, with the store empty, to fall back to
+// enumerating.
+static BOOL ManifestLoadStore(ItemStore* store, const WCHAR* folderPath, ULONGLONG folderLastWrite,
+                              ULONGLONG rulesHash, int* sortMode) {
+    WCHAR manifestPath[MAX_PATH];
+    if (!GetManifestPath(folderPath, manifestPath)) return FALSE;
+
+    HANDLE hFile = CreateFileW(manifestPath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    BOOL loaded = FALSE;
+    DWORD folderEntries;
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart >= (LONGLONG)sizeof(ManifestHeader) &&
+        fileSize.QuadPart <= 64 * 1024 * 1024 && CountFolderEntries(folderPath, &folderEntries)) {
+        HANDLE hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+        const BYTE* data = hMapping ? (const BYTE*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+        SIZE_T size = (SIZE_T)fileSize.QuadPart;
+
+        if (data && ManifestValidate(data, size, folderPath, folderLastWrite, folderEntries, rulesHash)) {
+            const ManifestHeader* header = (const ManifestHeader*)data;
+            const ManifestEntry* entries = (const ManifestEntry*)(data + sizeof(ManifestHeader));
+            const WCHAR* strings = (const WCHAR*)(entries + header->entryCount);
+
+            loaded = TRUE;
+            for (DWORD i = 0; i < header->entryCount && loaded; i++) {
+                BOOL isDirectory = (entries[i].attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+                int index = ItemStoreAdd(store, folderPath, strings + entries[i].nameOffset,
+                                         isDirectory ? ITEM_FLAG_DIRECTORY : 0,
+                                         isDirectory ? g_placeholderFolderIcon : g_placeholderFileIcon);
+                loaded = index >= 0 && (entries[i].targetOffset == MANIFEST_NO_TARGET ||
+                                        ItemStoreSetTarget(store, index, strings + entries[i].targetOffset));
+            }
+            *sortMode = (int)header->sortMode;
+            if (!loaded) ItemStoreReset(store);
+        }
+
+        if (data) UnmapViewOfFile(data);
+        if (hMapping) CloseHandle(hMapping);
+    }
+    CloseHandle(hFile);
+    return loaded;
+}
+
+// Background check of the items the popup shows against the disk. The
+// context is shared with the UI thread, which drops its reference when the
+// check is superseded or the popup closes.
+#define WM_APP_MANIFEST_STALE (WM_APP + 4)
+
+typedef struct ManifestCheck {
+    volatile LONG references;
+    volatile LONG cancelled;
+    HWND hwndNotify;
+    WCHAR folderPath[MAX_PATH];
+    ULONGLONG folderLastWrite;  // As of the snapshot
+    WCHAR* ruleText;            // Copy of g_ruleText
+    ListingRules rules;         // Built on the worker from ruleText
+    ItemStore items;            // Snapshot of g_store, in display order
+} ManifestCheck;
+
+static ManifestCheck* g_manifestCheck = NULL;
+
+static void ManifestCheckRelease(ManifestCheck* check) {
+    if (InterlockedDecrement(&check->references) == 0) {
+        FreeItemStore(&check->items);
+        RulesFree(&check->rules);
+        free(check->ruleText);
+        free(check);
+    }
+}
+
+// Lists the folder with the same filter as LoadFolderContents into listed,
+// with each entry's attributes, and counts every entry it holds. Returns
+// FALSE if the folder cannot be read.
+static BOOL ManifestListFolder(ManifestCheck* check, ItemStore* listed, DWORD** attributes, DWORD* folderEntries) {
+    DirReader reader;
+    if (!DirReaderOpen(&reader, check->folderPath)) return FALSE;
+
+    SIZE_T folderLength = wcslen(check->folderPath);
+    int capacity = 0;
+    BOOL ok = TRUE;
+    DirEntry entry;
+    *folderEntries = 0;
+    while (!check->cancelled && DirReaderNext(&reader, &entry)) {
+        (*folderEntries)++;
+        if (entry.attributes & FILE_ATTRIBUTE_HIDDEN) continue;
+        BOOL isDirectory = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (!RulesAccept(&check->rules, entry.name, isDirectory)) continue;
+
+        if (listed->count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            DWORD* grown = realloc(*attributes, capacity * sizeof(DWORD));
+            if (!grown) {
+                ok = FALSE;
+                break;
+            }
+            *attributes = grown;
+        }
+        int index = ItemStoreAddName(listed, check->folderPath, folderLength, entry.name, entry.nameLength,
+                                     isDirectory ? ITEM_FLAG_DIRECTORY : 0, 0);
+        if (index < 0) {
+            ok = FALSE;
+            break;
+        }
+        (*attributes)[index] = entry.attributes;
+    }
+    DirReaderClose(&reader);
+    return ok && !check->cancelled;
+}
+
+static DWORD WINAPI ManifestCheckThread(LPVOID param) {
+    ManifestCheck* check = (ManifestCheck*)param;
+    ItemStore* items = &check->items;
+    LONGLONG traceStart = TraceBegin();
+
+    ItemStore listed = {0};
+    listed.sortMode = items->sortMode;
+    DWORD* attributes = NULL;
+    DWORD folderEntries = 0;
+    int* match = malloc(max(items->count, 1) * sizeof(int));
+    WCHAR (*targets)[MAX_PATH] = malloc(max(items->count, 1) * sizeof(*targets));
+    ManifestItem* entries = malloc(max(items->count, 1) * sizeof(ManifestItem));
+
+    // Names hash to a slot in an open-addressing table of listed indices
+    DWORD mask = 1;
+    while (mask < (DWORD)items->count * 2) mask <<= 1;
+    int* slots = calloc(mask, sizeof(int));
+    mask--;
+
+    RulesBuild(&check->rules, check->ruleText, check->folderPath);
+    BOOL listedOk = match && targets && entries && slots && ManifestListFolder(check, &listed, &attributes, &folderEntries);
+    BOOL stale = listedOk && listed.count != items->count;
+
+    if (listedOk && !stale) {
+        for (int i = 0; i < listed.count; i++) {
+            const WCHAR* name = listed.arena + listed.pathOffset[i] + listed.nameStart[i];
+            DWORD slot = (DWORD)HashPath(name) & mask;
+            while (slots[slot]) slot = (slot + 1) & mask;
+            slots[slot] = i + 1;
+        }
+    }
+
+    for (int i = 0; listedOk && !stale && i < items->count && !check->cancelled; i++) {
+        const WCHAR* path = items->arena + items->pathOffset[i];
+        const WCHAR* name = path + items->nameStart[i];
+        DWORD slot = (DWORD)HashPath(name) & mask;
+        match[i] = -1;
+        for (; slots[slot]; slot = (slot + 1) & mask) {
+            int candidate = slots[slot] - 1;
+            if (_wcsicmp(listed.arena + listed.pathOffset[candidate] + listed.nameStart[candidate], name) == 0) {
+                match[i] = candidate;
+                break;
+            }
+        }
+        if (match[i] < 0 || ((listed.flags[match[i]] ^ items->flags[i]) & ITEM_FLAG_DIRECTORY)) {
+            stale = TRUE;
+            break;
+        }
+
+        // Only the native parser: a shortcut it cannot read gets no target
+        // and the icon loader resolves it as usual
+        targets[i][0] = L'\0';
+        ShellLinkInfo linkInfo;
+        if (!(items->flags[i] & ITEM_FLAG_DIRECTORY) && IsShortcut(name) &&
+            ReadShellLinkFile(path, &linkInfo) && linkInfo.szTarget[0]) {
+            wcscpy_s(targets[i], MAX_PATH, linkInfo.szTarget);
+        }
+
+        // A shortcut edited since the manifest was written
+        const WCHAR* known = items->targetOffset[i] == ITEM_NO_TARGET ? NULL : items->arena + items->targetOffset[i];
+        if (known && _wcsicmp(known, targets[i]) != 0) stale = TRUE;
+
+        entries[i].name = name;
+        entries[i].target = targets[i][0] ? targets[i] : NULL;
+        entries[i].attributes = attributes[match[i]];
+    }
+
+    if (check->cancelled) {
+        // Superseded or the popup closed; nothing to report
+    } else if (stale) {
+        PostMessageW(check->hwndNotify, WM_APP_MANIFEST_STALE, 0, 0);
+    } else if (listedOk) {
+        SIZE_T size;
+        BYTE* data = ManifestBuild(check->folderPath, check->folderLastWrite, folderEntries, check->rules.hash,
+                                   items->sortMode, entries, items->count, &size);
+        WCHAR manifestPath[MAX_PATH];
+        if (data && GetManifestPath(check->folderPath, manifestPath) &&
+            !ManifestFileMatches(manifestPath, data, size)) {
+            ManifestWriteFile(manifestPath, data, size);
+        }
+        free(data);
+    }
+    TraceEnd("ManifestCheck", traceStart);
+
+    FreeItemStore(&listed);
+    free(attributes);
+    free(match);
+    free(targets);
+    free(entries);
+    free(slots);
+    ManifestCheckRelease(check);
+    return 0;
+}
+
+static void ManifestCheckCancel(void) {
+    if (!g_manifestCheck) return;
+    InterlockedExchange(&g_manifestCheck->cancelled, 1);
+    ManifestCheckRelease(g_manifestCheck);
+    g_manifestCheck = NULL;
+}
+
+// Checks what the popup now shows against the disk in the background and
+// saves it as the folder's manifest. Recursive listings have no manifest:
+// the folder's timestamp says nothing about its subfolders.
+static ManifestCheck* ManifestCheckSnapshot(HWND hwnd) {
+    ManifestCheck* check = calloc(1, sizeof(ManifestCheck));
+    if (!check) return NULL;
+    check->references = 2;
+    check->hwndNotify = hwnd;
+    wcscpy_s(check->folderPath, MAX_PATH, g_folderPath);
+    check->folderLastWrite = ((ULONGLONG)g_storeLastWrite.dwHighDateTime << 32) | g_storeLastWrite.dwLowDateTime;
+    if (g_ruleText && !(check->ruleText = _wcsdup(g_ruleText))) {
+        free(check);
+        return NULL;
+    }
+
+    check->items.sortMode = g_store.sortMode;
+    for (int i = 0; i < g_store.count; i++) {
+        if (ItemStoreAppend(&check->items, &g_store, i) < 0) {
+            FreeItemStore(&check->items);
+            free(check->ruleText);
+            free(check);
+            return NULL;
+        }
+    }
+    return check;
+}
+
+static void ManifestCheckStart(HWND hwnd) {
+    ManifestCheckCancel();
+    if (g_recursiveDepth || g_store.rootLength) return;
+
+    ManifestCheck* check = ManifestCheckSnapshot(hwnd);
+    if (!check) return;
+
+    HANDLE hThread = CreateThread(NULL, 0, ManifestCheckThread, check, 0, NULL);
+    if (!hThread) {
+        FreeItemStore(&check->items);
+        free(check);
+        return;
+    }
+    SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+    CloseHandle(hThread);
+    g_manifestCheck = check;
+}
+
+// Folder loading. The listing is made on a worker thread, so a folder on a
+// sleeping disk or an unreachable share cannot keep the popup from showing:
+// the popup waits until FOLDER_LOAD_WAIT_MS after it was asked for, then
+// opens with whatever has been listed, "Loading..." in the status bar, and
+// takes in the rest in batches as the worker reports them. Everything else
+// that touches the folder (icons, the manifest check, the watcher) starts
+// once the listing is complete. A load that is superseded or outlives its
+// popup is cancelled; the worker stops at its next entry and owns its state,
+// so a call that never returns costs only the thread.
+#define WM_APP_FOLDER_LOADED (WM_APP + 6)
+#define FOLDER_LOAD_WAIT_MS 250
+#define FOLDER_LOAD_BATCH_MS 50         // Least time between batches
+
+typedef struct FolderLoad {
+    volatile LONG references;
+    volatile LONG cancelled;
+    SRWLOCK lock;
+    CONDITION_VARIABLE progress;    // probed or done was set
+    HWND hwndNotify;                // Cleared on cancel
+    WCHAR folderPath[MAX_PATH];
+    WCHAR* ruleText;                // Copy of g_ruleText
+    int recursiveDepth;
+    BOOL useManifest;
+    BOOL replace;                   // Keep showing the old items until done
+    int folderIcon;                 // Placeholders when the load started; a
+    int fileIcon;                   // superseded worker may outlive them
+
+    // Written by the worker under the lock. lastWrite and rules are fixed
+    // once probed is set; rules belong to the worker until done.
+    BOOL probed;
+    BOOL done;
+    BOOL haveLastWrite;
+    FILETIME lastWrite;
+    ListingRules rules;
+    int manifestSortMode;           // Order of a listing read from the manifest, or -1
+    ItemStore store;
+    int taken;                      // Items already moved to g_store
+    BOOL notified;                  // WM_APP_FOLDER_LOADED posted and not yet handled
+    ULONGLONG lastNotify;
+} FolderLoad;
+
+static FolderLoad* g_folderLoad = NULL;
+
+static void FolderLoadRelease(FolderLoad* load) {
+    if (InterlockedDecrement(&load->references) == 0) {
+        FreeItemStore(&load->store);
+        RulesFree(&load->rules);
+        free(load->ruleText);
+        free(load);
+    }
+}
+
+// Caller holds the lock. Tells the popup there is something to take, at
+// most once per FOLDER_LOAD_BATCH_MS until the load is done.
+static void FolderLoadNotify(FolderLoad* load) {
+    if (!load->hwndNotify || load->notified) return;
+    ULONGLONG now = GetTickCount64();
+    if (!load->done && (load->store.count == load->taken || now - load->lastNotify < FOLDER_LOAD_BATCH_MS)) return;
+    load->notified = TRUE;
+    load->lastNotify = now;
+    PostMessageW(load->hwndNotify, WM_APP_FOLDER_LOADED, 0, 0);
+}
+
+// Lists a single folder straight into load->store, a batch at a time
+static void FolderLoadList(FolderLoad* load) {
+    DirReader reader;
+    if (!DirReaderOpen(&reader, load->folderPath)) return;
+
+    SIZE_T folderLength = wcslen(load->folderPath);
+    DirEntry entry;
+    while (!load->cancelled && DirReaderNext(&reader, &entry)) {
+        // Skip hidden files
+        if (entry.attributes & FILE_ATTRIBUTE_HIDDEN) {
+            continue;
+        }
+
+        // Real icons are filled in by the icon loader
+        BOOL isDirectory = (entry.attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        if (!RulesAccept(&load->rules, entry.name, isDirectory)) continue;
+        AcquireSRWLockExclusive(&load->lock);
+        int index = ItemStoreAddName(&load->store, load->folderPath, folderLength, entry.name, entry.nameLength,
+                                     isDirectory ? ITEM_FLAG_DIRECTORY : 0,
+                                     isDirectory ? load->folderIcon : load->fileIcon);
+        FolderLoadNotify(load);
+        ReleaseSRWLockExclusive(&load->lock);
+        if (index < 0) break;
+    }
+    DirReaderClose(&reader);
+}
+
+static void FolderLoadRun(FolderLoad* load) {
+    LONGLONG traceStart = TraceBegin();
+    FILETIME lastWrite = {0};
+    ListingRules rules = {0};
+    BOOL haveLastWrite = GetFolderLastWrite(load->folderPath, &lastWrite);
+    RulesBuild(&rules, load->ruleText, load->folderPath);
+
+    AcquireSRWLockExclusive(&load->lock);
+    load->haveLastWrite = haveLastWrite;
+    load->lastWrite = lastWrite;
+    load->rules = rules;
+    load->probed = TRUE;
+    ReleaseSRWLockExclusive(&load->lock);
+    WakeAllConditionVariable(&load->progress);
+
+    // A manifest or a tree walk arrives whole
+    ItemStore listed = {0};
+    listed.sortMode = load->store.sortMode;
+    listed.rootLength = load->store.rootLength;
+    int manifestSortMode = -1;
+    if (load->useManifest && haveLastWrite && !load->recursiveDepth &&
+        ManifestLoadStore(&listed, load->folderPath,
+                          ((ULONGLONG)lastWrite.dwHighDateTime << 32) | lastWrite.dwLowDateTime,
+                          load->rules.hash, &manifestSortMode)) {
+        TraceEnd("ReadManifest", traceStart);
+    } else if (load->recursiveDepth) {
+        WalkFolderTree(&listed, load->folderPath, load->recursiveDepth, WalkThreadCount(), &load->rules,
+                       &load->cancelled);
+        TraceEnd("EnumerateFolder", traceStart);
+    } else {
+        FolderLoadList(load);
+        TraceEnd("EnumerateFolder", traceStart);
+    }
+
+    AcquireSRWLockExclusive(&load->lock);
+    if (listed.count) {
+        ItemStore empty = load->store;
+        load->store = listed;
+        listed = empty;
+    }
+    load->manifestSortMode = manifestSortMode;
+    load->done = TRUE;
+    FolderLoadNotify(load);
+    ReleaseSRWLockExclusive(&load->lock);
+    WakeAllConditionVariable(&load->progress);
+    FreeItemStore(&listed);
+}
+
+static DWORD WINAPI FolderLoadThread(LPVOID param) {
+    FolderLoad* load = (FolderLoad*)param;
+    FolderLoadRun(load);
+    FolderLoadRelease(load);
+    return 0;
+}
+
+static FolderLoad* FolderLoadCreate(HWND hwnd, BOOL useManifest, BOOL replace) {
+    FolderLoad* load = calloc(1, sizeof(FolderLoad));
+    if (!load) return NULL;
+    if (g_ruleText && !(load->ruleText = _wcsdup(g_ruleText))) {
+        free(load);
+        return NULL;
+    }
+    load->references = 1;
+    InitializeSRWLock(&load->lock);
+    InitializeConditionVariable(&load->progress);
+    load->hwndNotify = hwnd;
+    wcscpy_s(load->folderPath, MAX_PATH, g_folderPath);
+    load->recursiveDepth = g_recursiveDepth;
+    load->useManifest = useManifest;
+    load->replace = replace;
+    load->folderIcon = g_placeholderFolderIcon;
+    load->fileIcon = g_placeholderFileIcon;
+    load->manifestSortMode = -1;
+    load->store.sortMode = g_sortMode;
+    load->store.rootLength = g_recursiveDepth ? wcslen(g_folderPath) : 0;
+    return load;
+}
+
+static void FolderLoadCancel(void) {
+    FolderLoad* load = g_folderLoad;
+    if (!load) return;
+    AcquireSRWLockExclusive(&load->lock);
+    load->hwndNotify = NULL;
+    ReleaseSRWLockExclusive(&load->lock);
+    InterlockedExchange(&load->cancelled, 1);
+    FolderLoadRelease(load);
+    g_folderLoad = NULL;
+}
+
+// Empties g_store and gives it a fresh image list with the placeholders.
+static void ResetFolderView(void) {
+    ItemStoreReset(&g_store);
+    g_store.rootLength = g_recursiveDepth ? wcslen(g_folderPath) : 0;
+
+    if (g_imageList) {
+        ImageList_Destroy(g_imageList);
+    }
+    IconSlotFree(&g_iconSlots);
+    g_imageList = ImageList_Create(g_iconSize, g_iconSize, ILC_COLOR32 | ILC_MASK, 50, 50);
+    AddPlaceholderIcons();
+}
+
+// Starts listing g_folderPath. Unless replace is set, g_store is emptied
+// now and filled as the listing arrives. With useManifest, an up-to-date
+// folder manifest stands in for enumerating and sorting.
+static void FolderLoadStart(HWND hwnd, BOOL useManifest, BOOL replace) {
+    FolderLoadCancel();
+    if (!replace) ResetFolderView();
+
+    FolderLoad* load = FolderLoadCreate(hwnd, useManifest, replace);
+    if (!load) return;
+    load->references = 2;
+    HANDLE hThread = CreateThread(NULL, 0, FolderLoadThread, load, 0, NULL);
+    if (hThread) {
+        CloseHandle(hThread);
+    } else {
+        load->references = 1;
+        FolderLoadRun(load);
+    }
+    g_folderLoad = load;
+}
+
+// Waits until the load is probed (its last-write time and rules are known)
+// or, with untilDone, complete, or until deadline (a GetTickCount64 time).
+// Returns whether it got there.
+static BOOL FolderLoadWait(FolderLoad* load, BOOL untilDone, ULONGLONG deadline) {
+    AcquireSRWLockExclusive(&load->lock);
+    for (;;) {
+        if (untilDone ? load->done : load->probed) break;
+        ULONGLONG now = GetTickCount64();
+        if (now >= deadline) break;
+        SleepConditionVariableSRW(&load->progress, &load->lock, (DWORD)(deadline - now), 0);
+    }
+    BOOL reached = untilDone ? load->done : load->probed;
+    ReleaseSRWLockExclusive(&load->lock);
+    return reached;
+}
+
+// Moves what the worker has listed so far into g_store and sorts it.
+// Returns TRUE once the listing is complete; g_folderLoad is gone by then,
+// and its last-write time and rules have become the popup's.
+static BOOL FolderLoadTake(void) {
+    FolderLoad* load = g_folderLoad;
+    if (!load) return TRUE;
+
+    AcquireSRWLockExclusive(&load->lock);
+    load->notified = FALSE;
+    BOOL done = load->done;
+    if (load->replace && !done) {
+        ReleaseSRWLockExclusive(&load->lock);
+        return FALSE;
+    }
+    if (load->replace) ResetFolderView();
+    int first = g_store.count;
+    if (done && load->taken == 0 && first == 0) {
+        ItemStore swap = g_store;
+        g_store = load->store;
+        load->store = swap;
+    } else {
+        for (int i = load->taken; i < load->store.count; i++) {
+            if (ItemStoreAppend(&g_store, &load->store, i) < 0) break;
+        }
+    }
+    load->taken = load->store.count;
+    ReleaseSRWLockExclusive(&load->lock);
+
+    // Frecency ranks move with every launch, so that order is never reused
+    int manifestSortMode = done ? load->manifestSortMode : -1;
+    if (g_store.count > first &&
+        (manifestSortMode < 0 || manifestSortMode != g_sortMode || g_sortMode == SORT_FRECENCY)) {
+        LONGLONG sortStart = TraceBegin();
+        SortItems();
+        TraceEnd("SortItems", sortStart);
+    }
+
+    if (done) {
+        if (load->haveLastWrite) g_storeLastWrite = load->lastWrite;
+        RulesFree(&g_listingRules);
+        g_listingRules = load->rules;
+        ZeroMemory(&load->rules, sizeof(load->rules));
+        FolderLoadRelease(load);
+        g_folderLoad = NULL;
+    }
+    return done;
+}
+
+// Fills g_store for g_folderPath on the calling thread (--bench).
+static void LoadFolderContents(BOOL useManifest) {
+    LONGLONG traceStart = TraceBegin();
+    ResetFolderView();
+    FolderLoadCancel();
+    g_folderLoad = FolderLoadCreate(NULL, useManifest, FALSE);
+    if (g_folderLoad) {
+        FolderLoadRun(g_folderLoad);
+        FolderLoadTake();
+    }
+    TraceEnd("LoadFolderContents", traceStart);
+}
+
+static void PositionWindow(HWND hwnd) {
+    POINT cursorPos;
+    GetCursorPos(&cursorPos);
+
+    HMONITOR hMonitor = MonitorFromPoint(cursorPos, MONITOR_DEFAULTTONEAREST);
+    MONITORINFO mi = { sizeof(mi) };
+    GetMonitorInfo(hMonitor, &mi);
+
+    RECT work = mi.rcWork;
+    RECT bounds = mi.rcMonitor;
 
     int left = cursorPos.x;
     int top = cursorPos.y;
+    int width = ScaleForDpi(WINDOW_WIDTH);
+    int height = ScaleForDpi(WINDOW_HEIGHT);
+
+    // Determine taskbar position
+    if (work.top > bounds.top) {
+        top = work.top;
+    } else if (work.bottom < bounds.bottom) {
+        top = work.bottom - height;
+    } else if (work.left > bounds.left) {
+        left = work.left;
+    } else if (work.right < bounds.right) {
+        left = work.right - width;
+    } else {
+        top = work.bottom - height;
+    }
+
+    // Clamp to screen
+    if (left + width > work.right) left = work.right - width;
+    if (left < work.left) left = work.left;
+    if (top + height > work.bottom) top = work.bottom - height;
+    if (top < work.top) top = work.top;
+
+    SetWindowPos(hwnd, NULL, left, top, width, height, SWP_NOZORDER);
+}
+
+// Launch prefetch (--prefetch). While the popup is open, a background thread
+// reads the programs behind the folder's most-launched items into the file
+// cache, along with the DLLs installed next to them, so that a click on a slow
+// disk does not wait for them to page in. Candidates are ranked by the
+// frecency log that every launch already feeds, and shortcuts are followed to
+// their targets. Reads use low I/O priority and one fixed buffer, stop at a
+// byte budget, and end as soon as any launch is queued. Network targets are
+// left alone.
+#define PREFETCH_MAX_TARGETS 3                     // Programs read per popup
+#define PREFETCH_MIN_SCORE 0.5                      // About one launch in the last two weeks
+#define PREFETCH_MAX_BYTES (128 * 1024 * 1024)      // Per popup
+#define PREFETCH_MAX_FILE_BYTES (48 * 1024 * 1024)
+#define PREFETCH_MAX_LIBRARIES 24                   // DLLs read per program folder
+#define PREFETCH_CHUNK_BYTES (256 * 1024)
+
+typedef struct Prefetch {
+    volatile LONG references;
+    volatile LONG cancelled;
+    WCHAR folderPath[MAX_PATH];
+    ItemStore items;            // Snapshot of the files in g_store
+    LONGLONG budget;            // Bytes left to read
+    BYTE* buffer;
+} Prefetch;
+
+static Prefetch* g_prefetch = NULL;
+
+static void PrefetchRelease(Prefetch* prefetch) {
+    if (InterlockedDecrement(&prefetch->references) == 0) {
+        FreeItemStore(&prefetch->items);
+        free(prefetch->buffer);
+        free(prefetch);
+    }
+}
+
+static BOOL PrefetchIsLocal(const WCHAR* path) {
+    if (path[0] == L'\\' || !path[0] || path[1] != L':') return FALSE;
+    WCHAR root[4] = { path[0], L':', L'\\', 0 };
+    UINT type = GetDriveTypeW(root);
+    return type == DRIVE_FIXED || type == DRIVE_REMOVABLE || type == DRIVE_RAMDISK;
+}
+
+// Reads the start of one file into the cache. Returns FALSE if it cannot be opened.
+static BOOL PrefetchFile(Prefetch* prefetch, const WCHAR* path) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                               NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    FILE_IO_PRIORITY_HINT_INFO hint = { IoPriorityHintLow };
+    SetFileInformationByHandle(hFile, FileIoPriorityHintInfo, &hint, sizeof(hint));
+
+    LONGLONG fileBudget = PREFETCH_MAX_FILE_BYTES;
+    while (prefetch->budget > 0 && fileBudget > 0 && !prefetch->cancelled) {
+        DWORD chunk = (DWORD)min(min(prefetch->budget, fileBudget), PREFETCH_CHUNK_BYTES);
+        DWORD read = 0;
+        if (!ReadFile(hFile, prefetch->buffer, chunk, &read, NULL) || read == 0) break;
+        prefetch->budget -= read;
+        fileBudget -= read;
+    }
+    CloseHandle(hFile);
+    return TRUE;
+}
+
+// Reads a program and the DLLs in its folder. Returns FALSE if the program
+// is missing.
+static BOOL PrefetchProgram(Prefetch* prefetch, const WCHAR* programPath) {
+    if (!PrefetchFile(prefetch, programPath)) return FALSE;
+
+    const WCHAR* slash = wcsrchr(programPath, L'\\');
+    if (!slash || prefetch->budget <= 0 || prefetch->cancelled) return TRUE;
+    WCHAR searchPath[MAX_PATH], libraryPath[MAX_PATH];
+    int folderLength = (int)(slash - programPath);
+    if (folderLength + 6 >= MAX_PATH) return TRUE;
+    swprintf_s(searchPath, MAX_PATH, L"%.*s\\*.dll", folderLength, programPath);
+
+    WIN32_FIND_DATAW findData;
+    HANDLE hFind = FindFirstFileExW(searchPath, FindExInfoBasic, &findData, FindExSearchNameMatch, NULL,
+                                    FIND_FIRST_EX_LARGE_FETCH);
+    if (hFind == INVALID_HANDLE_VALUE) return TRUE;
+    int libraries = 0;
+    do {
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+        // DLL names run to 255 characters, so some do not fit beside the folder
+        if (folderLength + 1 + wcslen(findData.cFileName) >= MAX_PATH) continue;
+        swprintf_s(libraryPath, MAX_PATH, L"%.*s\\%s", folderLength, programPath, findData.cFileName);
+        PrefetchFile(prefetch, libraryPath);
+        libraries++;
+    } while (libraries < PREFETCH_MAX_LIBRARIES && prefetch->budget > 0 && !prefetch->cancelled &&
+             FindNextFileW(hFind, &findData));
+    FindClose(hFind);
+    return TRUE;
+}
 
-    // Determine taskbar position
-    if (work.top > bounds.top) {
-        top = work.top;
-    } else if (work.bottom < bounds.bottom) {
-        top = work.bottom - WINDOW_HEIGHT;
-    } else if (work.left > bounds.left) {
-        left = work.left;
-    } else if (work.right < bounds.right) {
-        left = work.right - WINDOW_WIDTH;
+// Finds the program an item starts: its known or parsed shortcut target, or
+// the item itself. Returns FALSE for anything but a local .exe.
+static BOOL PrefetchGetProgram(const ItemStore* items, int index, WCHAR* programPath) {
+    const WCHAR* path = items->arena + items->pathOffset[index];
+    const WCHAR* extension = wcsrchr(path + items->nameStart[index], L'.');
+
+    // Item paths and targets can exceed MAX_PATH; those are not prefetched
+    if (items->targetOffset[index] != ITEM_NO_TARGET) {
+        const WCHAR* target = items->arena + items->targetOffset[index];
+        if (wcslen(target) >= MAX_PATH) return FALSE;
+        wcscpy_s(programPath, MAX_PATH, target);
+    } else if (extension && _wcsicmp(extension, L".lnk") == 0) {
+        ShellLinkInfo linkInfo;
+        if (!ReadShellLinkFile(path, &linkInfo) || !linkInfo.szTarget[0]) return FALSE;
+        if (linkInfo.bTargetHasEnvVars) {
+            DWORD length = ExpandEnvironmentStringsW(linkInfo.szTarget, programPath, MAX_PATH);
+            if (!length || length > MAX_PATH) return FALSE;
+        } else {
+            wcscpy_s(programPath, MAX_PATH, linkInfo.szTarget);
+        }
+    } else if (wcslen(path) >= MAX_PATH) {
+        return FALSE;
     } else {
-        top = work.bottom - WINDOW_HEIGHT;
+        wcscpy_s(programPath, MAX_PATH, path);
     }
 
-    // Clamp to screen
-    if (left + WINDOW_WIDTH > work.right) left = work.right - WINDOW_WIDTH;
-    if (left < work.left) left = work.left;
-    if (top + WINDOW_HEIGHT > work.bottom) top = work.bottom - WINDOW_HEIGHT;
-    if (top < work.top) top = work.top;
+    extension = wcsrchr(programPath, L'.');
+    return extension && _wcsicmp(extension, L".exe") == 0 && PrefetchIsLocal(programPath);
+}
+
+typedef struct PrefetchCandidate {
+    double score;
+    int item;
+} PrefetchCandidate;
+
+static int ComparePrefetchCandidates(const void* a, const void* b) {
+    const PrefetchCandidate* candidateA = a;
+    const PrefetchCandidate* candidateB = b;
+    if (candidateA->score != candidateB->score) return candidateA->score > candidateB->score ? -1 : 1;
+    return candidateA->item - candidateB->item;
+}
+
+static DWORD WINAPI PrefetchThread(LPVOID param) {
+    Prefetch* prefetch = (Prefetch*)param;
+    LONGLONG traceStart = TraceBegin();
+
+    // Items launched often enough to be worth reading, best first
+    const ItemStore* items = &prefetch->items;
+    PrefetchCandidate* candidates = malloc(items->count * sizeof(PrefetchCandidate));
+    int candidateCount = 0;
+    FrecencyTable table = {0};
+    FrecencyLoad(&table, prefetch->folderPath);
+    for (int i = 0; i < items->count && candidates && table.count; i++) {
+        const WCHAR* path = items->arena + items->pathOffset[i];
+        const WCHAR* relativePath = items->rootLength ? path + items->rootLength + 1 : path + items->nameStart[i];
+        double score = FrecencyLookup(&table, HashPath(relativePath));
+        if (score >= PREFETCH_MIN_SCORE) {
+            candidates[candidateCount].score = score;
+            candidates[candidateCount].item = i;
+            candidateCount++;
+        }
+    }
+    FrecencyFreeTable(&table);
+    if (candidateCount) qsort(candidates, candidateCount, sizeof(PrefetchCandidate), ComparePrefetchCandidates);
+
+    WCHAR programs[PREFETCH_MAX_TARGETS][MAX_PATH];
+    int programCount = 0;
+    for (int i = 0; i < candidateCount && programCount < PREFETCH_MAX_TARGETS &&
+                    prefetch->budget > 0 && !prefetch->cancelled; i++) {
+        WCHAR* programPath = programs[programCount];
+        if (!PrefetchGetProgram(items, candidates[i].item, programPath)) continue;
+
+        // Several shortcuts may start the same program
+        BOOL seen = FALSE;
+        for (int j = 0; j < programCount && !seen; j++) seen = _wcsicmp(programs[j], programPath) == 0;
+        if (!seen && PrefetchProgram(prefetch, programPath)) programCount++;
+    }
+    free(candidates);
+
+    TraceEndArgs("Prefetch", traceStart, "programs", programCount, "kb", (PREFETCH_MAX_BYTES - prefetch->budget) / 1024);
+
+    PrefetchRelease(prefetch);
+    return 0;
+}
+
+// Stops the running prefetch, if any. Called when a launch is queued, so the
+// read-ahead never competes with the program actually starting.
+static void PrefetchCancel(void) {
+    if (!g_prefetch) return;
+    InterlockedExchange(&g_prefetch->cancelled, 1);
+    PrefetchRelease(g_prefetch);
+    g_prefetch = NULL;
+}
+
+static void PrefetchStart(void) {
+    PrefetchCancel();
+    if (!g_prefetchEnabled) return;
+
+    Prefetch* prefetch = calloc(1, sizeof(Prefetch));
+    if (!prefetch) return;
+    prefetch->references = 2;
+    prefetch->budget = PREFETCH_MAX_BYTES;
+    wcscpy_s(prefetch->folderPath, MAX_PATH, g_folderPath);
+    prefetch->buffer = malloc(PREFETCH_CHUNK_BYTES);
+
+    prefetch->items.rootLength = g_store.rootLength;
+    prefetch->items.sortMode = g_store.sortMode;
+    BOOL copied = prefetch->buffer != NULL;
+    for (int i = 0; i < g_store.count && copied; i++) {
+        if (!ItemIsDirectory(i)) copied = ItemStoreAppend(&prefetch->items, &g_store, i) >= 0;
+    }
+
+    HANDLE hThread = copied && prefetch->items.count ? CreateThread(NULL, 0, PrefetchThread, prefetch, 0, NULL) : NULL;
+    if (!hThread) {
+        prefetch->references = 1;
+        PrefetchRelease(prefetch);
+        return;
+    }
+    SetThreadPriority(hThread, THREAD_PRIORITY_BELOW_NORMAL);
+    CloseHandle(hThread);
+    g_prefetch = prefetch;
+}
+
+// Launch queue. Clicks hand their target to a worker thread, so a target on
+// a sleeping network share or with a slow handler cannot freeze the popup,
+// its click animation or its fade. Launches run one at a time in click
+// order. A second click on an item that is still queued or starting, or that
+// was clicked within LAUNCH_MERGE_MS, joins the first launch instead of
+// starting the target twice. A launch that has not returned LAUNCH_TIMEOUT_MS
+// after its click is reported as timed out and its worker is abandoned to
+// the shell call; a fresh worker takes the rest of the queue. While launches
+// are in flight, a timer on the notify window checks that deadline, so a
+// hung launch is reported even when nothing else is clicked. Outcomes go
+// back to the UI thread through WM_APP_LAUNCH_DONE.
+#define LAUNCH_TIMEOUT_MS 15000
+#define LAUNCH_MERGE_MS 500
+#define LAUNCH_WATCHDOG_MS 1000
+#define WM_APP_LAUNCH_DONE (WM_APP + 5)
+
+typedef enum LaunchStatus {
+    LAUNCH_QUEUED,
+    LAUNCH_RUNNING,
+    LAUNCH_SUCCEEDED,
+    LAUNCH_FAILED,
+    LAUNCH_TIMED_OUT
+} LaunchStatus;
+
+typedef struct LaunchRequest {
+    struct LaunchRequest* next;
+    LONG references;        // The worker running it, and the done list
+    LaunchStatus status;
+    DWORD error;
+    int mergedClicks;       // Later clicks folded into this launch
+    LONGLONG queuedTime;    // QueryPerformanceCounter ticks
+    LONGLONG startTime;
+    LONGLONG doneTime;
+    WCHAR* path;
+    WCHAR* folderPath;      // For the frecency log; NULL to skip it
+    WCHAR* relativePath;
+} LaunchRequest;
+
+typedef struct LaunchQueue {
+    SRWLOCK lock;
+    CONDITION_VARIABLE wake;        // Work queued, or stopping
+    CONDITION_VARIABLE idle;        // A launch finished
+    LaunchRequest* head;            // Queued, oldest first
+    LaunchRequest* tail;
+    LaunchRequest* running;
+    LaunchRequest* doneHead;        // Finished, waiting for LaunchQueueReport
+    LaunchRequest* doneTail;
+    LONG generation;                // Workers of older generations were abandoned
+    BOOL hasWorker;
+    BOOL stopping;
+    HWND hwndNotify;
+    ULONGLONG lastHash;             // Most recent accepted launch, for merging
+    LONGLONG lastTime;
+    LONGLONG frequency;
+} LaunchQueue;
+
+static LaunchQueue g_launchQueue = { SRWLOCK_INIT, CONDITION_VARIABLE_INIT, CONDITION_VARIABLE_INIT };
+
+static LONGLONG LaunchNow(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static double LaunchMilliseconds(LONGLONG ticks) {
+    return (double)ticks * 1000.0 / (double)g_launchQueue.frequency;
+}
+
+static void LaunchRequestRelease(LaunchRequest* request) {
+    if (InterlockedDecrement(&request->references) == 0) {
+        free(request->path);
+        free(request->folderPath);
+        free(request->relativePath);
+        free(request);
+    }
+}
+
+// Runs one launch. Returns 0 or a Win32 error code.
+static DWORD ShellLaunch(const LaunchRequest* request) {
+    SHELLEXECUTEINFOW sei = { sizeof(sei) };
+    sei.fMask = SEE_MASK_FLAG_NO_UI | SEE_MASK_NOASYNC;
+    sei.lpVerb = L"open";
+    sei.lpFile = request->path;
+    sei.nShow = SW_SHOWNORMAL;
+    if (ShellExecuteExW(&sei)) return 0;
+
+    // Without an association, offer the shell's Open With dialog as before
+    DWORD error = GetLastError();
+    if (error != ERROR_NO_ASSOCIATION) return error;
+    sei.fMask = SEE_MASK_NOASYNC;
+    sei.lpVerb = L"openas";
+    return ShellExecuteExW(&sei) ? 0 : GetLastError();
+}
+
+// Called with the lock held
+static void LaunchQueueFinish(LaunchQueue* queue, LaunchRequest* request) {
+    request->doneTime = LaunchNow();
+    request->next = NULL;
+    if (queue->doneTail) {
+        queue->doneTail->next = request;
+    } else {
+        queue->doneHead = request;
+        if (queue->hwndNotify) PostMessageW(queue->hwndNotify, WM_APP_LAUNCH_DONE, 0, 0);
+    }
+    queue->doneTail = request;
+    WakeAllConditionVariable(&queue->idle);
+}
+
+static DWORD WINAPI LaunchWorkerThread(LPVOID param);
+
+// Called with the lock held
+static void LaunchQueueStartWorker(LaunchQueue* queue) {
+    HANDLE thread = CreateThread(NULL, 0, LaunchWorkerThread, (LPVOID)(LONG_PTR)queue->generation, 0, NULL);
+    if (thread) {
+        CloseHandle(thread);
+        queue->hasWorker = TRUE;
+    }
+}
+
+// Called with the lock held. Gives up on a launch that has been running past
+// its deadline and hands the queue to a new worker.
+static void LaunchQueueCheckDeadline(LaunchQueue* queue) {
+    LaunchRequest* request = queue->running;
+    if (!request || LaunchMilliseconds(LaunchNow() - request->queuedTime) < LAUNCH_TIMEOUT_MS) return;
+
+    request->status = LAUNCH_TIMED_OUT;
+    request->error = ERROR_TIMEOUT;
+    InterlockedIncrement(&request->references);
+    queue->running = NULL;
+    LaunchQueueFinish(queue, request);
+
+    queue->generation++;
+    queue->hasWorker = FALSE;
+    if (queue->head) LaunchQueueStartWorker(queue);
+}
+
+static DWORD WINAPI LaunchWorkerThread(LPVOID param) {
+    LaunchQueue* queue = &g_launchQueue;
+    LONG generation = (LONG)(LONG_PTR)param;
+    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE);
+
+    AcquireSRWLockExclusive(&queue->lock);
+    for (;;) {
+        while (queue->generation == generation && !queue->head && !queue->stopping) {
+            SleepConditionVariableSRW(&queue->wake, &queue->lock, INFINITE, 0);
+        }
+        if (queue->generation != generation || !queue->head) break;
+
+        LaunchRequest* request = queue->head;
+        queue->head = request->next;
+        if (!queue->head) queue->tail = NULL;
+
+        // A launch that waited out its deadline behind a slow one is dropped
+        // rather than started long after the click
+        if (LaunchMilliseconds(LaunchNow() - request->queuedTime) >= LAUNCH_TIMEOUT_MS) {
+            request->status = LAUNCH_TIMED_OUT;
+            request->error = ERROR_TIMEOUT;
+            LaunchQueueFinish(queue, request);
+            continue;
+        }
+
+        request->status = LAUNCH_RUNNING;
+        request->startTime = LaunchNow();
+        queue->running = request;
+        ReleaseSRWLockExclusive(&queue->lock);
+
+        LONGLONG traceStart = TraceBegin();
+        DWORD error = ShellLaunch(request);
+        TraceEnd("ShellLaunch", traceStart);
+        if (!error && request->folderPath) {
+            FrecencyRecordLaunch(request->folderPath, request->relativePath);
+        }
+
+        AcquireSRWLockExclusive(&queue->lock);
+        if (request->status == LAUNCH_RUNNING) {
+            request->status = error ? LAUNCH_FAILED : LAUNCH_SUCCEEDED;
+            request->error = error;
+            queue->running = NULL;
+            LaunchQueueFinish(queue, request);
+        } else {
+            // Already reported as timed out; this worker was replaced
+            LaunchRequestRelease(request);
+        }
+    }
+    if (queue->generation == generation) queue->hasWorker = FALSE;
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    CoUninitialize();
+    return 0;
+}
+
+// Queues a launch of path. folderPath and relativePath name the entry in the
+// frecency log, or are NULL. Returns FALSE when the click was merged into a
+// launch already in flight or the request could not be queued.
+static BOOL LaunchQueuePush(const WCHAR* path, const WCHAR* folderPath, const WCHAR* relativePath) {
+    LaunchQueue* queue = &g_launchQueue;
+    LONGLONG now = LaunchNow();
+    ULONGLONG hash = HashPath(path);
+
+    AcquireSRWLockExclusive(&queue->lock);
+    if (!queue->frequency) {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        queue->frequency = frequency.QuadPart;
+    }
+    LaunchQueueCheckDeadline(queue);
+
+    LaunchRequest* merged = NULL;
+    if (queue->running && _wcsicmp(queue->running->path, path) == 0) merged = queue->running;
+    for (LaunchRequest* request = queue->head; request && !merged; request = request->next) {
+        if (_wcsicmp(request->path, path) == 0) merged = request;
+    }
+    if (merged || (hash == queue->lastHash && LaunchMilliseconds(now - queue->lastTime) < LAUNCH_MERGE_MS)) {
+        if (merged) merged->mergedClicks++;
+        ReleaseSRWLockExclusive(&queue->lock);
+        return FALSE;
+    }
+
+    LaunchRequest* request = calloc(1, sizeof(LaunchRequest));
+    if (request) {
+        request->references = 1;
+        request->path = _wcsdup(path);
+        request->folderPath = folderPath ? _wcsdup(folderPath) : NULL;
+        request->relativePath = relativePath ? _wcsdup(relativePath) : NULL;
+    }
+    if (!request || !request->path || (folderPath && (!request->folderPath || !request->relativePath))) {
+        ReleaseSRWLockExclusive(&queue->lock);
+        if (request) LaunchRequestRelease(request);
+        return FALSE;
+    }
+
+    request->status = LAUNCH_QUEUED;
+    request->queuedTime = now;
+    if (queue->tail) {
+        queue->tail->next = request;
+    } else {
+        queue->head = request;
+    }
+    queue->tail = request;
+    queue->lastHash = hash;
+    queue->lastTime = now;
+    queue->stopping = FALSE;
+
+    if (!queue->hasWorker) LaunchQueueStartWorker(queue);
+    WakeConditionVariable(&queue->wake);
+    HWND hwndNotify = queue->hwndNotify;
+    ReleaseSRWLockExclusive(&queue->lock);
 
-    SetWindowPos(hwnd, NULL, left, top, WINDOW_WIDTH, WINDOW_HEIGHT, SWP_NOZORDER);
+    if (hwndNotify) SetTimer(hwndNotify, ID_TIMER_LAUNCH_WATCHDOG, LAUNCH_WATCHDOG_MS, NULL);
+    return TRUE;
+}
+
+// Sets the window that receives WM_APP_LAUNCH_DONE and runs the deadline
+// timer, or NULL for none. Results that finish meanwhile are kept for the
+// next LaunchQueueReport.
+static void LaunchQueueSetNotify(HWND hwnd) {
+    LaunchQueue* queue = &g_launchQueue;
+    AcquireSRWLockExclusive(&queue->lock);
+    queue->hwndNotify = hwnd;
+    if (hwnd && queue->doneHead) PostMessageW(hwnd, WM_APP_LAUNCH_DONE, 0, 0);
+    BOOL pending = queue->head || queue->running;
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    if (hwnd && pending) SetTimer(hwnd, ID_TIMER_LAUNCH_WATCHDOG, LAUNCH_WATCHDOG_MS, NULL);
+}
+
+// UI side of ID_TIMER_LAUNCH_WATCHDOG: reports a launch that has run past
+// its deadline. Returns FALSE once nothing is queued or starting, and the
+// timer can stop.
+static BOOL LaunchQueueWatchdog(void) {
+    LaunchQueue* queue = &g_launchQueue;
+    AcquireSRWLockExclusive(&queue->lock);
+    LaunchQueueCheckDeadline(queue);
+    BOOL pending = queue->head || queue->running;
+    ReleaseSRWLockExclusive(&queue->lock);
+    return pending;
+}
+
+// UI side of WM_APP_LAUNCH_DONE: traces each finished launch with its
+// latency and tells the user about the ones that did not start.
+static void LaunchQueueReport(void) {
+    LaunchQueue* queue = &g_launchQueue;
+    AcquireSRWLockExclusive(&queue->lock);
+    LaunchRequest* request = queue->doneHead;
+    queue->doneHead = queue->doneTail = NULL;
+    ReleaseSRWLockExclusive(&queue->lock);
+
+    while (request) {
+        LaunchRequest* next = request->next;
+
+        // The worker's ShellLaunch span covers the shell call itself
+        TraceSpan("LaunchQueued", request->queuedTime, request->startTime ? request->startTime : request->doneTime,
+                  "merged", request->mergedClicks);
+        TraceSpan("Launch", request->queuedTime, request->doneTime, "error", request->error);
+
+        if (request->status != LAUNCH_SUCCEEDED) {
+            const WCHAR* name = wcsrchr(request->path, L'\\');
+            name = name ? name + 1 : request->path;
+            WCHAR text[256];
+            if (request->status == LAUNCH_TIMED_OUT) {
+                swprintf_s(text, 256, L"%.160s did not start within %d seconds.", name, LAUNCH_TIMEOUT_MS / 1000);
+            } else {
+                swprintf_s(text, 256, L"Could not open %.160s (error %lu).", name, request->error);
+            }
+            ShowNotification(L"FolderIcon", text, TRUE);
+        }
+
+        LaunchRequestRelease(request);
+        request = next;
+    }
+}
+
+// Waits for queued launches before the process exits, so a slow target is
+// still started after the popup has faded. Each launch waits at most until
+// its deadline.
+static void LaunchQueueStop(void) {
+    LaunchQueue* queue = &g_launchQueue;
+    AcquireSRWLockExclusive(&queue->lock);
+    queue->hwndNotify = NULL;
+    for (;;) {
+        LaunchQueueCheckDeadline(queue);
+        if (!queue->head && !queue->running) break;
+        if (!queue->hasWorker) LaunchQueueStartWorker(queue);
+        if (!queue->hasWorker) break;
+        SleepConditionVariableSRW(&queue->idle, &queue->lock, 100, 0);
+    }
+    queue->stopping = TRUE;
+    WakeAllConditionVariable(&queue->wake);
+    ReleaseSRWLockExclusive(&queue->lock);
 }
 
 static void OpenItem(int index) {
-    if (index >= 0 && index < g_itemCount) {
-        // Start the application
-        ShellExecuteW(NULL, L"open", g_items[index].szPath, NULL, NULL, SW_SHOWNORMAL);
+    if (index >= 0 && index < ViewCount()) {
+        // Start the application on the launch worker
+        PrefetchCancel();
+        LaunchQueuePush(ItemPath(ViewItem(index)), g_folderPath, ItemRelativePath(ViewItem(index)));
 
         // Start click animation
         g_clickedIndex = index;
@@ -599,13 +7120,16 @@ static void UpdateTooltip(HWND hwndLV, int index) {
 
     SendMessageW(g_hwndTooltip, TTM_DELTOOLW, 0, (LPARAM)&ti);
 
-    if (index >= 0 && index < g_itemCount) {
-        wcscpy_s(g_tooltipText, MAX_PATH, g_items[index].szName);
+    if (index >= 0 && index < ViewCount()) {
+        // Recursive listings show the path below the root folder
+        int item = ViewItem(index);
+        wcsncpy_s(g_tooltipText, MAX_PATH, ItemRelativePath(item), _TRUNCATE);
 
         // Remove extension for files (not folders)
-        if (!g_items[index].bIsDirectory) {
+        if (!ItemIsDirectory(item)) {
             WCHAR* dot = wcsrchr(g_tooltipText, L'.');
-            if (dot && dot != g_tooltipText) {
+            WCHAR* slash = wcsrchr(g_tooltipText, L'\\');
+            if (dot && dot != g_tooltipText && (!slash || dot > slash + 1)) {
                 *dot = L'\0';
             }
         }
@@ -616,6 +7140,26 @@ static void UpdateTooltip(HWND hwndLV, int index) {
     }
 }
 
+// Refreshes the cached view size and scroll offset from the list view.
+static void SyncGridWithListView(void) {
+    RECT rc;
+    POINT origin = {0};
+    GetClientRect(g_hwndListView, &rc);
+    ListView_GetOrigin(g_hwndListView, &origin);
+    GridResize(&g_grid, rc.right, rc.bottom);
+    g_grid.scrollY = origin.y;
+}
+
+// Takes the item offset inside a cell from the list view's own layout.
+static void MeasureGridItemBounds(void) {
+    if (ListView_GetItemCount(g_hwndListView) == 0) return;
+
+    RECT itemRect;
+    ListView_GetItemRect(g_hwndListView, 0, &itemRect, LVIR_BOUNDS);
+    GridSetItemBounds(&g_grid, itemRect.left, itemRect.top + g_grid.scrollY,
+                      itemRect.right - itemRect.left, itemRect.bottom - itemRect.top);
+}
+
 static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam, UINT_PTR uIdSubclass, DWORD_PTR dwRefData) {
     switch (msg) {
         case WM_MOUSEMOVE: {
@@ -623,10 +7167,7 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
             TRACKMOUSEEVENT tme = { sizeof(tme), TME_LEAVE, hwnd, 0 };
             TrackMouseEvent(&tme);
 
-            LVHITTESTINFO ht = {0};
-            ht.pt.x = LOWORD(lParam);
-            ht.pt.y = HIWORD(lParam);
-            int index = ListView_HitTest(hwnd, &ht);
+            int index = GridHitTest(&g_grid, GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
 
             if (index != g_hoverIndex) {
                 int oldIndex = g_hoverIndex;
@@ -636,12 +7177,12 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
                 // Invalidate old and new items to trigger repaint
                 if (oldIndex >= 0) {
                     RECT oldRect;
-                    ListView_GetItemRect(hwnd, oldIndex, &oldRect, LVIR_BOUNDS);
+                    GridItemRect(&g_grid, oldIndex, &oldRect);
                     InvalidateRect(hwnd, &oldRect, TRUE);
                 }
                 if (index >= 0) {
                     RECT newRect;
-                    ListView_GetItemRect(hwnd, index, &newRect, LVIR_BOUNDS);
+                    GridItemRect(&g_grid, index, &newRect);
                     InvalidateRect(hwnd, &newRect, TRUE);
                 }
             }
@@ -651,18 +7192,29 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
         case WM_MOUSELEAVE: {
             if (g_hoverIndex >= 0) {
                 RECT oldRect;
-                ListView_GetItemRect(hwnd, g_hoverIndex, &oldRect, LVIR_BOUNDS);
+                GridItemRect(&g_grid, g_hoverIndex, &oldRect);
                 g_hoverIndex = -1;
                 InvalidateRect(hwnd, &oldRect, TRUE);
             }
             break;
         }
 
+        case WM_KEYDOWN:
+            if (wParam == VK_ESCAPE || wParam == VK_RETURN) {
+                return SendMessageW(g_hwndMain, msg, wParam, lParam);
+            }
+            // Fall through
+        case WM_VSCROLL:
+        case WM_MOUSEWHEEL:
+        case WM_SIZE: {
+            // Let the list view scroll, then pick up the new offset
+            LRESULT result = DefSubclassProc(hwnd, msg, wParam, lParam);
+            SyncGridWithListView();
+            return result;
+        }
+
         case WM_LBUTTONDOWN: {
-            LVHITTESTINFO ht = {0};
-            ht.pt.x = LOWORD(lParam);
-            ht.pt.y = HIWORD(lParam);
-            int index = ListView_HitTest(hwnd, &ht);
+            int index = GridHitTest(&g_grid, GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam));
             if (index >= 0) {
                 OpenItem(index);
                 return 0;
@@ -674,15 +7226,17 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
             SetCursor(LoadCursor(NULL, IDC_ARROW));
             return TRUE;
 
+        case WM_CHAR:
+            // Typing filters; keep the list view's own incremental search out
+            return SendMessageW(g_hwndMain, msg, wParam, lParam);
+
         case WM_RBUTTONUP: {
-            LVHITTESTINFO ht = {0};
-            ht.pt.x = LOWORD(lParam);
-            ht.pt.y = HIWORD(lParam);
-            int index = ListView_HitTest(hwnd, &ht);
+            POINT pt = { GET_X_LPARAM(lParam), GET_Y_LPARAM(lParam) };
+            int index = GridHitTest(&g_grid, pt.x, pt.y);
 
             // Show context menu only if not clicking on an icon
             if (index < 0) {
-                POINT screenPt = ht.pt;
+                POINT screenPt = pt;
                 ClientToScreen(hwnd, &screenPt);
 
                 HMENU hMenu = CreatePopupMenu();
@@ -701,7 +7255,8 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
                 DestroyMenu(hMenu);
 
                 if (cmd == IDM_OPEN_FOLDER) {
-                    ShellExecuteW(NULL, L"open", g_folderPath, NULL, NULL, SW_SHOWNORMAL);
+                    PrefetchCancel();
+                    LaunchQueuePush(g_folderPath, NULL, NULL);
                 } else if (cmd == IDM_REGISTER_CONTEXT_MENU) {
                     if (RegisterContextMenu()) {
                         ShowNotification(L"FolderIcon", L"Context menu registered.\nUse 'Show more options' in Explorer.", FALSE);
@@ -725,119 +7280,807 @@ static LRESULT CALLBACK ListViewSubclassProc(HWND hwnd, UINT msg, WPARAM wParam,
             break;
     }
 
-    return DefSubclassProc(hwnd, msg, wParam, lParam);
+    return DefSubclassProc(hwnd, msg, wParam, lParam);
+}
+
+static void CreateListView(HWND hwndParent) {
+    RECT rc;
+    GetClientRect(hwndParent, &rc);
+
+    g_hwndListView = CreateWindowExW(
+        0, WC_LISTVIEWW, NULL,
+        WS_CHILD | WS_VISIBLE | LVS_ICON | LVS_SINGLESEL | LVS_AUTOARRANGE | LVS_OWNERDATA,
+        0, ScaleForDpi(HEADER_HEIGHT),
+        rc.right, rc.bottom - ScaleForDpi(HEADER_HEIGHT) - ScaleForDpi(STATUS_HEIGHT),
+        hwndParent, (HMENU)IDC_LISTVIEW, GetModuleHandle(NULL), NULL);
+
+    ListView_SetImageList(g_hwndListView, g_imageList, LVSIL_NORMAL);
+    ListView_SetIconSpacing(g_hwndListView, IconCellSize(), IconCellSize());
+    ListView_SetExtendedListViewStyle(g_hwndListView, LVS_EX_DOUBLEBUFFER);
+
+    // Set colors
+    ListView_SetBkColor(g_hwndListView, g_bgColor);
+    ListView_SetTextBkColor(g_hwndListView, g_bgColor);
+    ListView_SetTextColor(g_hwndListView, g_bgColor); // Hide text, show in tooltip only
+
+    // Virtual list: items are served from g_store through LVN_GETDISPINFO
+    ListView_SetItemCountEx(g_hwndListView, g_store.count, LVSICF_NOINVALIDATEALL);
+
+    GridInit(&g_grid, IconCellSize());
+    g_grid.itemCount = g_store.count;
+    SyncGridWithListView();
+    MeasureGridItemBounds();
+
+    SetWindowSubclass(g_hwndListView, ListViewSubclassProc, 0, 0);
+    CreateTooltip(hwndParent);
+}
+
+// Live refresh. A watcher thread keeps a ReadDirectoryChangesW request
+// outstanding on the folder and turns notifications into add / remove /
+// rename / modify deltas. Each completed read posts WM_APP_FOLDER_CHANGED;
+// the UI thread restarts a short timer on every post, so a burst of changes
+// (a sync tool dropping 50 files) is applied as one update once it settles.
+// Only the affected items are touched: untouched icons are never re-extracted.
+#define WM_APP_FOLDER_CHANGED (WM_APP + 2)
+#define REFRESH_COALESCE_MS 150
+#define WATCH_BUFFER_SIZE 32768
+
+#define DELTA_ADD 1
+#define DELTA_REMOVE 2
+#define DELTA_RENAME 3
+#define DELTA_MODIFY 4
+#define DELTA_RESCAN 5
+
+typedef struct FolderDelta {
+    int action;
+    WCHAR* name;
+    WCHAR* newName;
+} FolderDelta;
+
+typedef struct FolderWatcher {
+    SRWLOCK lock;
+    FolderDelta* deltas;
+    int deltaCount;
+    int deltaCapacity;
+
+    HWND hwndNotify;
+    HANDLE hDirectory;
+    HANDLE hStopEvent;
+    HANDLE hThread;
+    WCHAR* pendingOldName;  // RENAMED_OLD_NAME waiting for its NEW_NAME
+    BOOL subtree;           // Recursive listing: any change means a rescan
+} FolderWatcher;
+
+static FolderWatcher g_watcher;
+
+static WCHAR* CopyNotifyName(const FILE_NOTIFY_INFORMATION* info) {
+    int length = (int)(info->FileNameLength / sizeof(WCHAR));
+    WCHAR* name = malloc((length + 1) * sizeof(WCHAR));
+    if (name) {
+        wmemcpy(name, info->FileName, length);
+        name[length] = L'\0';
+    }
+    return name;
+}
+
+// Caller holds the watcher lock. Takes ownership of the name strings.
+static void PushFolderDelta(FolderWatcher* watcher, int action, WCHAR* name, WCHAR* newName) {
+    if (watcher->deltaCount == watcher->deltaCapacity) {
+        int newCapacity = watcher->deltaCapacity ? watcher->deltaCapacity * 2 : 64;
+        FolderDelta* deltas = realloc(watcher->deltas, newCapacity * sizeof(FolderDelta));
+        if (!deltas) {
+            free(name);
+            free(newName);
+            return;
+        }
+        watcher->deltas = deltas;
+        watcher->deltaCapacity = newCapacity;
+    }
+
+    FolderDelta* delta = &watcher->deltas[watcher->deltaCount++];
+    delta->action = action;
+    delta->name = name;
+    delta->newName = newName;
+}
+
+static void QueueNotifications(FolderWatcher* watcher, const BYTE* buffer, DWORD bytes) {
+    AcquireSRWLockExclusive(&watcher->lock);
+
+    if (bytes == 0) {
+        // The change buffer overflowed; only a full rescan is reliable now
+        PushFolderDelta(watcher, DELTA_RESCAN, NULL, NULL);
+    }
+
+    if (watcher->subtree && bytes > 0) {
+        PushFolderDelta(watcher, DELTA_RESCAN, NULL, NULL);
+        bytes = 0;
+    }
+
+    DWORD offset = 0;
+    while (bytes > 0) {
+        const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)(buffer + offset);
+        WCHAR* name = CopyNotifyName(info);
+
+        if (name) {
+            switch (info->Action) {
+                case FILE_ACTION_ADDED:
+                    PushFolderDelta(watcher, DELTA_ADD, name, NULL);
+                    break;
+                case FILE_ACTION_REMOVED:
+                    PushFolderDelta(watcher, DELTA_REMOVE, name, NULL);
+                    break;
+                case FILE_ACTION_MODIFIED:
+                    PushFolderDelta(watcher, DELTA_MODIFY, name, NULL);
+                    break;
+                case FILE_ACTION_RENAMED_OLD_NAME:
+                    free(watcher->pendingOldName);
+                    watcher->pendingOldName = name;
+                    break;
+                case FILE_ACTION_RENAMED_NEW_NAME:
+                    if (watcher->pendingOldName) {
+                        PushFolderDelta(watcher, DELTA_RENAME, watcher->pendingOldName, name);
+                        watcher->pendingOldName = NULL;
+                    } else {
+                        PushFolderDelta(watcher, DELTA_ADD, name, NULL);
+                    }
+                    break;
+                default:
+                    free(name);
+                    break;
+            }
+        }
+
+        if (info->NextEntryOffset == 0) break;
+        offset += info->NextEntryOffset;
+    }
+
+    ReleaseSRWLockExclusive(&watcher->lock);
+}
+
+static DWORD WINAPI FolderWatcherThread(LPVOID param) {
+    FolderWatcher* watcher = (FolderWatcher*)param;
+    BYTE* buffer = malloc(WATCH_BUFFER_SIZE);
+    HANDLE hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (!buffer || !hEvent) {
+        free(buffer);
+        if (hEvent) CloseHandle(hEvent);
+        return 0;
+    }
+
+    for (;;) {
+        OVERLAPPED ov = {0};
+        ov.hEvent = hEvent;
+        ResetEvent(hEvent);
+
+        if (!ReadDirectoryChangesW(watcher->hDirectory, buffer, WATCH_BUFFER_SIZE, watcher->subtree,
+                                   FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                   FILE_NOTIFY_CHANGE_ATTRIBUTES | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                   NULL, &ov, NULL)) {
+            break;
+        }
+
+        HANDLE handles[2] = { watcher->hStopEvent, hEvent };
+        DWORD wait = WaitForMultipleObjects(2, handles, FALSE, INFINITE);
+        if (wait != WAIT_OBJECT_0 + 1) {
+            CancelIoEx(watcher->hDirectory, &ov);
+            DWORD ignored;
+            GetOverlappedResult(watcher->hDirectory, &ov, &ignored, TRUE);
+            break;
+        }
+
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(watcher->hDirectory, &ov, &bytes, FALSE)) {
+            if (GetLastError() != ERROR_NOTIFY_ENUM_DIR) break;
+            bytes = 0;
+        }
+
+        QueueNotifications(watcher, buffer, bytes);
+        PostMessageW(watcher->hwndNotify, WM_APP_FOLDER_CHANGED, 0, 0);
+    }
+
+    CloseHandle(hEvent);
+    free(buffer);
+    return 0;
+}
+
+static void FolderWatcherStart(HWND hwnd, const WCHAR* folderPath) {
+    FolderWatcher* watcher = &g_watcher;
+    ZeroMemory(watcher, sizeof(*watcher));
+    InitializeSRWLock(&watcher->lock);
+    watcher->hwndNotify = hwnd;
+    watcher->subtree = g_recursiveDepth > 0;
+
+    watcher->hDirectory = CreateFileW(folderPath, FILE_LIST_DIRECTORY,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                                      OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (watcher->hDirectory == INVALID_HANDLE_VALUE) return;
+
+    watcher->hStopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (watcher->hStopEvent) {
+        watcher->hThread = CreateThread(NULL, 0, FolderWatcherThread, watcher, 0, NULL);
+    }
+}
+
+static void FreeFolderDeltas(FolderDelta* deltas, int count) {
+    for (int i = 0; i < count; i++) {
+        free(deltas[i].name);
+        free(deltas[i].newName);
+    }
+    free(deltas);
+}
+
+static void FolderWatcherStop(void) {
+    FolderWatcher* watcher = &g_watcher;
+
+    if (watcher->hThread) {
+        SetEvent(watcher->hStopEvent);
+        WaitForSingleObject(watcher->hThread, INFINITE);
+        CloseHandle(watcher->hThread);
+    }
+    if (watcher->hStopEvent) CloseHandle(watcher->hStopEvent);
+    if (watcher->hDirectory && watcher->hDirectory != INVALID_HANDLE_VALUE) CloseHandle(watcher->hDirectory);
+
+    FreeFolderDeltas(watcher->deltas, watcher->deltaCount);
+    free(watcher->pendingOldName);
+    ZeroMemory(watcher, sizeof(*watcher));
+}
+
+// Adds a new entry unless it is hidden, excluded by the listing rules or
+// already present.
+static void AddWatchedItem(const WCHAR* name) {
+    if (ItemStoreFind(&g_store, name) >= 0) return;
+
+    // Any name the listing accepts fits, with the extended-length prefix
+    // past MAX_PATH
+    SIZE_T length = wcslen(g_folderPath) + 1 + wcslen(name);
+    WCHAR* path = malloc((length + 5) * sizeof(WCHAR));
+    if (!path) return;
+    swprintf_s(path, length + 5, L"%s%s\\%s", length >= MAX_PATH ? L"\\\\?\\" : L"", g_folderPath, name);
+    DWORD attributes = GetFileAttributesW(path);
+    free(path);
+    if (attributes == INVALID_FILE_ATTRIBUTES || (attributes & FILE_ATTRIBUTE_HIDDEN)) return;
+
+    BOOL isDirectory = (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    if (!RulesAccept(&g_listingRules, name, isDirectory)) return;
+    ItemStoreAdd(&g_store, g_folderPath, name,
+                 (isDirectory ? ITEM_FLAG_DIRECTORY : 0) | ITEM_FLAG_ICON_PENDING,
+                 isDirectory ? g_placeholderFolderIcon : g_placeholderFileIcon);
+}
+
+// Retained back buffer for the pixels the main window paints itself: the
+// header and the status bar (the ListView child draws the grid). Fonts and
+// brushes are created once per popup, each band is re-rendered only when its
+// text changes, and WM_PAINT copies just the update rectangle to the screen.
+//
+// The fade-out stays on SetLayeredWindowAttributes: UpdateLayeredWindow cannot
+// present child windows such as the ListView, and a constant-alpha layer is
+// blended by DWM without repainting anything at each step.
+#define PAINT_PEN_CACHE 8   // Hover color plus every click-pulse step
+
+typedef struct PaintCache {
+    HDC hdc;
+    HBITMAP hBitmap;
+    HBITMAP hOldBitmap;
+    int width;
+    int height;
+    HFONT hHeaderFont;
+    HFONT hStatusFont;
+    HBRUSH hHeaderBrush;
+    HBRUSH hStatusBrush;
+    HBRUSH hBgBrush;
+    HPEN pens[PAINT_PEN_CACHE];
+    COLORREF penColors[PAINT_PEN_CACHE];
+    int nextPen;
+    BOOL headerValid;
+    WCHAR statusText[64 + FILTER_MAX_QUERY];
+} PaintCache;
+
+static PaintCache g_paint;
+
+static void PaintCacheFree(PaintCache* cache) {
+    if (cache->hdc) {
+        SelectObject(cache->hdc, cache->hOldBitmap);
+        DeleteDC(cache->hdc);
+    }
+    if (cache->hBitmap) DeleteObject(cache->hBitmap);
+    if (cache->hHeaderFont) DeleteObject(cache->hHeaderFont);
+    if (cache->hStatusFont) DeleteObject(cache->hStatusFont);
+    if (cache->hHeaderBrush) DeleteObject(cache->hHeaderBrush);
+    if (cache->hStatusBrush) DeleteObject(cache->hStatusBrush);
+    if (cache->hBgBrush) DeleteObject(cache->hBgBrush);
+    for (int i = 0; i < PAINT_PEN_CACHE; i++) {
+        if (cache->pens[i]) DeleteObject(cache->pens[i]);
+    }
+    ZeroMemory(cache, sizeof(*cache));
+}
+
+// Makes sure the back buffer matches the client size. A new buffer starts
+// with every band dirty.
+static BOOL PaintCacheEnsure(PaintCache* cache, HDC hdc, int width, int height) {
+    if (!cache->hHeaderFont) {
+        cache->hHeaderFont = CreateFontW(-ScaleForDpi(14), 0, 0, 0, FW_SEMIBOLD, FALSE, FALSE, FALSE,
+            DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+            CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Segoe UI");
+        cache->hStatusFont = CreateFontW(-ScaleForDpi(11), 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
+            DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
+            CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Segoe UI");
+        cache->hHeaderBrush = CreateSolidBrush(g_headerBgColor);
+        cache->hStatusBrush = CreateSolidBrush(g_isDarkMode ? RGB(37, 37, 37) : RGB(249, 249, 249));
+        cache->hBgBrush = CreateSolidBrush(g_bgColor);
+    }
+
+    if (cache->hdc && cache->width == width && cache->height == height) return TRUE;
+
+    if (cache->hdc) {
+        SelectObject(cache->hdc, cache->hOldBitmap);
+        DeleteDC(cache->hdc);
+        DeleteObject(cache->hBitmap);
+        cache->hdc = NULL;
+        cache->hBitmap = NULL;
+    }
+
+    BITMAPINFO bmi = {0};
+    bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+    bmi.bmiHeader.biWidth = width;
+    bmi.bmiHeader.biHeight = -height;  // Top-down
+    bmi.bmiHeader.biPlanes = 1;
+    bmi.bmiHeader.biBitCount = 32;
+    bmi.bmiHeader.biCompression = BI_RGB;
+
+    void* bits;
+    cache->hBitmap = CreateDIBSection(hdc, &bmi, DIB_RGB_COLORS, &bits, NULL, 0);
+    if (!cache->hBitmap) return FALSE;
+    cache->hdc = CreateCompatibleDC(hdc);
+    if (!cache->hdc) {
+        DeleteObject(cache->hBitmap);
+        cache->hBitmap = NULL;
+        return FALSE;
+    }
+    cache->hOldBitmap = SelectObject(cache->hdc, cache->hBitmap);
+    SetBkMode(cache->hdc, TRANSPARENT);
+    cache->width = width;
+    cache->height = height;
+
+    RECT rc = { 0, 0, width, height };
+    FillRect(cache->hdc, &rc, cache->hBgBrush);
+    cache->headerValid = FALSE;
+    cache->statusText[0] = 0;
+    return TRUE;
+}
+
+// Pen for a highlight outline. Hover and the click pulse only ever use a few
+// colors, so after the first frames no pen is created.
+static HPEN PaintCachePen(PaintCache* cache, COLORREF color) {
+    for (int i = 0; i < PAINT_PEN_CACHE; i++) {
+        if (cache->pens[i] && cache->penColors[i] == color) return cache->pens[i];
+    }
+
+    int slot = cache->nextPen;
+    cache->nextPen = (slot + 1) % PAINT_PEN_CACHE;
+    if (cache->pens[slot]) DeleteObject(cache->pens[slot]);
+    cache->pens[slot] = CreatePen(PS_SOLID, ScaleForDpi(2), color);
+    cache->penColors[slot] = color;
+    return cache->pens[slot];
+}
+
+static void FormatStatusText(WCHAR* statusText, int size) {
+    // Counts so far, while a listing is still arriving
+    if (g_folderLoad && !g_filter.queryLength) {
+        if (g_store.count && !g_folderLoad->replace) {
+            swprintf_s(statusText, size, L"Loading... %d item%s", g_store.count, g_store.count == 1 ? L"" : L"s");
+        } else {
+            wcscpy_s(statusText, size, L"Loading...");
+        }
+        return;
+    }
+
+    if (g_filter.queryLength) {
+        swprintf_s(statusText, size, L"\"%s\": %d of %d",
+            g_filter.query, g_filter.matchCount, g_store.count);
+        return;
+    }
+
+    int folders = 0, files = 0;
+    for (int i = 0; i < g_store.count; i++) {
+        if (ItemIsDirectory(i)) folders++;
+        else files++;
+    }
+
+    if (folders > 0 && files > 0) {
+        swprintf_s(statusText, size, L"%d folder%s, %d file%s",
+            folders, folders == 1 ? L"" : L"s",
+            files, files == 1 ? L"" : L"s");
+    } else if (folders > 0) {
+        swprintf_s(statusText, size, L"%d folder%s", folders, folders == 1 ? L"" : L"s");
+    } else if (files > 0) {
+        swprintf_s(statusText, size, L"%d file%s", files, files == 1 ? L"" : L"s");
+    } else {
+        wcscpy_s(statusText, size, L"Empty folder");
+    }
+}
+
+static void InvalidateStatusBar(void) {
+    RECT rc;
+    GetClientRect(g_hwndMain, &rc);
+    rc.top = rc.bottom - ScaleForDpi(STATUS_HEIGHT);
+    InvalidateRect(g_hwndMain, &rc, FALSE);
+}
+
+static void PaintWindow(HWND hwnd, HDC hdc, const RECT* update) {
+    RECT rc;
+    GetClientRect(hwnd, &rc);
+    PaintCache* cache = &g_paint;
+    if (!PaintCacheEnsure(cache, hdc, rc.right, rc.bottom)) return;
+    int headerHeight = ScaleForDpi(HEADER_HEIGHT);
+    int statusHeight = ScaleForDpi(STATUS_HEIGHT);
+    int margin = ScaleForDpi(12);
+
+    // Header: folder name, which is fixed for the life of the window
+    if (!cache->headerValid) {
+        RECT headerRect = { 0, 0, rc.right, headerHeight };
+        FillRect(cache->hdc, &headerRect, cache->hHeaderBrush);
+
+        SetTextColor(cache->hdc, g_textColor);
+        HFONT oldFont = SelectObject(cache->hdc, cache->hHeaderFont);
+        RECT textRect = { margin, 0, rc.right - ScaleForDpi(36), headerHeight };
+        DrawTextW(cache->hdc, g_folderName, -1, &textRect, DT_SINGLELINE | DT_VCENTER | DT_END_ELLIPSIS);
+        SelectObject(cache->hdc, oldFont);
+        cache->headerValid = TRUE;
+    }
+
+    // Status bar: counts or filter results, redrawn only when the text changes
+    WCHAR statusText[64 + FILTER_MAX_QUERY];
+    FormatStatusText(statusText, 64 + FILTER_MAX_QUERY);
+    if (wcscmp(statusText, cache->statusText) != 0) {
+        RECT statusRect = { 0, rc.bottom - statusHeight, rc.right, rc.bottom };
+        FillRect(cache->hdc, &statusRect, cache->hStatusBrush);
+
+        SetTextColor(cache->hdc, g_statusTextColor);
+        HFONT oldFont = SelectObject(cache->hdc, cache->hStatusFont);
+        RECT statusTextRect = { margin, rc.bottom - statusHeight, rc.right - margin, rc.bottom };
+        DrawTextW(cache->hdc, statusText, -1, &statusTextRect, DT_SINGLELINE | DT_VCENTER);
+        SelectObject(cache->hdc, oldFont);
+        wcscpy_s(cache->statusText, 64 + FILTER_MAX_QUERY, statusText);
+    }
+
+    // Copy the dirty part to screen
+    BitBlt(hdc, update->left, update->top, update->right - update->left, update->bottom - update->top,
+           cache->hdc, update->left, update->top, SRCCOPY);
+}
+
+static void RefreshListView(void) {
+    g_hoverIndex = -1;
+    g_clickedIndex = -1;
+    UpdateTooltip(g_hwndListView, -1);
+
+    if (g_filter.built) FilterRebuild(&g_filter);
+    g_grid.itemCount = ViewCount();
+    ListView_SetItemCountEx(g_hwndListView, ViewCount(), LVSICF_NOSCROLL);
+    SyncGridWithListView();
+    InvalidateRect(g_hwndListView, NULL, TRUE);
+
+    // Status bar counts
+    InvalidateStatusBar();
+}
+
+// Timer side of the watcher: applies every queued delta, re-sorts once and
+// starts icon extraction for just the new or modified items.
+static void ApplyFolderDeltas(HWND hwnd) {
+    // Item indices must stay stable while icons are being extracted, and a
+    // listing still arriving may already include the changes
+    if (g_iconLoader || g_folderLoad) {
+        SetTimer(hwnd, ID_TIMER_REFRESH, REFRESH_COALESCE_MS, NULL);
+        return;
+    }
+    KillTimer(hwnd, ID_TIMER_REFRESH);
+    GetFolderLastWrite(g_folderPath, &g_storeLastWrite);
+
+    FolderWatcher* watcher = &g_watcher;
+    AcquireSRWLockExclusive(&watcher->lock);
+    FolderDelta* deltas = watcher->deltas;
+    int deltaCount = watcher->deltaCount;
+    watcher->deltas = NULL;
+    watcher->deltaCount = 0;
+    watcher->deltaCapacity = 0;
+    ReleaseSRWLockExclusive(&watcher->lock);
+
+    if (deltaCount == 0) {
+        free(deltas);
+        return;
+    }
+
+    BOOL rescan = FALSE;
+    for (int i = 0; i < deltaCount && !rescan; i++) {
+        FolderDelta* delta = &deltas[i];
+        int index;
+
+        // New listing rules can change any entry
+        if ((delta->name && _wcsicmp(delta->name, RULES_FILE_NAME) == 0) ||
+            (delta->newName && _wcsicmp(delta->newName, RULES_FILE_NAME) == 0)) {
+            rescan = TRUE;
+            break;
+        }
+
+        switch (delta->action) {
+            case DELTA_ADD:
+                AddWatchedItem(delta->name);
+                break;
+
+            case DELTA_REMOVE:
+                index = ItemStoreFind(&g_store, delta->name);
+                if (index >= 0) ItemStoreRemove(&g_store, index);
+                break;
+
+            case DELTA_RENAME:
+                index = ItemStoreFind(&g_store, delta->name);
+                if (index < 0) {
+                    AddWatchedItem(delta->newName);
+                } else if (!RulesAccept(&g_listingRules, delta->newName, ItemIsDirectory(index)) ||
+                           !ItemStoreRename(&g_store, index, g_folderPath, delta->newName)) {
+                    ItemStoreRemove(&g_store, index);
+                } else if (IsShortcut(delta->name) != IsShortcut(delta->newName)) {
+                    g_store.flags[index] |= ITEM_FLAG_ICON_PENDING;
+                }
+                break;
+
+            case DELTA_MODIFY:
+                // Attribute changes can hide or reveal an entry; content
+                // changes (an edited shortcut) need a fresh icon
+                index = ItemStoreFind(&g_store, delta->name);
+                if (index >= 0) {
+                    DWORD attributes = GetFileAttributesW(ItemPath(index));
+                    if (attributes == INVALID_FILE_ATTRIBUTES || (attributes & FILE_ATTRIBUTE_HIDDEN)) {
+                        ItemStoreRemove(&g_store, index);
+                    } else if (!ItemIsDirectory(index)) {
+                        g_store.flags[index] |= ITEM_FLAG_ICON_PENDING;
+                        g_store.targetOffset[index] = ITEM_NO_TARGET;
+                    }
+                } else {
+                    AddWatchedItem(delta->name);
+                }
+                break;
+
+            case DELTA_RESCAN:
+                rescan = TRUE;
+                break;
+        }
+    }
+    FreeFolderDeltas(deltas, deltaCount);
+
+    // The current items stay up until the new listing is complete
+    if (rescan) {
+        FolderLoadStart(hwnd, FALSE, TRUE);
+        InvalidateStatusBar();
+        return;
+    }
+
+    SortItems();
+    RefreshListView();
+
+    int* pending = malloc(max(1, g_store.count) * sizeof(int));
+    if (!pending) return;
+    int pendingCount = 0;
+    for (int i = 0; i < g_store.count; i++) {
+        if (g_store.flags[i] & ITEM_FLAG_ICON_PENDING) {
+            g_store.flags[i] &= ~ITEM_FLAG_ICON_PENDING;
+            pending[pendingCount++] = i;
+        }
+    }
+    if (pendingCount > 0) {
+        IconLoaderStart(hwnd, pending, pendingCount);
+    }
+    free(pending);
+    ManifestCheckStart(hwnd);
+}
+
+// WM_APP_FOLDER_LOADED: takes the next batch of a listing that was still
+// arriving when the popup opened, or a finished rescan, and starts the work
+// that waits for the complete listing.
+static void ApplyFolderLoad(HWND hwnd) {
+    FolderLoad* load = g_folderLoad;
+    if (!load) return;
+
+    BOOL replace = load->replace;
+    int count = g_store.count;
+    BOOL complete = FolderLoadTake();
+    if (replace) {
+        if (!complete) return;
+        ListView_SetImageList(g_hwndListView, g_imageList, LVSIL_NORMAL);
+    }
+    if (complete || g_store.count != count) RefreshListView();
+    if (!complete) return;
+
+    IconLoaderStart(hwnd, NULL, 0);
+    ManifestCheckStart(hwnd);
+    if (!replace) {
+        FolderWatcherStart(hwnd, g_folderPath);
+        PrefetchStart();
+    }
 }
 
-static void CreateListView(HWND hwndParent) {
-    RECT rc;
-    GetClientRect(hwndParent, &rc);
+// Applies new filter text and resets the view to the top of the results.
+static void ApplyFilter(const WCHAR* query) {
+    FilterSetQuery(&g_filter, query);
+    if (!g_filter.queryLength) FilterClear(&g_filter);
+
+    g_hoverIndex = -1;
+    g_clickedIndex = -1;
+    UpdateTooltip(g_hwndListView, -1);
+
+    g_grid.itemCount = ViewCount();
+    ListView_SetItemCountEx(g_hwndListView, ViewCount(), 0);
+    if (ViewCount() > 0) ListView_EnsureVisible(g_hwndListView, 0, FALSE);
+    SyncGridWithListView();
+    InvalidateRect(g_hwndListView, NULL, TRUE);
+    InvalidateStatusBar();
+    IconLoaderPrioritizeVisible();
+}
 
-    g_hwndListView = CreateWindowExW(
-        0, WC_LISTVIEWW, NULL,
-        WS_CHILD | WS_VISIBLE | LVS_ICON | LVS_SINGLESEL | LVS_AUTOARRANGE,
-        0, HEADER_HEIGHT,
-        rc.right, rc.bottom - HEADER_HEIGHT - STATUS_HEIGHT,
-        hwndParent, (HMENU)IDC_LISTVIEW, GetModuleHandle(NULL), NULL);
+// The popup was dragged onto a monitor with another scale. Fonts and pens
+// follow on the next paint; a new icon level means a new image list, filled
+// again from the icon cache's masters by a fresh loader.
+static void ApplyDpiChange(HWND hwnd, UINT dpi, const RECT* suggested) {
+    g_dpi = dpi;
+    PaintCacheFree(&g_paint);
+
+    int iconSize = IconSizeForDpi(dpi);
+    BOOL reload = iconSize != g_iconSize;
+    if (reload) {
+        // Results still queued are at the old size. Detach the run rather
+        // than join it, so a slow extraction cannot freeze the drag
+        IconLoaderStop(0);
+
+        g_iconSize = iconSize;
+        ImageList_Destroy(g_imageList);
+        IconSlotFree(&g_iconSlots);
+        g_imageList = ImageList_Create(g_iconSize, g_iconSize, ILC_COLOR32 | ILC_MASK, 50, 50);
+        AddPlaceholderIcons();
+        for (int i = 0; i < g_store.count; i++) {
+            g_store.iconIndex[i] = ItemIsDirectory(i) ? g_placeholderFolderIcon : g_placeholderFileIcon;
+        }
+        ListView_SetImageList(g_hwndListView, g_imageList, LVSIL_NORMAL);
+    }
 
-    ListView_SetImageList(g_hwndListView, g_imageList, LVSIL_NORMAL);
-    ListView_SetIconSpacing(g_hwndListView, ICON_CELL_SIZE, ICON_CELL_SIZE);
-    ListView_SetExtendedListViewStyle(g_hwndListView, LVS_EX_DOUBLEBUFFER);
+    int itemCount = g_grid.itemCount;
+    ListView_SetIconSpacing(g_hwndListView, IconCellSize(), IconCellSize());
+    GridInit(&g_grid, IconCellSize());
+    g_grid.itemCount = itemCount;
 
-    // Set colors
-    ListView_SetBkColor(g_hwndListView, g_bgColor);
-    ListView_SetTextBkColor(g_hwndListView, g_bgColor);
-    ListView_SetTextColor(g_hwndListView, g_bgColor); // Hide text, show in tooltip only
+    // WM_SIZE lays out the list view for the new window size
+    SetWindowPos(hwnd, NULL, suggested->left, suggested->top,
+                 suggested->right - suggested->left, suggested->bottom - suggested->top,
+                 SWP_NOZORDER | SWP_NOACTIVATE);
+    MeasureGridItemBounds();
+    InvalidateRect(hwnd, NULL, FALSE);
 
-    // Populate items
-    for (int i = 0; i < g_itemCount; i++) {
-        LVITEMW lvi = {0};
-        lvi.mask = LVIF_IMAGE | LVIF_PARAM;
-        lvi.iItem = i;
-        lvi.iImage = g_items[i].nIconIndex;
-        lvi.lParam = i;
-        ListView_InsertItem(g_hwndListView, &lvi);
-    }
+    if (reload && !g_folderLoad) IconLoaderStart(hwnd, NULL, 0);
+}
 
-    SetWindowSubclass(g_hwndListView, ListViewSubclassProc, 0, 0);
-    CreateTooltip(hwndParent);
+// Resident mode keeps the models of recently shown folders alive between
+// popups: the item store and its finished image list, validated against the
+// folder's last-write time when the folder is shown again.
+#define RESIDENT_MAX_MODELS 8
+
+typedef struct FolderModel {
+    WCHAR szFolderPath[MAX_PATH];
+    FILETIME ftLastWrite;
+    ULONGLONG rulesHash;  // ListingRules the store was filtered with
+    ItemStore store;
+    HIMAGELIST imageList;
+    IconSlotTable iconSlots;
+    DWORD lastUsed;
+} FolderModel;
+
+static BOOL g_isResident = FALSE;
+static HWND g_hwndResident = NULL;
+static FolderModel g_models[RESIDENT_MAX_MODELS];
+static DWORD g_modelClock = 0;
+
+static void DiscardModel(FolderModel* model) {
+    FreeItemStore(&model->store);
+    if (model->imageList) ImageList_Destroy(model->imageList);
+    IconSlotFree(&model->iconSlots);
+    ZeroMemory(model, sizeof(*model));
 }
 
-static void PaintWindow(HWND hwnd, HDC hdc) {
-    RECT rc;
-    GetClientRect(hwnd, &rc);
+// Moves a cached model for the current folder into g_store / g_imageList,
+// given the folder's last-write time and listing rules as they are now.
+// Returns FALSE (and drops the entry) when nothing usable is cached.
+static BOOL ResidentTakeModel(const FILETIME* lastWrite, ULONGLONG rulesHash) {
+    if (!g_isResident) return FALSE;
+
+    for (int i = 0; i < RESIDENT_MAX_MODELS; i++) {
+        FolderModel* model = &g_models[i];
+        if (!model->imageList || _wcsicmp(model->szFolderPath, g_folderPath) != 0) continue;
+        if (g_recursiveDepth) {
+            DiscardModel(model);
+            return FALSE;
+        }
 
-    // Create memory DC for double buffering
-    HDC memDC = CreateCompatibleDC(hdc);
-    HBITMAP memBitmap = CreateCompatibleBitmap(hdc, rc.right, rc.bottom);
-    HBITMAP oldBitmap = SelectObject(memDC, memBitmap);
-
-    // Fill background
-    HBRUSH bgBrush = CreateSolidBrush(g_bgColor);
-    FillRect(memDC, &rc, bgBrush);
-    DeleteObject(bgBrush);
-
-    // Draw header
-    RECT headerRect = { 0, 0, rc.right, HEADER_HEIGHT };
-    HBRUSH headerBrush = CreateSolidBrush(g_headerBgColor);
-    FillRect(memDC, &headerRect, headerBrush);
-    DeleteObject(headerBrush);
-
-    // Draw header text
-    SetBkMode(memDC, TRANSPARENT);
-    SetTextColor(memDC, g_textColor);
-    HFONT hFont = CreateFontW(-14, 0, 0, 0, FW_SEMIBOLD, FALSE, FALSE, FALSE,
-        DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
-        CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Segoe UI");
-    HFONT oldFont = SelectObject(memDC, hFont);
-
-    RECT textRect = { 12, 0, rc.right - 36, HEADER_HEIGHT };
-    DrawTextW(memDC, g_folderName, -1, &textRect, DT_SINGLELINE | DT_VCENTER | DT_END_ELLIPSIS);
-
-    // Draw status bar
-    RECT statusRect = { 0, rc.bottom - STATUS_HEIGHT, rc.right, rc.bottom };
-    HBRUSH statusBrush = CreateSolidBrush(g_isDarkMode ? RGB(37, 37, 37) : RGB(249, 249, 249));
-    FillRect(memDC, &statusRect, statusBrush);
-    DeleteObject(statusBrush);
-
-    // Draw status text
-    SetTextColor(memDC, g_statusTextColor);
-    HFONT statusFont = CreateFontW(-11, 0, 0, 0, FW_NORMAL, FALSE, FALSE, FALSE,
-        DEFAULT_CHARSET, OUT_DEFAULT_PRECIS, CLIP_DEFAULT_PRECIS,
-        CLEARTYPE_QUALITY, DEFAULT_PITCH | FF_DONTCARE, L"Segoe UI");
-    SelectObject(memDC, statusFont);
+        // Icons are at the level of the monitor the model was shown on
+        int iconWidth, iconHeight;
+        if (!ImageList_GetIconSize(model->imageList, &iconWidth, &iconHeight) || iconWidth != g_iconSize ||
+            model->rulesHash != rulesHash || CompareFileTime(lastWrite, &model->ftLastWrite) != 0) {
+            DiscardModel(model);
+            return FALSE;
+        }
 
-    int folders = 0, files = 0;
-    for (int i = 0; i < g_itemCount; i++) {
-        if (g_items[i].bIsDirectory) folders++;
-        else files++;
+        FreeItemStore(&g_store);
+        if (g_imageList) ImageList_Destroy(g_imageList);
+        IconSlotFree(&g_iconSlots);
+        g_store = model->store;
+        g_imageList = model->imageList;
+        g_iconSlots = model->iconSlots;
+        g_storeLastWrite = model->ftLastWrite;
+        ZeroMemory(model, sizeof(*model));
+
+        // Nothing left to extract for this model
+        g_iconsIncomplete = FALSE;
+        g_iconsSlow = FALSE;
+
+        // This launch may ask for a different --sort
+        // Frecency ranks move with every launch, so they are never cached
+        if (g_store.sortMode != g_sortMode || g_sortMode == SORT_FRECENCY) SortItems();
+        return TRUE;
     }
+    return FALSE;
+}
 
-    WCHAR statusText[64];
-    if (folders > 0 && files > 0) {
-        swprintf_s(statusText, 64, L"%d folder%s, %d file%s",
-            folders, folders == 1 ? L"" : L"s",
-            files, files == 1 ? L"" : L"s");
-    } else if (folders > 0) {
-        swprintf_s(statusText, 64, L"%d folder%s", folders, folders == 1 ? L"" : L"s");
-    } else if (files > 0) {
-        swprintf_s(statusText, 64, L"%d file%s", files, files == 1 ? L"" : L"s");
-    } else {
-        wcscpy_s(statusText, 64, L"Empty folder");
+// Hands the current folder's model to the cache when the popup closes. Only
+// complete models are kept: a popup closed mid-extraction would otherwise
+// leave placeholder icons behind for good.
+static BOOL ResidentStashModel(void) {
+    if (!g_isResident || !g_imageList) return FALSE;
+    // The folder's last-write time says nothing about changes in subfolders
+    if (g_store.rootLength) return FALSE;
+    if (g_folderLoad || g_iconLoader || g_iconsIncomplete || g_iconsSlow) return FALSE;
+
+    FolderModel* slot = &g_models[0];
+    for (int i = 0; i < RESIDENT_MAX_MODELS; i++) {
+        if (!g_models[i].imageList || _wcsicmp(g_models[i].szFolderPath, g_folderPath) == 0) {
+            slot = &g_models[i];
+            break;
+        }
+        if (g_models[i].lastUsed < slot->lastUsed) slot = &g_models[i];
     }
+    DiscardModel(slot);
+
+    wcscpy_s(slot->szFolderPath, MAX_PATH, g_folderPath);
+    slot->ftLastWrite = g_storeLastWrite;
+    slot->rulesHash = g_listingRules.hash;
+    slot->store = g_store;
+    slot->imageList = g_imageList;
+    slot->iconSlots = g_iconSlots;
+    slot->lastUsed = ++g_modelClock;
+
+    ZeroMemory(&g_store, sizeof(g_store));
+    ZeroMemory(&g_iconSlots, sizeof(g_iconSlots));
+    g_imageList = NULL;
+    return TRUE;
+}
 
-    RECT statusTextRect = { 12, rc.bottom - STATUS_HEIGHT, rc.right - 12, rc.bottom };
-    DrawTextW(memDC, statusText, -1, &statusTextRect, DT_SINGLELINE | DT_VCENTER);
-
-    SelectObject(memDC, oldFont);
-    DeleteObject(hFont);
-    DeleteObject(statusFont);
+// Click-to-visible latency: the launch time is the creation time of the
+// process that handled the click (forwarded by clients in resident mode);
+// it is traced on the popup's first paint, as a span ending there.
+static ULONGLONG g_launchTime = 0;
+static BOOL g_launchForwarded = FALSE;
 
-    // Copy to screen
-    BitBlt(hdc, 0, 0, rc.right, rc.bottom, memDC, 0, 0, SRCCOPY);
+static ULONGLONG GetProcessStartTime(void) {
+    FILETIME creation, exitTime, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user)) return 0;
+    return ((ULONGLONG)creation.dwHighDateTime << 32) | creation.dwLowDateTime;
+}
 
-    SelectObject(memDC, oldBitmap);
-    DeleteObject(memBitmap);
-    DeleteDC(memDC);
+static void ReportLaunchLatency(void) {
+    LONGLONG end = TraceBegin();
+    if (end && g_launchTime) {
+        FILETIME now;
+        GetSystemTimePreciseAsFileTime(&now);
+        ULONGLONG nowTime = ((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime;
+        LONGLONG latency = (LONGLONG)((double)(nowTime - g_launchTime) * g_traceFrequency / 10000000.0);
+        TraceSpan("ClickToVisible", end - latency, end, "resident", g_launchForwarded);
+    }
+    g_launchTime = 0;
 }
 
 static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
@@ -851,9 +8094,48 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
             BOOL darkMode = g_isDarkMode;
             DwmSetWindowAttribute(hwnd, DWMWA_USE_IMMERSIVE_DARK_MODE, &darkMode, sizeof(darkMode));
 
-            LoadFolderContents();
+            g_dpi = GetDpiForWindow(hwnd);
+            g_iconSize = IconSizeForDpi(g_dpi);
+
+            // A cached model only needs the folder's last-write time and
+            // rules, which the load looks up first
+            FilterClear(&g_filter);
+            ULONGLONG deadline = GetTickCount64() + FOLDER_LOAD_WAIT_MS;
+            FolderLoadStart(hwnd, TRUE, FALSE);
+            FolderLoad* load = g_folderLoad;
+            BOOL warm = FALSE;
+            if (g_isResident && load && FolderLoadWait(load, FALSE, deadline) &&
+                ResidentTakeModel(&load->lastWrite, load->rules.hash)) {
+                // The load's rules stay with its worker until it stops
+                warm = TRUE;
+                FolderLoadCancel();
+                RulesBuild(&g_listingRules, g_ruleText, g_folderPath);
+            }
+
+            // Past the deadline the popup opens with what has been listed
+            BOOL complete = warm;
+            if (!warm) {
+                if (load) FolderLoadWait(load, TRUE, deadline);
+                complete = FolderLoadTake();
+            }
+
+            LONGLONG traceStart = TraceBegin();
             CreateListView(hwnd);
+            TraceEnd("CreateListView", traceStart);
+
+            traceStart = TraceBegin();
             PositionWindow(hwnd);
+            TraceEnd("PositionWindow", traceStart);
+
+            traceStart = TraceBegin();
+            if (complete && !warm) {
+                IconLoaderStart(hwnd, NULL, 0);
+                ManifestCheckStart(hwnd);
+            }
+            if (complete) FolderWatcherStart(hwnd, g_folderPath);
+            LaunchQueueSetNotify(hwnd);
+            if (complete) PrefetchStart();
+            TraceEnd("StartBackgroundWork", traceStart);
 
             // Show immediately (fade-out only)
             g_opacity = 255;
@@ -862,7 +8144,11 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
         }
 
         case WM_TIMER:
-            if (wParam == ID_TIMER_FADE && g_isClosing) {
+            if (wParam == ID_TIMER_REFRESH) {
+                ApplyFolderDeltas(hwnd);
+            } else if (wParam == ID_TIMER_LAUNCH_WATCHDOG) {
+                if (!LaunchQueueWatchdog()) KillTimer(hwnd, ID_TIMER_LAUNCH_WATCHDOG);
+            } else if (wParam == ID_TIMER_FADE && g_isClosing) {
                 if (g_opacity <= 25) {
                     KillTimer(hwnd, ID_TIMER_FADE);
                     DestroyWindow(hwnd);
@@ -899,8 +8185,8 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
                     // Invalidate clicked item to redraw
                     if (g_clickedIndex >= 0) {
                         RECT itemRect;
-                        ListView_GetItemRect(g_hwndListView, g_clickedIndex, &itemRect, LVIR_BOUNDS);
-                        InflateRect(&itemRect, 4, 4);
+                        GridItemRect(&g_grid, g_clickedIndex, &itemRect);
+                        InflateRect(&itemRect, ScaleForDpi(4), ScaleForDpi(4));
                         InvalidateRect(g_hwndListView, &itemRect, TRUE);
                     }
                 }
@@ -909,17 +8195,44 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
 
         case WM_PAINT: {
             PAINTSTRUCT ps;
+            LONGLONG traceStart = TraceBegin();
             HDC hdc = BeginPaint(hwnd, &ps);
-            PaintWindow(hwnd, hdc);
+            PaintWindow(hwnd, hdc, &ps.rcPaint);
             EndPaint(hwnd, &ps);
+            TraceEnd("WM_PAINT", traceStart);
+            ReportLaunchLatency();
             return 0;
         }
 
         case WM_ERASEBKGND:
             return 1;
 
+        case WM_SIZE:
+            if (g_hwndListView) {
+                int headerHeight = ScaleForDpi(HEADER_HEIGHT);
+                MoveWindow(g_hwndListView, 0, headerHeight, LOWORD(lParam),
+                           max(0, HIWORD(lParam) - headerHeight - ScaleForDpi(STATUS_HEIGHT)), TRUE);
+                SyncGridWithListView();
+            }
+            return 0;
+
+        case WM_DPICHANGED:
+            ApplyDpiChange(hwnd, HIWORD(wParam), (const RECT*)lParam);
+            return 0;
+
         case WM_NOTIFY: {
             NMHDR* nmhdr = (NMHDR*)lParam;
+            if (nmhdr->hwndFrom == g_hwndListView && nmhdr->code == LVN_GETDISPINFOW) {
+                NMLVDISPINFOW* di = (NMLVDISPINFOW*)lParam;
+                if ((di->item.mask & LVIF_IMAGE) && di->item.iItem >= 0 && di->item.iItem < ViewCount()) {
+                    di->item.iImage = g_store.iconIndex[ViewItem(di->item.iItem)];
+                }
+                return 0;
+            }
+            if (nmhdr->hwndFrom == g_hwndListView && nmhdr->code == LVN_ENDSCROLL) {
+                SyncGridWithListView();
+                IconLoaderPrioritizeVisible();
+            }
             if (nmhdr->hwndFrom == g_hwndListView && nmhdr->code == NM_CUSTOMDRAW) {
                 NMLVCUSTOMDRAW* lvcd = (NMLVCUSTOMDRAW*)lParam;
                 switch (lvcd->nmcd.dwDrawStage) {
@@ -937,7 +8250,7 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
                         if (isClicked || isHovered) {
                             // Draw rounded border outline
                             RECT itemRect;
-                            ListView_GetItemRect(g_hwndListView, itemIndex, &itemRect, LVIR_BOUNDS);
+                            GridItemRect(&g_grid, itemIndex, &itemRect);
 
                             HDC hdc = lvcd->nmcd.hdc;
                             HBRUSH oldBrush = SelectObject(hdc, GetStockObject(NULL_BRUSH));
@@ -953,15 +8266,14 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
                                 penColor = RGB(r, g, b);
                             }
 
-                            HPEN hPen = CreatePen(PS_SOLID, 2, penColor);
-                            HPEN oldPen = SelectObject(hdc, hPen);
+                            HPEN oldPen = SelectObject(hdc, PaintCachePen(&g_paint, penColor));
 
-                            RoundRect(hdc, itemRect.left + 3, itemRect.top + 3,
-                                      itemRect.right - 3, itemRect.bottom - 3, 8, 8);
+                            int inset = ScaleForDpi(3), radius = ScaleForDpi(8);
+                            RoundRect(hdc, itemRect.left + inset, itemRect.top + inset,
+                                      itemRect.right - inset, itemRect.bottom - inset, radius, radius);
 
                             SelectObject(hdc, oldBrush);
                             SelectObject(hdc, oldPen);
-                            DeleteObject(hPen);
                         }
                         return CDRF_DODEFAULT;
                     }
@@ -979,7 +8291,7 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
 
         case WM_LBUTTONDOWN: {
             POINT pt = { LOWORD(lParam), HIWORD(lParam) };
-            if (pt.y < HEADER_HEIGHT) {
+            if (pt.y < ScaleForDpi(HEADER_HEIGHT)) {
                 ReleaseCapture();
                 SendMessageW(hwnd, WM_NCLBUTTONDOWN, HTCAPTION, 0);
             }
@@ -988,8 +8300,9 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
 
         case WM_LBUTTONDBLCLK: {
             POINT pt = { LOWORD(lParam), HIWORD(lParam) };
-            if (pt.y < HEADER_HEIGHT) {
-                ShellExecuteW(NULL, L"open", g_folderPath, NULL, NULL, SW_SHOWNORMAL);
+            if (pt.y < ScaleForDpi(HEADER_HEIGHT)) {
+                PrefetchCancel();
+                LaunchQueuePush(g_folderPath, NULL, NULL);
                 g_isClosing = TRUE;
                 SetTimer(hwnd, ID_TIMER_FADE, 10, NULL);
             }
@@ -997,17 +8310,180 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
         }
 
         case WM_KEYDOWN:
-            if (wParam == VK_ESCAPE) {
+            if (wParam == VK_ESCAPE && g_filter.queryLength) {
+                ApplyFilter(L"");
+            } else if (wParam == VK_ESCAPE) {
                 g_isClosing = TRUE;
                 SetTimer(hwnd, ID_TIMER_FADE, 10, NULL);
+            } else if (wParam == VK_RETURN && g_filter.queryLength && g_filter.matchCount > 0) {
+                OpenItem(0);  // Best match
+            }
+            return 0;
+
+        case WM_CHAR: {
+            WCHAR query[FILTER_MAX_QUERY + 1];
+            wcscpy_s(query, FILTER_MAX_QUERY + 1, g_filter.query);
+            int length = g_filter.queryLength;
+            if (wParam == VK_BACK) {
+                if (length == 0) return 0;
+                query[length - 1] = 0;
+            } else if (wParam >= L' ' && wParam != 0x7F && length < FILTER_MAX_QUERY) {
+                query[length] = (WCHAR)wParam;
+                query[length + 1] = 0;
+            } else {
+                return 0;
             }
+            ApplyFilter(query);
+            return 0;
+        }
+
+        case WM_APP_ICONS_READY:
+            IconLoaderApplyResults();
+            return 0;
+
+        case WM_APP_FOLDER_CHANGED:
+            // Restarting the timer coalesces a burst into one update
+            SetTimer(hwnd, ID_TIMER_REFRESH, REFRESH_COALESCE_MS, NULL);
+            return 0;
+
+        case WM_APP_LAUNCH_DONE:
+            LaunchQueueReport();
+            return 0;
+
+        case WM_APP_FOLDER_LOADED:
+            ApplyFolderLoad(hwnd);
+            return 0;
+
+        case WM_APP_MANIFEST_STALE:
+            // The manifest the popup was built from no longer matches the disk
+            AcquireSRWLockExclusive(&g_watcher.lock);
+            PushFolderDelta(&g_watcher, DELTA_RESCAN, NULL, NULL);
+            ReleaseSRWLockExclusive(&g_watcher.lock);
+            SetTimer(hwnd, ID_TIMER_REFRESH, REFRESH_COALESCE_MS, NULL);
             return 0;
 
         case WM_DESTROY:
-            if (g_imageList) {
+            // Launch outcomes after the popup closes go to the resident window
+            LaunchQueueSetNotify(g_hwndResident);
+            PrefetchCancel();
+            ManifestCheckCancel();
+            FolderWatcherStop();
+            IconLoaderStop(ICON_LOADER_CLOSE_WAIT_MS);
+            FilterClear(&g_filter);
+            PaintCacheFree(&g_paint);
+            if (!ResidentStashModel() && g_imageList) {
                 ImageList_Destroy(g_imageList);
                 g_imageList = NULL;
+                IconSlotFree(&g_iconSlots);
+            }
+            FolderLoadCancel();
+            g_hwndMain = NULL;
+            g_hwndListView = NULL;
+            g_hwndTooltip = NULL;
+            if (!g_isResident) {
+                PostQuitMessage(0);
+            }
+            return 0;
+    }
+
+    return DefWindowProcW(hwnd, msg, wParam, lParam);
+}
+
+static void ShowPopup(HINSTANCE hInstance) {
+    if (g_hwndMain) {
+        DestroyWindow(g_hwndMain);
+    }
+
+    g_opacity = 0;
+    g_isClosing = FALSE;
+    g_hoverIndex = -1;
+    g_clickedIndex = -1;
+    g_clickAnimAlpha = 255;
+    g_clickAnimFading = TRUE;
+
+    // Created on the cursor's monitor so WM_CREATE sees that monitor's DPI;
+    // PositionWindow sets the real position and size
+    POINT cursorPos;
+    GetCursorPos(&cursorPos);
+    g_hwndMain = CreateWindowExW(
+        WS_EX_LAYERED | WS_EX_TOOLWINDOW | WS_EX_TOPMOST,
+        L"FolderIconClass", L"FolderIcon",
+        WS_POPUP,
+        cursorPos.x, cursorPos.y, WINDOW_WIDTH, WINDOW_HEIGHT,
+        NULL, NULL, hInstance, NULL);
+
+    ShowWindow(g_hwndMain, SW_SHOW);
+    SetForegroundWindow(g_hwndMain);
+    UpdateWindow(g_hwndMain);
+}
+
+// Resident server. The first instance started with --resident stays alive
+// behind a message-only window; later launches hand it their command line
+// over WM_COPYDATA and exit before doing any UI work.
+#define RESIDENT_CLASS_NAME L"FolderIconResidentClass"
+#define RESIDENT_PROTOCOL_VERSION 1
+#define WM_APP_RESIDENT_OPEN (WM_APP + 3)
+
+typedef struct ResidentRequest {
+    DWORD version;
+    ULONGLONG launchTime;
+    WCHAR szCurrentDir[MAX_PATH];
+    WCHAR szCommandLine[1];     // Variable length, NUL-terminated
+} ResidentRequest;
+
+static ResidentRequest* g_pendingRequest = NULL;
+
+static LRESULT CALLBACK ResidentWndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
+    switch (msg) {
+        case WM_COPYDATA: {
+            // Copy and return at once so the client can exit; the popup is
+            // opened from the posted message
+            const COPYDATASTRUCT* cds = (const COPYDATASTRUCT*)lParam;
+            if (cds->dwData != RESIDENT_PROTOCOL_VERSION || cds->cbData < sizeof(ResidentRequest) ||
+                cds->cbData > sizeof(ResidentRequest) + 32768 * sizeof(WCHAR)) {
+                return FALSE;
+            }
+
+            ResidentRequest* request = malloc(cds->cbData + sizeof(WCHAR));
+            if (!request) return FALSE;
+            memcpy(request, cds->lpData, cds->cbData);
+            request->szCurrentDir[MAX_PATH - 1] = L'\0';
+            ((WCHAR*)((BYTE*)request + cds->cbData))[0] = L'\0';
+
+            free(g_pendingRequest);
+            g_pendingRequest = request;
+            PostMessageW(hwnd, WM_APP_RESIDENT_OPEN, 0, 0);
+            return TRUE;
+        }
+
+        case WM_APP_RESIDENT_OPEN: {
+            ResidentRequest* request = g_pendingRequest;
+            g_pendingRequest = NULL;
+            if (!request) return 0;
+
+            SetCurrentDirectoryW(request->szCurrentDir);
+            g_launchTime = request->launchTime;
+            g_launchForwarded = TRUE;
+
+            InitializeColors();
+            ParseCommandLine(request->szCommandLine);
+            free(request);
+
+            ShowPopup(GetModuleHandle(NULL));
+            return 0;
+        }
+
+        case WM_APP_LAUNCH_DONE:
+            LaunchQueueReport();
+            return 0;
+
+        case WM_TIMER:
+            if (wParam == ID_TIMER_LAUNCH_WATCHDOG && !LaunchQueueWatchdog()) {
+                KillTimer(hwnd, ID_TIMER_LAUNCH_WATCHDOG);
             }
+            return 0;
+
+        case WM_DESTROY:
             PostQuitMessage(0);
             return 0;
     }
@@ -1015,17 +8491,518 @@ static LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lPara
     return DefWindowProcW(hwnd, msg, wParam, lParam);
 }
 
+// Sends this launch to a running resident instance. Returns TRUE when the
+// server accepted it and this process should exit.
+static BOOL ForwardToResidentInstance(void) {
+    HWND hwndServer = FindWindowExW(HWND_MESSAGE, NULL, RESIDENT_CLASS_NAME, NULL);
+    if (!hwndServer) return FALSE;
+
+    const WCHAR* commandLine = GetCommandLineW();
+    SIZE_T commandLength = wcslen(commandLine);
+    DWORD size = (DWORD)(sizeof(ResidentRequest) + commandLength * sizeof(WCHAR));
+
+    ResidentRequest* request = calloc(1, size);
+    if (!request) return FALSE;
+
+    request->version = RESIDENT_PROTOCOL_VERSION;
+    request->launchTime = GetProcessStartTime();
+    GetCurrentDirectoryW(MAX_PATH, request->szCurrentDir);
+    wmemcpy(request->szCommandLine, commandLine, commandLength + 1);
+
+    // The popup needs to take the foreground from this process
+    DWORD serverProcessId = 0;
+    GetWindowThreadProcessId(hwndServer, &serverProcessId);
+    AllowSetForegroundWindow(serverProcessId);
+
+    COPYDATASTRUCT cds = { RESIDENT_PROTOCOL_VERSION, size, request };
+    DWORD_PTR result = 0;
+    BOOL sent = SendMessageTimeoutW(hwndServer, WM_COPYDATA, 0, (LPARAM)&cds,
+                                    SMTO_ABORTIFHUNG | SMTO_BLOCK, 2000, &result) && result;
+    free(request);
+    return sent;
+}
+
+static BOOL StartResidentServer(HINSTANCE hInstance) {
+    WNDCLASSEXW wc = {0};
+    wc.cbSize = sizeof(wc);
+    wc.lpfnWndProc = ResidentWndProc;
+    wc.hInstance = hInstance;
+    wc.lpszClassName = RESIDENT_CLASS_NAME;
+    if (!RegisterClassExW(&wc)) return FALSE;
+
+    g_hwndResident = CreateWindowExW(0, RESIDENT_CLASS_NAME, L"", 0, 0, 0, 0, 0,
+                                     HWND_MESSAGE, NULL, hInstance, NULL);
+    return g_hwndResident != NULL;
+}
+
+// Headless benchmark (--bench [count]). Generates a synthetic launcher
+// folder in %TEMP% and times the non-GUI startup path phase by phase:
+// enumeration with hidden-file filtering, shortcut detection, shortcut
+// resolution, sorting and desktop.ini lookups. Allocation counts come from
+// the debug CRT's allocation hook, so they are only reported by Debug builds.
+#define BENCH_DEFAULT_COUNT 500
+#define BENCH_ITERATIONS 5
+#define BENCH_MANIFEST_WRITES 200
+
+static volatile LONG g_benchAllocations = 0;
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+static int __cdecl BenchAllocHook(int allocType, void* userData, size_t size, int blockType,
+                                  long requestNumber, const unsigned char* fileName, int lineNumber) {
+    (void)userData; (void)size; (void)blockType; (void)requestNumber; (void)fileName; (void)lineNumber;
+    if (allocType == _HOOK_ALLOC || allocType == _HOOK_REALLOC) {
+        InterlockedIncrement(&g_benchAllocations);
+    }
+    return TRUE;
+}
+#endif
+
+static BOOL BenchWriteFile(const WCHAR* path, const char* contents, DWORD attributes) {
+    HANDLE hFile = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, attributes, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return FALSE;
+
+    DWORD written = 0;
+    DWORD length = contents ? (DWORD)strlen(contents) : 0;
+    BOOL ok = !length || WriteFile(hFile, contents, length, &written, NULL);
+    CloseHandle(hFile);
+    return ok;
+}
+
+static BOOL BenchWriteShortcut(const WCHAR* shortcutPath, const WCHAR* targetPath) {
+    IShellLinkW* pShellLink = NULL;
+    IPersistFile* pPersistFile = NULL;
+    BOOL success = FALSE;
+
+    if (FAILED(CoCreateInstance(&CLSID_ShellLink, NULL, CLSCTX_INPROC_SERVER,
+                                &IID_IShellLinkW, (void**)&pShellLink))) {
+        return FALSE;
+    }
+    pShellLink->lpVtbl->SetPath(pShellLink, targetPath);
+    pShellLink->lpVtbl->SetArguments(pShellLink, L"--bench-argument");
+    if (SUCCEEDED(pShellLink->lpVtbl->QueryInterface(pShellLink, &IID_IPersistFile, (void**)&pPersistFile))) {
+        success = SUCCEEDED(pPersistFile->lpVtbl->Save(pPersistFile, shortcutPath, TRUE));
+        pPersistFile->lpVtbl->Release(pPersistFile);
+    }
+    pShellLink->lpVtbl->Release(pShellLink);
+    return success;
+}
+
+// Fixture layout for count N: N plain files, N shortcuts to them, N long
+// names, N non-ASCII names, N/10 hidden files (filtered out) and N/10
+// subfolders cycling through the desktop.ini variants GetFolderIconLocation
+// understands.
+static BOOL BenchCreateFixtures(const WCHAR* root, int count) {
+    static const char* iniVariants[] = {
+        "[.ShellClassInfo]\r\nIconResource=C:\\Windows\\System32\\shell32.dll,4\r\n",
+        "[ViewState]\r\nIconResource=icons\\folder.ico\r\n",
+        "[.ShellClassInfo]\r\nIconFile=%SystemRoot%\\System32\\imageres.dll\r\nIconIndex=12\r\n",
+        "[.ShellClassInfo]\r\nInfoTip=No icon here\r\n",
+        "\xEF\xBB\xBF; UTF-8\r\n[.ShellClassInfo]\r\nIconResource = \"Ic\xC3\xB4nes\\folder.ico\" , -101\r\n",
+    };
+    WCHAR path[MAX_PATH], target[MAX_PATH];
+
+    if (!CreateDirectoryW(root, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) return FALSE;
+
+    for (int i = 0; i < count; i++) {
+        swprintf_s(target, MAX_PATH, L"%s\\App %d.txt", root, i);
+        if (!BenchWriteFile(target, NULL, FILE_ATTRIBUTE_NORMAL)) return FALSE;
+
+        swprintf_s(path, MAX_PATH, L"%s\\App %d.lnk", root, i);
+        if (!BenchWriteShortcut(path, target)) return FALSE;
+
+        swprintf_s(path, MAX_PATH, L"%s\\%d %.*s.txt", root, i, 160,
+                   L"A very long launcher entry name that keeps going well past what fits in a grid cell "
+                   L"so that truncation, tooltips and path buffers all get exercised by the benchmark run");
+        BenchWriteFile(path, NULL, FILE_ATTRIBUTE_NORMAL);
+
+        swprintf_s(path, MAX_PATH, L"%s\\\x00DC" L"bersicht \x65E5\x672C\x8A9E %d \x0424\x0430\x0439\x043B.txt", root, i);
+        BenchWriteFile(path, NULL, FILE_ATTRIBUTE_NORMAL);
+
+        if (i % 10 == 0) {
+            swprintf_s(path, MAX_PATH, L"%s\\hidden %d.txt", root, i);
+            BenchWriteFile(path, NULL, FILE_ATTRIBUTE_HIDDEN);
+
+            swprintf_s(path, MAX_PATH, L"%s\\Folder %d", root, i);
+            CreateDirectoryW(path, NULL);
+            swprintf_s(path, MAX_PATH, L"%s\\Folder %d\\desktop.ini", root, i);
+            BenchWriteFile(path, iniVariants[(i / 10) % 5], FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM);
+        }
+    }
+    return TRUE;
+}
+
+// A tree of count directories for the recursive walk, eight subfolders per
+// folder breadth first, two files in each.
+static BOOL BenchCreateTree(const WCHAR* root, int count) {
+    WCHAR** paths = calloc(count, sizeof(WCHAR*));
+    if (!paths) return FALSE;
+
+    WCHAR path[MAX_PATH];
+    paths[0] = _wcsdup(root);
+    BOOL ok = paths[0] && CreateDirectoryW(root, NULL);
+    for (int i = 0, parent = 0; ok && i < count; i++) {
+        if (i > 0) {
+            parent = (i - 1) / 8;
+            swprintf_s(path, MAX_PATH, L"%s\\Category %d", paths[parent], i);
+            paths[i] = _wcsdup(path);
+            ok = paths[i] && CreateDirectoryW(path, NULL);
+        }
+        for (int f = 0; ok && f < 2; f++) {
+            swprintf_s(path, MAX_PATH, L"%s\\Tool %d.txt", paths[i], f);
+            ok = BenchWriteFile(path, NULL, FILE_ATTRIBUTE_NORMAL);
+        }
+    }
+
+    for (int i = 0; i < count; i++) free(paths[i]);
+    free(paths);
+    return ok;
+}
+
+static void BenchDeleteFixtures(const WCHAR* root) {
+    WCHAR from[MAX_PATH + 1] = {0};  // Double null terminated
+    wcscpy_s(from, MAX_PATH, root);
+
+    SHFILEOPSTRUCTW op = {0};
+    op.wFunc = FO_DELETE;
+    op.pFrom = from;
+    op.fFlags = FOF_NO_UI;
+    SHFileOperationW(&op);
+}
+
+typedef struct BenchPhase {
+    const char* name;
+    LONGLONG bestTicks;
+    LONGLONG totalTicks;
+    LONG allocations;       // Per iteration, from the last run
+    int work;               // Items processed per iteration
+} BenchPhase;
+
+static void BenchRecord(BenchPhase* phase, LONGLONG start, LONG allocationsBefore, int work) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    LONGLONG ticks = now.QuadPart - start;
+
+    if (!phase->bestTicks || ticks < phase->bestTicks) phase->bestTicks = ticks;
+    phase->totalTicks += ticks;
+    phase->allocations = g_benchAllocations - allocationsBefore;
+    phase->work = work;
+}
+
+static LONGLONG BenchNow(void) {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Returns the whole file as a malloc'd buffer, or NULL
+static BYTE* BenchReadFile(const WCHAR* path, SIZE_T* size) {
+    HANDLE hFile = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) return NULL;
+
+    BYTE* data = NULL;
+    LARGE_INTEGER fileSize;
+    if (GetFileSizeEx(hFile, &fileSize) && fileSize.QuadPart <= 64 * 1024 * 1024) {
+        *size = (SIZE_T)fileSize.QuadPart;
+        data = malloc(max(*size, 1));
+        DWORD read = 0;
+        if (data && (!ReadFile(hFile, data, (DWORD)*size, &read, NULL) || read != *size)) {
+            free(data);
+            data = NULL;
+        }
+    }
+    CloseHandle(hFile);
+    return data;
+}
+
+typedef struct BenchManifestWriter {
+    const WCHAR* path;
+    const BYTE* data;
+    SIZE_T size;
+    int replaced;
+} BenchManifestWriter;
+
+static DWORD WINAPI BenchManifestWriterThread(LPVOID param) {
+    BenchManifestWriter* writer = (BenchManifestWriter*)param;
+    for (int i = 0; i < BENCH_MANIFEST_WRITES; i++) {
+        if (ManifestWriteFile(writer->path, writer->data, writer->size)) writer->replaced++;
+    }
+    return 0;
+}
+
+// Two threads replace the folder's manifest with different listings while
+// this one keeps reading it, as when several popups open the folder at
+// once. Every read, and the manifest left at the end, must validate and hold
+// one of the two listings.
+static BOOL BenchManifestWriters(const WCHAR* folderPath, int* replaced, int* reads) {
+    *replaced = 0;
+    *reads = 0;
+    WCHAR path[MAX_PATH];
+    FILETIME lastWrite;
+    DWORD folderEntries;
+    if (!GetManifestPath(folderPath, path) || !GetFolderLastWrite(folderPath, &lastWrite) ||
+        !CountFolderEntries(folderPath, &folderEntries)) {
+        return FALSE;
+    }
+    ULONGLONG folderLastWrite = ((ULONGLONG)lastWrite.dwHighDateTime << 32) | lastWrite.dwLowDateTime;
+
+    // The manifest the background check wrote, and the same minus its last item
+    SIZE_T size = 0, shorterSize = 0;
+    BYTE* data = BenchReadFile(path, &size);
+    if (!data || !ManifestValidate(data, size, folderPath, folderLastWrite, folderEntries, g_listingRules.hash)) {
+        free(data);
+        return FALSE;
+    }
+    const ManifestHeader* header = (const ManifestHeader*)data;
+    const ManifestEntry* entries = (const ManifestEntry*)(data + sizeof(ManifestHeader));
+    const WCHAR* strings = (const WCHAR*)(entries + header->entryCount);
+    DWORD count = header->entryCount;
+    ManifestItem* items = malloc(max(count, 1) * sizeof(ManifestItem));
+    BYTE* shorter = NULL;
+    if (items && count > 0) {
+        for (DWORD i = 0; i < count; i++) {
+            items[i].name = strings + entries[i].nameOffset;
+            items[i].target = entries[i].targetOffset == MANIFEST_NO_TARGET ? NULL : strings + entries[i].targetOffset;
+            items[i].attributes = entries[i].attributes;
+        }
+        shorter = ManifestBuild(strings, header->folderLastWrite, header->folderEntries, header->rulesHash,
+                                (int)header->sortMode, items, (int)count - 1, &shorterSize);
+    }
+    free(items);
+
+    BenchManifestWriter writers[2] = { { path, data, size, 0 }, { path, shorter, shorterSize, 0 } };
+    HANDLE threads[2] = { NULL, NULL };
+    BOOL ok = shorter != NULL;
+    for (int i = 0; i < 2 && ok; i++) {
+        threads[i] = CreateThread(NULL, 0, BenchManifestWriterThread, &writers[i], 0, NULL);
+        ok = threads[i] != NULL;
+    }
+
+    // A reader may find the file gone for a moment, but never half-written
+    BOOL writing = ok;
+    while (writing) {
+        writing = WaitForMultipleObjects(2, threads, TRUE, 0) == WAIT_TIMEOUT;
+        SIZE_T readSize;
+        BYTE* read = BenchReadFile(path, &readSize);
+        if (read) {
+            (*reads)++;
+            if (!ManifestValidate(read, readSize, folderPath, folderLastWrite, folderEntries, g_listingRules.hash) ||
+                (((const ManifestHeader*)read)->entryCount != count &&
+                 ((const ManifestHeader*)read)->entryCount != count - 1)) {
+                ok = FALSE;
+            }
+            free(read);
+        } else if (!writing) {
+            ok = FALSE;  // Nothing left in place
+        }
+    }
+    for (int i = 0; i < 2; i++) {
+        if (threads[i]) CloseHandle(threads[i]);
+    }
+
+    *replaced = writers[0].replaced + writers[1].replaced;
+    free(shorter);
+    free(data);
+    return ok;
+}
+
+static int RunBenchmark(int count) {
+    OpenConsoleOutput();
+
+    WCHAR tempDir[MAX_PATH], root[MAX_PATH];
+    GetTempPathW(MAX_PATH, tempDir);
+    swprintf_s(root, MAX_PATH, L"%sFolderIconBench-%lu", tempDir, GetCurrentProcessId());
+
+    LONGLONG start = BenchNow();
+    if (!BenchCreateFixtures(root, count)) {
+        ConsolePrint("bench: failed to create fixtures (error %lu)\n", GetLastError());
+        BenchDeleteFixtures(root);
+        return 1;
+    }
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    double msPerTick = 1000.0 / (double)frequency.QuadPart;
+    ConsolePrint("bench: %d fixtures per kind, generated in %.1f ms\n", count, (BenchNow() - start) * msPerTick);
+
+    wcscpy_s(g_folderPath, MAX_PATH, root);
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+    _CrtSetAllocHook(BenchAllocHook);
+#endif
+
+    BenchPhase phases[] = {
+        { "enumerate+filter+sort" }, { "manifest-load" }, { "detect-shortcuts" }, { "resolve-shortcuts" },
+        { "sort" }, { "folder-icon-location" }, { "folder-icon-batch" },
+        { "tree-walk-1-thread" }, { "tree-walk-parallel" },
+    };
+    WCHAR treeRoot[MAX_PATH];
+    swprintf_s(treeRoot, MAX_PATH, L"%s\\Tree", root);
+    start = BenchNow();
+    BOOL haveTree = BenchCreateTree(treeRoot, count);
+    ConsolePrint("bench: %d-directory tree %s in %.1f ms\n", count,
+                 haveTree ? "generated" : "failed", (BenchNow() - start) * msPerTick);
+    ItemStore walkStores[2] = {0};
+    WCHAR buffer[MAX_PATH];
+    int* order = malloc(sizeof(int) * (count * 5 + 16));
+    ULONG random = 0x9E3779B9;
+
+    for (int iteration = 0; iteration < BENCH_ITERATIONS && order; iteration++) {
+        LONG allocations = g_benchAllocations;
+        start = BenchNow();
+        LoadFolderContents(FALSE);
+        BenchRecord(&phases[0], start, allocations, g_store.count);
+
+        // The same listing from the manifest the background check writes
+        if (iteration == 0) {
+            ManifestCheck* check = ManifestCheckSnapshot(NULL);
+            if (check) {
+                check->references = 1;
+                ManifestCheckThread(check);
+            }
+        }
+        int listed = g_store.count;
+        allocations = g_benchAllocations;
+        start = BenchNow();
+        LoadFolderContents(TRUE);
+        BenchRecord(&phases[1], start, allocations, g_store.count);
+        if (g_store.count != listed) {
+            ConsolePrint("bench: manifest lists %d of %d items\n", g_store.count, listed);
+        }
+
+        int shortcuts = 0;
+        allocations = g_benchAllocations;
+        start = BenchNow();
+        for (int i = 0; i < g_store.count; i++) {
+            if (IsShortcut(ItemPath(i))) shortcuts++;
+        }
+        BenchRecord(&phases[2], start, allocations, g_store.count);
+
+        int resolved = 0;
+        allocations = g_benchAllocations;
+        start = BenchNow();
+        for (int i = 0; i < g_store.count; i++) {
+            if (IsShortcut(ItemPath(i)) && ResolveShortcut(ItemPath(i), buffer, MAX_PATH)) resolved++;
+        }
+        BenchRecord(&phases[3], start, allocations, shortcuts);
+        if (resolved != shortcuts) {
+            ConsolePrint("bench: resolved %d of %d shortcuts\n", resolved, shortcuts);
+        }
+
+        // Sort from a shuffled order so every iteration does real work
+        int itemCount = min(g_store.count, count * 5 + 16);
+        for (int i = 0; i < itemCount; i++) order[i] = i;
+        for (int i = itemCount - 1; i > 0; i--) {
+            random ^= random << 13; random ^= random >> 17; random ^= random << 5;
+            int j = (int)(random % (ULONG)(i + 1));
+            int swap = order[i]; order[i] = order[j]; order[j] = swap;
+        }
+        ItemStorePermute(&g_store, order);
+        allocations = g_benchAllocations;
+        start = BenchNow();
+        SortItems();
+        BenchRecord(&phases[4], start, allocations, itemCount);
+
+        int folders = 0, iconIndex;
+        allocations = g_benchAllocations;
+        start = BenchNow();
+        for (int i = 0; i < g_store.count; i++) {
+            if (ItemIsDirectory(i)) {
+                GetFolderIconLocation(ItemPath(i), buffer, &iconIndex);
+                folders++;
+            }
+        }
+        BenchRecord(&phases[5], start, allocations, folders);
+
+        FolderIconRequest* requests = malloc(max(1, folders) * sizeof(FolderIconRequest));
+        if (requests) {
+            int requestCount = 0;
+            for (int i = 0; i < g_store.count; i++) {
+                if (ItemIsDirectory(i)) requests[requestCount++].folderPath = ItemPath(i);
+            }
+            allocations = g_benchAllocations;
+            start = BenchNow();
+            ResolveFolderIcons(requests, requestCount);
+            BenchRecord(&phases[6], start, allocations, requestCount);
+            free(requests);
+        }
+
+        // The same tree walked serially and in parallel must list the same items
+        for (int w = 0; w < 2 && haveTree; w++) {
+            ItemStore* store = &walkStores[w];
+            ItemStoreReset(store);
+            store->rootLength = wcslen(treeRoot);
+            allocations = g_benchAllocations;
+            start = BenchNow();
+            WalkFolderTree(store, treeRoot, RECURSIVE_MAX_DEPTH, w ? WalkThreadCount() : 1, &g_listingRules, NULL);
+            BenchRecord(&phases[7 + w], start, allocations, store->count);
+        }
+        if (haveTree && (walkStores[0].count != walkStores[1].count ||
+                         wmemcmp(walkStores[0].arena, walkStores[1].arena, walkStores[0].arenaLength) != 0)) {
+            ConsolePrint("bench: serial and parallel walks differ\n");
+        }
+    }
+    FreeItemStore(&walkStores[0]);
+    FreeItemStore(&walkStores[1]);
+
+#if defined(_MSC_VER) && defined(_DEBUG)
+    _CrtSetAllocHook(NULL);
+    const char* allocationsNote = "";
+#else
+    const char* allocationsNote = " (allocation counts need a Debug build)";
+#endif
+
+    ConsolePrint("%-24s %8s %10s %10s %10s %8s\n", "phase", "items", "best ms", "avg ms", "us/item", "allocs");
+    for (int i = 0; i < (int)(sizeof(phases) / sizeof(phases[0])); i++) {
+        const BenchPhase* phase = &phases[i];
+        double best = phase->bestTicks * msPerTick;
+        ConsolePrint("%-24s %8d %10.3f %10.3f %10.3f %8ld\n", phase->name, phase->work, best,
+                     phase->totalTicks * msPerTick / BENCH_ITERATIONS,
+                     phase->work ? best * 1000.0 / phase->work : 0.0, phase->allocations);
+    }
+    ConsolePrint("%d iterations, best and average per phase%s\n", BENCH_ITERATIONS, allocationsNote);
+
+    int replaced, reads;
+    BOOL manifestOk = BenchManifestWriters(root, &replaced, &reads);
+    ConsolePrint("bench: 2 manifest writers, %d replaces, %d reads: %s\n", replaced, reads,
+                 manifestOk ? "always valid" : "FAILED");
+
+    free(order);
+    if (g_imageList) {
+        ImageList_Destroy(g_imageList);
+        g_imageList = NULL;
+    }
+    IconSlotFree(&g_iconSlots);
+    FreeItemStore(&g_store);
+    if (GetManifestPath(root, buffer)) DeleteFileW(buffer);
+    BenchDeleteFixtures(root);
+    return manifestOk ? 0 : 1;
+}
+
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLine, int nCmdShow) {
     (void)hPrevInstance;
     (void)lpCmdLine;
     (void)nCmdShow;
 
-    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
-    GetExePath();
+    // Layout and icons follow each monitor's scale (WM_DPICHANGED)
+    SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
 
     // Handle special command line arguments
+    BOOL wantResident = FALSE;
     int argc;
     LPWSTR* argv = CommandLineToArgvW(GetCommandLineW(), &argc);
+    if (argv) {
+        for (int i = 1; i + 1 < argc; i++) {
+            if (wcscmp(argv[i], L"--trace") == 0) {
+                TraceInit(argv[i + 1]);
+            }
+        }
+    }
+
+    LONGLONG traceStart = TraceBegin();
+    CoInitializeEx(NULL, COINIT_APARTMENTTHREADED);
+    TraceEnd("CoInitializeEx", traceStart);
+    GetExePath();
+
     if (argv) {
         for (int i = 1; i < argc; i++) {
             if (wcscmp(argv[i], L"--register") == 0) {
@@ -1051,16 +9028,47 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
                 LocalFree(argv);
                 CoUninitialize();
                 return 0;
+            } else if (wcscmp(argv[i], L"--add-to-taskbar-batch") == 0 && i + 1 < argc) {
+                int result = CreateFolderIconShortcuts(argv[i + 1]);
+                LocalFree(argv);
+                CoUninitialize();
+                return result;
+            } else if (wcscmp(argv[i], L"--bench") == 0) {
+                int count = (i + 1 < argc) ? _wtoi(argv[i + 1]) : 0;
+                int result = RunBenchmark(count > 0 ? count : BENCH_DEFAULT_COUNT);
+                LocalFree(argv);
+                TraceWrite();
+                CoUninitialize();
+                return result;
+            } else if (wcscmp(argv[i], L"--resident") == 0) {
+                wantResident = TRUE;
+            } else if (wcscmp(argv[i], L"--trace") == 0 && i + 1 < argc) {
+                i++;
             }
         }
         LocalFree(argv);
     }
 
+    // A resident instance already has everything warm: hand over and exit
+    if (ForwardToResidentInstance()) {
+        CoUninitialize();
+        return 0;
+    }
+
+    g_launchTime = GetProcessStartTime();
+
+    traceStart = TraceBegin();
     INITCOMMONCONTROLSEX icc = { sizeof(icc), ICC_LISTVIEW_CLASSES };
     InitCommonControlsEx(&icc);
+    TraceEnd("InitCommonControlsEx", traceStart);
 
+    traceStart = TraceBegin();
     InitializeColors();
-    ParseCommandLine();
+    TraceEnd("InitializeColors", traceStart);
+
+    traceStart = TraceBegin();
+    ParseCommandLine(GetCommandLineW());
+    TraceEnd("ParseCommandLine", traceStart);
 
     WNDCLASSEXW wc = {0};
     wc.cbSize = sizeof(wc);
@@ -1071,15 +9079,11 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
     wc.lpszClassName = L"FolderIconClass";
     RegisterClassExW(&wc);
 
-    g_hwndMain = CreateWindowExW(
-        WS_EX_LAYERED | WS_EX_TOOLWINDOW | WS_EX_TOPMOST,
-        L"FolderIconClass", L"FolderIcon",
-        WS_POPUP,
-        0, 0, WINDOW_WIDTH, WINDOW_HEIGHT,
-        NULL, NULL, hInstance, NULL);
+    if (wantResident) {
+        g_isResident = StartResidentServer(hInstance);
+    }
 
-    ShowWindow(g_hwndMain, SW_SHOW);
-    UpdateWindow(g_hwndMain);
+    ShowPopup(hInstance);
 
     MSG msg;
     while (GetMessageW(&msg, NULL, 0, 0)) {
@@ -1087,6 +9091,11 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
         DispatchMessageW(&msg);
     }
 
+    // A launch clicked just before the popup faded may still be starting
+    LaunchQueueStop();
+    LaunchQueueReport();
+
+    TraceWrite();
     CoUninitialize();
     return (int)msg.wParam;
 }